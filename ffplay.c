@@ -28,8 +28,25 @@
 #include <limits.h>
 #include <signal.h>
 #include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #include <libavutil/avstring.h>
+#include <libavutil/crc.h>
 #include <libavutil/eval.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/pixdesc.h>
@@ -83,6 +100,8 @@ const char program_name[] = "ffplay";
 
 /* polls for possible required screen refresh at least this often, should be less than 1/fps */
 #define REFRESH_RATE 0.01
+/* refresh rate used while waiting for the first frame after a seek with -fast_seek */
+#define SEEK_REFRESH_RATE 0.001
 
 /* NOTE: the size must be big enough to compensate the hardware audio buffersize size */
 /* TODO: We assume that a decoded and resampled frame fits into this buffer */
@@ -96,8 +115,33 @@ typedef struct MyAVPacketList {
 	int serial;
 } MyAVPacketList;
 
+/**
+ * Ring of packet payloads, filled in queue order and reclaimed in the same
+ * order as the packets are released. A packet released out of order only
+ * has its block marked, the space comes back once the older ones go too.
+ */
+#define ARENA_ALIGN 64
+
+typedef struct ArenaBlock {
+	uint32_t size;          /* including this header, ARENA_ALIGN bytes */
+	uint32_t released;
+} ArenaBlock;
+
+typedef struct PacketArena {
+	uint8_t *buf;
+	int64_t size;
+	int64_t head;           /* bytes handed out so far */
+	int64_t tail;           /* start of the oldest block in use */
+	int live;               /* blocks not released yet */
+	int closed;             /* the queue is gone, the last block frees the arena */
+	int64_t nb_arena;       /* packets stored in the arena */
+	int64_t nb_heap;        /* packets that did not fit and stayed on the heap */
+	SDL_mutex *mutex;
+} PacketArena;
+
 typedef struct PacketQueue {
 	MyAVPacketList *first_pkt, *last_pkt;
+	PacketArena *arena;
 	int nb_packets;
 	int size;
 	int64_t duration;
@@ -135,9 +179,14 @@ typedef struct Frame {
 	AVFrame *frame;
 	int serial;
 	double pts;           /* presentation timestamp for the frame */
-	double duration;      /* estimated duration of the frame */
+	double duration;      /* estimated duration, see estimate_frame_duration() */
 	int64_t pos;          /* byte position of the frame in the input file */
 	SDL_Texture *bmp;
+	SDL_Texture **tiles;    /* grid of textures if the picture exceeds the renderer limits, bmp is tiles[0] */
+	int tiles_x, tiles_y;
+	int tile_w, tile_h;
+	uint64_t tiles_uploaded;
+	SDL_Rect uploaded_rect; /* part of the picture in the texture */
 	int allocated;
 	int width;
 	int height;
@@ -154,11 +203,16 @@ typedef struct FrameQueue {
 	int max_size;
 	int keep_last;
 	int rindex_shown;
+	int limit;              /* max_size or less under memory pressure */
+	int64_t frame_bytes;    /* size of the last queued frame */
 	SDL_mutex *mutex;
 	SDL_cond *cond;
 	PacketQueue *pktq;
 } FrameQueue;
 
+/* packets a skip_frame setting may have discarded, see decoder_take_skipped() */
+#define DECODER_SKIPPED_MAX 32
+
 typedef struct Decoder {
 	AVPacket pkt;
 	AVPacket pkt_temp;
@@ -172,90 +226,229 @@ typedef struct Decoder {
 	AVRational start_pts_tb;
 	int64_t next_pts;
 	AVRational next_pts_tb;
+	int64_t flush_time;   /* time of the last flush, for the seek statistics */
+	int bypass_format;    /* format of an uncompressed stream whose packets are used as frames, or -1 */
+	int64_t skipped_pts[DECODER_SKIPPED_MAX];   /* ascending */
+	int nb_skipped;
+	struct IntraPool *intra;
 	SDL_Thread *decoder_tid;
 } Decoder;
 
+/* frame parallel decoding of intra-only codecs, see intra_pool_open() */
+enum IntraJobState {
+	INTRA_JOB_FREE, INTRA_JOB_QUEUED, INTRA_JOB_BUSY, INTRA_JOB_DONE
+};
+
+typedef struct IntraJob {
+	AVPacket pkt;         /* a NULL packet is the end of stream marker */
+	AVFrame *frame;
+	int got_frame;
+	int eof;
+	int serial;
+	int state;
+} IntraJob;
+
+typedef struct IntraWorker {
+	struct IntraPool *pool;
+	AVCodecContext *avctx;
+	SDL_Thread *tid;
+} IntraWorker;
+
+typedef struct IntraPool {
+	IntraWorker *workers;
+	int nb_workers;
+	IntraJob *jobs;       /* ring of jobs in submission order */
+	int nb_jobs;
+	int head;             /* next job to submit */
+	int next;             /* next job for a worker to take */
+	int tail;             /* next job to return */
+	int nb_queued;
+	int nb_pending;       /* submitted but not yet returned */
+	int abort;
+	PacketQueue *queue;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	SDL_cond *done_cond;
+} IntraPool;
+
+enum SeekStage {
+	SEEK_STAGE_REQUEST,        /* stream_seek() */
+	SEEK_STAGE_SEEK,           /* avformat_seek_file() returned */
+	SEEK_STAGE_FLUSH,          /* packet queues flushed */
+	SEEK_STAGE_DECODER_FLUSH,  /* video decoder flushed */
+	SEEK_STAGE_KEYFRAME,       /* first frame of the new serial decoded */
+	SEEK_STAGE_FILTER,         /* filter graph (re)configured */
+	SEEK_STAGE_UPLOAD,         /* first frame uploaded to its texture */
+	SEEK_STAGE_PRESENT,        /* first frame presented */
+	SEEK_STAGE_NB
+};
+
+/* seek-to-first-frame latency, broken down into the pipeline stages */
+typedef struct SeekStats {
+	SDL_mutex *mutex;          /* stages are marked by the main, read and video threads */
+	int64_t t[SEEK_STAGE_NB];  /* time each stage was reached, 0 if not yet */
+	int active;                /* a seek is in flight */
+	int serial;                /* video queue serial of the seek, -1 until flushed */
+
+	int nb_seeks;
+	int64_t total[SEEK_STAGE_NB];  /* sums and maxima of the time spent in each stage */
+	int64_t max[SEEK_STAGE_NB];
+} SeekStats;
+
+enum ShowMode {
+	SHOW_MODE_NONE = -1, SHOW_MODE_VIDEO = 0, SHOW_MODE_WAVES, SHOW_MODE_RDFT, SHOW_MODE_NB
+};
+
+/*
+ * -aclock_filter: a least squares line through the audio positions reported
+ * at the last callbacks, so that their scheduling jitter does not reach
+ * audclk. Positions are fitted relative to the callback times, the slope is
+ * the drift of the sound card against the system clock and becomes the
+ * clock speed.
+ */
+#define ACLOCK_WINDOW_MAX 256
+#define ACLOCK_MIN_POINTS 4
+/* a callback gap or a position off the line by more than this restarts the fit */
+#define ACLOCK_MAX_GAP 1.0
+#define ACLOCK_MAX_ERROR AV_SYNC_THRESHOLD_MAX
+/* sound cards do not drift further than this from the system clock */
+#define ACLOCK_MAX_DRIFT 0.005
+
+typedef struct AudioClockFilter {
+	double x[ACLOCK_WINDOW_MAX];  /* callback times relative to base */
+	double y[ACLOCK_WINDOW_MAX];  /* position minus callback time */
+	int nb, index;
+	int serial;
+	double base;
+	double last_time;
+	double offset, slope, mean_x; /* current line */
+
+	/* how far each update moves the clock from where it was heading */
+	double last_raw, last_out, last_speed;
+	double raw_step2, out_step2;
+	int64_t nb_steps;
+	int nb_resets;
+} AudioClockFilter;
+
+/*
+ * Duration of each picture for vp_duration() when the pts of the next one
+ * cannot tell it (end of the queue, missing or discontinuous timestamps):
+ * the packet duration when the container stores one, otherwise the last pts
+ * step of the same serial, which follows variable frame rate sources, and
+ * the guessed frame rate only before the second picture.
+ */
+typedef struct DurationEstimate {
+	double last_pts;      /* pts of the previous picture, queued or dropped, NAN if none */
+	double step;          /* last usable pts step, 0 if none yet */
+	int serial;
+} DurationEstimate;
+
+/* the fields are grouped by the thread that writes them, cold data last */
 typedef struct VideoState {
-	SDL_Thread *read_tid;
-	AVInputFormat *iformat;
+	/* set by the main thread, cleared by the read thread */
 	int abort_request;
-	int force_refresh;
 	int queue_attachments_req;
+	int reconfig_req;       /* reopen the streams, see soak_poll() */
 	int seek_req;
 	int seek_flags;
 	int64_t seek_pos;
 	int64_t seek_rel;
+
+	/* read thread */
+	int eof;
 	int read_pause_return;
 	AVFormatContext *ic;
+	int audio_stream;
+	int video_stream;
+	AVStream *audio_st;
+	AVStream *video_st;
 
-	Clock audclk;
-	Clock vidclk;
-	Clock extclk;
-
+	/* the queues are written from both ends */
+	PacketQueue audioq;
+	PacketQueue videoq;
 	FrameQueue pictq;
 	FrameQueue sampq;
 
-	Decoder auddec;
+	/* video decoder thread */
 	Decoder viddec;
+	int frame_drops_early;
+	DurationEstimate frame_dur;
+	int64_t decode_time;    /* wall clock time spent decoding, for -abr */
+	int nb_decoded;
+	int skipping_nonref;    /* the decoder discards non-reference frames, see get_video_frame() */
+	int nb_nonref_skips;
+	double frame_last_returned_time;
+	double frame_last_filter_delay;
+	int vfilter_idx;
+	AVFilterContext *in_video_filter;   // the first filter in the video chain
+	AVFilterContext *out_video_filter;  // the last filter in the video chain
 
-	int audio_stream;
+	/* audio decoder thread */
+	Decoder auddec;
+	struct AudioParams audio_filter_src;
+	AVFilterContext *in_audio_filter;   // the first filter in the audio chain
+	AVFilterContext *out_audio_filter;  // the last filter in the audio chain
+	AVFilterGraph *agraph;              // audio filter graph
 
+	/* audio callback */
+	Clock audclk;
 	double audio_clock;
 	int audio_clock_serial;
-	AVStream *audio_st;
-	PacketQueue audioq;
-	int audio_hw_buf_size;
 	uint8_t *audio_buf;
-	uint8_t *audio_buf1;
 	unsigned int audio_buf_size; /* in bytes */
-	unsigned int audio_buf1_size;
 	int audio_buf_index; /* in bytes */
 	int audio_write_buf_size;
-	int audio_volume;
+	AudioClockFilter aclock;
+	uint8_t *audio_buf1;
+	unsigned int audio_buf1_size;
 	struct AudioParams audio_src;
-	struct AudioParams audio_filter_src;
-	struct AudioParams audio_tgt;
 	struct SwrContext *swr_ctx;
-	int frame_drops_early;
-	int frame_drops_late;
-
-	enum ShowMode {
-		SHOW_MODE_NONE = -1, SHOW_MODE_VIDEO = 0, SHOW_MODE_WAVES, SHOW_MODE_RDFT, SHOW_MODE_NB
-	} show_mode;
-	int16_t sample_array[SAMPLE_ARRAY_SIZE];
 	int sample_array_index;
-	int last_i_start;
-	RDFTContext *rdft;
-	int rdft_bits;
-	FFTSample *rdft_data;
-	int xpos;
+
+	/* main thread */
+	Clock vidclk;
+	double frame_timer;
+	double zoom;            /* 1 shows the whole picture */
+	double zoom_cx, zoom_cy;        /* center of the viewport, in fractions of the picture */
+	int force_refresh;
+	int still_image;        /* the video is a still picture already uploaded, see video_refresh() */
+	int frame_drops_late;
+	int frames_presented;
+	/* frame pacing, for -stats: compute_target_delay() results and how
+	   late each picture was taken against frame_timer */
+	double pacing_delay_sum, pacing_delay_sum2, pacing_err2;
+	int nb_paced;
+	int audio_volume;
 	double last_vis_time;
+	int xpos;
+	struct SwsContext *img_convert_ctx;
+	struct SwsContext *sub_convert_ctx;
 	SDL_Texture *vis_texture;
 	SDL_Texture *sub_texture;
 
-	double frame_timer;
-	double frame_last_returned_time;
-	double frame_last_filter_delay;
-	int video_stream;
-	AVStream *video_st;
-	PacketQueue videoq;
+	/* set up once, read by every thread */
+	enum ShowMode show_mode;
+	int audio_hw_buf_size;
+	struct AudioParams audio_tgt;
 	// maximum duration of a frame - above this, we consider the jump a timestamp discontinuity
 	double max_frame_duration;
-	struct SwsContext *img_convert_ctx;
-	struct SwsContext *sub_convert_ctx;
-	int eof;
+	SDL_cond *continue_read_thread;
+
+	/* written by several threads: extclk follows the audio callback, the
+	   main thread and seeks, seek_stats is marked along the whole pipeline */
+	Clock extclk;
+	SeekStats seek_stats;
 
+	/* cold */
+	SDL_Thread *read_tid;
+	AVInputFormat *iformat;
 	char *filename;
 	int width, height;
-
-	int vfilter_idx;
-	AVFilterContext *in_video_filter;   // the first filter in the video chain
-	AVFilterContext *out_video_filter;  // the last filter in the video chain
-	AVFilterContext *in_audio_filter;   // the first filter in the audio chain
-	AVFilterContext *out_audio_filter;  // the last filter in the audio chain
-	AVFilterGraph *agraph;              // audio filter graph
-
-	SDL_cond *continue_read_thread;
+	int16_t sample_array[SAMPLE_ARRAY_SIZE];
+	int last_i_start;
+	RDFTContext *rdft;
+	int rdft_bits;
+	FFTSample *rdft_data;
 } VideoState;
 
 /* options specified by the user */
@@ -275,7 +468,38 @@ static int framedrop = -1;
 static int infinite_buffer = -1;
 double rdftspeed = 0.02;
 static const char **vfilters_list = NULL;
+static const char *vfilters;
 static char *afilters = NULL;
+static const char *export_video;
+static const char *export_audio;
+static int export_raw;
+static const char *framecrc;
+static int deterministic;
+static const char *shm_name;
+static int shm_slots = 8;
+static int pipe_buffer = 64;
+static const char *cache_dir;
+static int abr_enabled;
+static int sw_output = -1;
+static int packet_arena_size;
+static int frame_pool_enabled;
+static int hugepages;
+static int mem_budget_size;
+static double mem_psi = 10.0;
+static int cache_size = 1024;
+static const char *scenario_file;
+static const char *scenario_report;
+static int fast_seek;
+static double soak_duration;
+static double soak_seek_interval = 10.0;
+static double soak_reconfig_interval = 60.0;
+static double soak_sample_interval = 10.0;
+static double soak_max_growth = 1024.0;
+static double stats_interval = -1;
+static int intra_threads;
+static int perf_counters;
+static int aclock_filter;
+static int nonref_skip;
 
 /* current context */
 static int64_t audio_callback_time;
@@ -287,6 +511,398 @@ static AVPacket flush_pkt;
 
 static SDL_Window *window;
 static SDL_Renderer *renderer;
+static SDL_RendererInfo renderer_info;
+
+/* scripted interaction, see scenario_load() for the file format */
+enum ScenarioActionType {
+	SCENARIO_SEEK, SCENARIO_SEEK_REL, SCENARIO_KEY, SCENARIO_RESIZE, SCENARIO_VOLUME,
+	SCENARIO_QUIT
+};
+
+enum ScenarioWait {
+	SCENARIO_WAIT_NONE,     /* the action has no observable completion */
+	SCENARIO_WAIT_SERIAL,   /* done when a frame of a new queue serial is presented */
+	SCENARIO_WAIT_RESIZE,   /* done when a frame is presented at the new size */
+};
+
+typedef struct ScenarioAction {
+	double time;          /* scheduled time in seconds since the scenario started */
+	enum ScenarioActionType type;
+	double arg;           /* seek target or offset, key hold time, volume steps */
+	int key;
+	int width, height;
+
+	enum ScenarioWait wait;
+	double start_time;    /* time at which the action was actually injected */
+	double latency;       /* seconds until the action took effect, NAN if it never did */
+	int serial;
+	int drops_start;
+	int drops;            /* frames dropped until the next action started */
+} ScenarioAction;
+
+typedef struct Scenario {
+	ScenarioAction *actions;
+	int nb_actions;
+	int next;             /* next action to inject */
+	int pending;          /* action waiting for its completion, -1 if none */
+	double start;         /* wall clock time the scenario started at, NAN before */
+	int held_key;         /* key currently held down by a key action, 0 if none */
+	double hold_end;
+	double next_repeat;
+} Scenario;
+
+static Scenario scenario = { .pending = -1, .start = NAN };
+
+/* long running loop with periodic seeks and stream reconfigurations */
+typedef struct SoakSample {
+	double time;
+	int64_t rss;
+	int64_t heap;         /* bytes allocated from the heap, -1 if unknown */
+} SoakSample;
+
+typedef struct Soak {
+	double start;
+	double next_seek;
+	double next_reconfig;
+	double next_sample;
+	unsigned seed;
+	int nb_seeks;
+	int nb_reconfigs;
+	int64_t baseline_heap;  /* heap in use before the stream was opened */
+	SoakSample *samples;
+	int nb_samples;
+} Soak;
+
+static Soak soak = { .start = NAN };
+
+/* raw output of the decoded frames instead of the SDL window and audio */
+#define EXPORT_IOV_MAX 1024
+
+typedef struct ExportSink {
+	const char *url;
+	int fd;
+	int width, height;    /* geometry of the Y4M stream header */
+	int nb_iov;
+	struct iovec iov[EXPORT_IOV_MAX];
+	int64_t nb_frames;
+	int64_t bytes;
+} ExportSink;
+
+static ExportSink export_video_sink = { .fd = -1 };
+static ExportSink export_audio_sink = { .fd = -1 };
+
+/* -framecrc: a CRC32C per filtered frame instead of its pixels or samples */
+typedef struct FrameCrcLine {
+	int64_t pts;          /* microseconds */
+	int size;
+	uint32_t crc;
+} FrameCrcLine;
+
+/* lines of one stream not written yet, see framecrc_write() */
+typedef struct FrameCrcStream {
+	int index;
+	FrameCrcLine *lines;
+	int head, nb, allocated;
+	int finished;         /* no line will follow until the stream writes again */
+} FrameCrcStream;
+
+static ExportSink framecrc_sink = { .fd = -1 };
+static SDL_mutex *framecrc_mutex;
+static FrameCrcStream framecrc_streams[2];
+static int framecrc_nb_streams;
+static AVCRC crc32c_table[257];
+static int crc32c_hw;
+
+/**
+ * Layout of the -shm frame ring. The header is followed by nb_slots slots
+ * of slot_size bytes, each starting with a ShmSlotHeader and holding the
+ * planes at the given offsets from the slot start.
+ *
+ * Readers never write to the segment, they map it read-only, and the
+ * publisher never waits for them. A reader takes the slot of frame
+ * n = write_seq - 1, that is (n % nb_slots), loads its seq with acquire
+ * semantics, which must be 2 * n + 2, uses the header and planes in place
+ * or copies them out, and then checks seq again after an acquire fence: if
+ * it changed, the slot was overwritten meanwhile and what was read must be
+ * discarded. A reader slower than the publisher only loses frames.
+ *
+ * When the frames outgrow the slots, the publisher sets closed and moves to
+ * a new segment of the same name sized for them. It sets closed on exit as
+ * well. Readers then open the name again.
+ */
+#define SHM_RING_MAGIC        MKTAG('F', 'P', 'R', 'G')
+#define SHM_RING_VERSION      3
+#define SHM_SLOT_HEADER_SIZE  128
+
+typedef struct ShmRingHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nb_slots;
+	uint32_t slot_size;
+	uint32_t data_offset;   /* offset of the first slot */
+	uint32_t closed;        /* nothing more is published to this segment */
+	uint64_t write_seq;     /* number of frames published */
+} ShmRingHeader;
+
+typedef struct ShmSlotHeader {
+	uint64_t seq;           /* 2 * n + 1 while frame n is written, 2 * n + 2 once complete */
+	double pts;
+	double duration;
+	int32_t serial;
+	int32_t format;         /* enum AVPixelFormat */
+	int32_t width, height;
+	int32_t sar_num, sar_den;
+	int32_t linesize[4];
+	uint32_t offset[4];
+} ShmSlotHeader;
+
+typedef struct ShmRing {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	ShmRingHeader *hdr;
+	int disabled;
+} ShmRing;
+
+static ShmRing shm_ring = { .fd = -1 };
+
+/* reader of a shm: input ring, only used by the video decoder thread once attached */
+typedef struct ShmInput {
+	const char *name;
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	ShmRingHeader *hdr;
+	uint32_t nb_slots, slot_size, data_offset;  /* as validated on attach */
+	uint64_t next;          /* next frame to take from the ring */
+} ShmInput;
+
+static ShmInput shm_in = { .fd = -1 };
+
+/* read-ahead ring between a pipe input and the demuxer, see pipe_input_open() */
+#define PIPE_READ_SIZE (1 << 20)
+#define PIPE_IO_SIZE   (64 * 1024)
+
+typedef struct PipeRing {
+	int fd;
+	int own_fd;
+	uint8_t *buf;
+	int64_t size;
+	int64_t write_pos;      /* bytes read from the pipe */
+	int64_t writing;        /* bytes being read into the ring past write_pos */
+	int64_t read_pos;       /* position of the demuxer */
+	int eof;                /* error code once the pipe is done */
+	int abort;
+	VideoState *is;
+	AVIOContext *pb;
+	SDL_Thread *tid;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+} PipeRing;
+
+static PipeRing pipe_in = { .fd = -1 };
+
+/**
+ * On-disk cache of a remote input, see cache_input_open(). The entity is
+ * cached in blocks in a sparse <key>.data file, <key>.map holds the URL,
+ * the entity size and a bitmap of the cached blocks, updated as each block
+ * is written so that a crash loses nothing. A process using an entity holds
+ * a shared flock() on its data file, eviction skips the locked ones.
+ */
+#define CACHE_BLOCK_SIZE (256 * 1024)
+#define CACHE_MAP_MAGIC  "FPCACHE1"
+
+typedef struct CacheInput {
+	AVIOContext *remote;
+	AVIOContext *pb;
+	char *url;
+	char *path;             /* cache_dir/key, without extension */
+	int fd;                 /* the data file */
+	int map_fd;
+	int map_offset;         /* of the bitmap in the map file */
+	int64_t size;           /* size of the entity, its validator with the URL */
+	int64_t pos;
+	uint8_t *map;           /* one bit per cached block */
+	int64_t nb_blocks;
+	int64_t cached;         /* bytes of this entity on disk */
+	int64_t budget;         /* bytes this entity may take on disk */
+	uint8_t *block;         /* last block read from the network */
+	int64_t block_index;
+	int block_len;
+	int64_t disk_bytes;     /* bytes served from the cache */
+	int64_t net_bytes;      /* bytes fetched from the network */
+} CacheInput;
+
+static CacheInput cache_in = { .fd = -1, .map_fd = -1, .block_index = -1 };
+
+/* variant selection of multi-variant (HLS) inputs, see abr_update() */
+#define ABR_CHECK_INTERVAL 1.0
+#define ABR_UP_HOLD        10.0    /* seconds without trouble before switching up */
+#define ABR_BW_MARGIN      0.8     /* part of the measured rate a variant may use */
+#define ABR_DROP_DOWN      0.10    /* drop ratio that switches down */
+#define ABR_DROP_UP        0.01    /* drop ratio below which switching up is allowed */
+#define ABR_DECODE_DOWN    0.9     /* decode time per frame duration that switches down */
+#define ABR_DECODE_UP      0.5     /* decode load below which switching up is allowed */
+#define ABR_IO_SIZE        (32 * 1024)
+
+typedef struct AbrVariant {
+	int64_t bitrate;
+	int video_stream;
+	int audio_stream;
+} AbrVariant;
+
+typedef struct Abr {
+	AbrVariant *variants;   /* sorted by bitrate */
+	int nb_variants;
+	int cur;
+	int pending;            /* variant being switched to, -1 if none */
+	int audio_src;          /* stream whose packets feed the audio decoder */
+	int64_t last_video_ts;  /* last queued packet, in the time base of the decoder's stream */
+	int64_t last_audio_ts;
+	int64_t audio_min_ts;   /* packets of the new audio stream up to this are dropped */
+	int64_t last_decode_time;
+	int last_decoded;
+	double load;            /* video decode time per frame duration */
+	double rate;            /* estimated download rate in bit/s */
+	int64_t io_bytes;       /* read since the last estimate */
+	int64_t io_time;        /* time spent in those reads */
+	double next_check;
+	double last_switch;
+	int last_drops;
+	int last_frames;
+	int nb_switches;
+	int (*io_open)(AVFormatContext *s, AVIOContext **pb, const char *url,
+	               int flags, AVDictionary **options);
+	void (*io_close)(AVFormatContext *s, AVIOContext *pb);
+} Abr;
+
+static Abr abr = { .pending = -1 };
+
+/**
+ * Process-wide memory budget. Every component that holds a notable amount
+ * of memory registers a client reporting its usage; when the total exceeds
+ * -mem_budget or the cgroup reports memory pressure, the clients are asked
+ * to shrink in order of priority, lowest first.
+ */
+#define MEM_CLIENTS_MAX   16
+#define MEM_POLL_INTERVAL 0.5
+#define MEM_QUEUE_MIN     (1024 * 1024)
+
+enum MemPriority {
+	MEM_PRIO_SLACK,         /* buffers larger than they need to be */
+	MEM_PRIO_FRAMES,        /* decoded frames queued ahead */
+	MEM_PRIO_PACKETS,       /* demuxed packets queued ahead */
+	MEM_PRIO_FIXED,         /* accounted for, cannot shrink */
+};
+
+typedef struct MemClient {
+	const char *name;
+	enum MemPriority priority;
+	void *opaque;
+	int64_t (*usage)(void *opaque);
+	/* release about bytes, return the amount expected to be released */
+	int64_t (*shrink)(void *opaque, int64_t bytes);
+	/* lift the restrictions once the pressure is gone */
+	void (*restore)(void *opaque);
+} MemClient;
+
+typedef struct MemBudget {
+	SDL_mutex *mutex;       /* guards the clients, the read thread registers too */
+	MemClient clients[MEM_CLIENTS_MAX];
+	int nb_clients;
+	int psi_fd;
+	int pressure;           /* clients have been shrunk */
+	int64_t usage;          /* total at the last poll */
+	double psi;             /* some avg10 of the last poll */
+	double next_poll;
+	int nb_shrinks;
+	/* set by the main thread, accessed atomically */
+	int queue_limit;        /* packet queue limit of the read thread */
+	int trim_audio_buf;     /* set to let the audio callback reallocate audio_buf1 */
+} MemBudget;
+
+static MemBudget mem_budget = { .psi_fd = -1, .queue_limit = MAX_QUEUE_SIZE };
+
+/* add a client, keeping the list ordered by priority */
+static void mem_budget_register(const char *name, enum MemPriority priority, void *opaque,
+                                int64_t (*usage)(void *opaque),
+                                int64_t (*shrink)(void *opaque, int64_t bytes),
+                                void (*restore)(void *opaque))
+{
+	MemBudget *mb = &mem_budget;
+	int i;
+
+	/* no budget, nothing to account */
+	if (!mb->mutex)
+		return;
+	SDL_LockMutex(mb->mutex);
+	if (mb->nb_clients == MEM_CLIENTS_MAX) {
+		av_log(NULL, AV_LOG_WARNING, "memory budget: too many clients, %s not accounted\n", name);
+	} else {
+		for (i = mb->nb_clients; i > 0 && mb->clients[i - 1].priority > priority; i--)
+			mb->clients[i] = mb->clients[i - 1];
+		mb->clients[i] = (MemClient) {
+			name, priority, opaque, usage, shrink, restore
+		};
+		mb->nb_clients++;
+	}
+	SDL_UnlockMutex(mb->mutex);
+}
+
+/* CPU accounting of the pipeline threads */
+enum ThreadKind {
+	THREAD_READ, THREAD_VIDEO_DECODE, THREAD_AUDIO_DECODE, THREAD_MAIN,
+	THREAD_AUDIO_CALLBACK, THREAD_NB
+};
+
+typedef struct ThreadStats {
+	int64_t start;        /* wall clock time the thread first ran at */
+	int64_t cpu;          /* CPU time used, in microseconds */
+	int64_t cpu_mark;     /* thread CPU clock when cpu was last updated */
+	int64_t blocked;      /* wall clock time spent waiting on queues */
+} ThreadStats;
+
+static ThreadStats thread_stats[THREAD_NB];
+static __thread ThreadStats *cur_thread_stats;
+
+/* hardware counters of the hot regions, see perf_begin() */
+enum PerfCounter {
+	PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_COUNTER_NB
+};
+
+enum PerfRegionId {
+	PERF_REGION_UPLOAD, PERF_REGION_SWS, PERF_REGION_SWR, PERF_REGION_PACKET_GET,
+	PERF_REGION_NB
+};
+
+typedef struct PerfRegion {
+	const char *name;
+	const char *unit;
+	uint64_t count[PERF_COUNTER_NB];
+	uint64_t units;       /* pixels, samples or packets processed in the region */
+	uint64_t calls;
+} PerfRegion;
+
+static PerfRegion perf_regions[PERF_REGION_NB] = {
+	{ "upload_texture", "pixel" },
+	{ "sws_scale", "pixel" },
+	{ "swr_convert", "sample" },
+	{ "packet_queue_get", "packet" },
+};
+
+typedef struct PerfThread {
+	int state;            /* 0 if not opened yet, 1 if counting, -1 if unavailable */
+	int leader;
+	int fd[PERF_COUNTER_NB];
+	int slot[PERF_COUNTER_NB];  /* position of each counter in a group read, -1 if missing */
+	int nb_slots;
+} PerfThread;
+
+static __thread PerfThread perf_thread;
+/* counters of the SDL audio thread, which exits without closing them, see perf_audio_close() */
+static int perf_audio_fd[PERF_COUNTER_NB] = { -1, -1, -1, -1 };
+/* set when a thread had to fall back to the software task clock */
+static int perf_software;
 
 AVDictionary *sws_dict;
 AVDictionary *swr_opts;
@@ -345,1592 +961,5462 @@ int64_t get_valid_channel_layout(int64_t channel_layout, int channels)
 		return 0;
 }
 
-static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+static int64_t thread_cpu_time(void)
 {
-	MyAVPacketList *pkt1;
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0;
+	return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
 
-	if (q->abort_request)
-		return -1;
+/* start accounting the calling thread's CPU time to the given pipeline stage */
+static void thread_stats_enter(enum ThreadKind kind)
+{
+	ThreadStats *ts = &thread_stats[kind];
 
-	pkt1 = av_malloc(sizeof(MyAVPacketList));
-	if (!pkt1)
-		return -1;
-	pkt1->pkt = *pkt;
-	pkt1->next = NULL;
-	if (pkt == &flush_pkt)
-		q->serial++;
-	pkt1->serial = q->serial;
+	cur_thread_stats = ts;
+	ts->cpu_mark = thread_cpu_time();
+	if (!ts->start)
+		ts->start = av_gettime_relative();
+}
 
-	if (!q->last_pkt)
-		q->first_pkt = pkt1;
-	else
-		q->last_pkt->next = pkt1;
-	q->last_pkt = pkt1;
-	q->nb_packets++;
-	q->size += pkt1->pkt.size + sizeof(*pkt1);
-	q->duration += pkt1->pkt.duration;
-	/* XXX: should duplicate packet data in DV case */
-	SDL_CondSignal(q->cond);
-	return 0;
+static void thread_stats_update(void)
+{
+	ThreadStats *ts = cur_thread_stats;
+	int64_t now;
+
+	if (!ts)
+		return;
+	now = thread_cpu_time();
+	ts->cpu += now - ts->cpu_mark;
+	ts->cpu_mark = now;
 }
 
-static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+/* SDL_CondWait() which accounts the time waited as blocked */
+static int cond_wait(SDL_cond *cond, SDL_mutex *mutex)
 {
+	int64_t start;
 	int ret;
 
-	SDL_LockMutex(q->mutex);
-	ret = packet_queue_put_private(q, pkt);
-	SDL_UnlockMutex(q->mutex);
+	thread_stats_update();
+	start = av_gettime_relative();
+	ret = SDL_CondWait(cond, mutex);
 
-	if (pkt != &flush_pkt && ret < 0)
-		av_packet_unref(pkt);
+	if (cur_thread_stats)
+		cur_thread_stats->blocked += av_gettime_relative() - start;
+	return ret;
+}
+
+static int cond_wait_timeout(SDL_cond *cond, SDL_mutex *mutex, Uint32 ms)
+{
+	int64_t start;
+	int ret;
 
+	thread_stats_update();
+	start = av_gettime_relative();
+	ret = SDL_CondWaitTimeout(cond, mutex, ms);
+
+	if (cur_thread_stats)
+		cur_thread_stats->blocked += av_gettime_relative() - start;
 	return ret;
 }
 
-static int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
+#ifdef __linux__
+static int perf_open_counter(uint32_t type, uint64_t config, int group_fd)
 {
-	AVPacket pkt1, *pkt = &pkt1;
-	av_init_packet(pkt);
-	pkt->data = NULL;
-	pkt->size = 0;
-	pkt->stream_index = stream_index;
-	return packet_queue_put(q, pkt);
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* this thread only, on any CPU */
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
 }
 
-/* packet queue handling */
-static int packet_queue_init(PacketQueue *q)
+static void perf_thread_open(PerfThread *pt)
 {
-	memset(q, 0, sizeof(PacketQueue));
-	q->mutex = SDL_CreateMutex();
-	if (!q->mutex) {
-		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
-		return AVERROR(ENOMEM);
+	static const uint64_t hw_config[PERF_COUNTER_NB] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+	};
+	int i;
+
+	for (i = 0; i < PERF_COUNTER_NB; i++) {
+		pt->fd[i] = -1;
+		pt->slot[i] = -1;
 	}
-	q->cond = SDL_CreateCond();
-	if (!q->cond) {
-		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
-		return AVERROR(ENOMEM);
+	pt->nb_slots = 0;
+	pt->state = -1;
+
+	pt->leader = perf_open_counter(PERF_TYPE_HARDWARE, hw_config[0], -1);
+	if (pt->leader >= 0) {
+		pt->fd[PERF_CYCLES] = pt->leader;
+		pt->slot[PERF_CYCLES] = pt->nb_slots++;
+		for (i = 1; i < PERF_COUNTER_NB; i++) {
+			pt->fd[i] = perf_open_counter(PERF_TYPE_HARDWARE, hw_config[i], pt->leader);
+			if (pt->fd[i] >= 0)
+				pt->slot[i] = pt->nb_slots++;
+		}
+	} else {
+		/* containers and VMs often expose no PMU, count nanoseconds instead of cycles */
+		pt->leader = perf_open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+		if (pt->leader < 0) {
+			av_log(NULL, AV_LOG_WARNING, "perf_event_open(): %s\n", strerror(errno));
+			return;
+		}
+		pt->fd[PERF_CYCLES] = pt->leader;
+		pt->slot[PERF_CYCLES] = pt->nb_slots++;
+		perf_software = 1;
 	}
-	q->abort_request = 1;
+	pt->state = 1;
+	if (cur_thread_stats == &thread_stats[THREAD_AUDIO_CALLBACK])
+		memcpy(perf_audio_fd, pt->fd, sizeof(perf_audio_fd));
+}
+
+static int perf_read(PerfThread *pt, uint64_t *v)
+{
+	uint64_t buf[1 + PERF_COUNTER_NB];
+	int i;
+
+	if (read(pt->leader, buf, sizeof(buf)) < (ssize_t)((1 + pt->nb_slots) * sizeof(*buf)))
+		return -1;
+	for (i = 0; i < PERF_COUNTER_NB; i++)
+		v[i] = pt->slot[i] >= 0 ? buf[1 + pt->slot[i]] : 0;
 	return 0;
 }
 
-static void packet_queue_flush(PacketQueue *q)
+/* close the calling thread's counters, must be called before the thread exits */
+static void perf_thread_close(void)
 {
-	MyAVPacketList *pkt, *pkt1;
+	PerfThread *pt = &perf_thread;
+	int i;
 
-	SDL_LockMutex(q->mutex);
-	for (pkt = q->first_pkt; pkt; pkt = pkt1) {
-		pkt1 = pkt->next;
-		av_packet_unref(&pkt->pkt);
-		av_freep(&pkt);
+	if (pt->state > 0)
+		for (i = 0; i < PERF_COUNTER_NB; i++)
+			if (pt->fd[i] >= 0)
+				close(pt->fd[i]);
+	pt->state = 0;
+}
+
+/* close the counters of an audio callback thread that SDL_CloseAudio() has joined */
+static void perf_audio_close(void)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTER_NB; i++) {
+		if (perf_audio_fd[i] >= 0)
+			close(perf_audio_fd[i]);
+		perf_audio_fd[i] = -1;
 	}
-	q->last_pkt = NULL;
-	q->first_pkt = NULL;
-	q->nb_packets = 0;
-	q->size = 0;
-	q->duration = 0;
-	SDL_UnlockMutex(q->mutex);
+}
+#else
+static int perf_read(PerfThread *pt, uint64_t *v)
+{
+	return -1;
 }
 
-static void packet_queue_start(PacketQueue *q)
+static void perf_thread_close(void)
 {
-	SDL_LockMutex(q->mutex);
-	q->abort_request = 0;
-	packet_queue_put_private(q, &flush_pkt);
-	SDL_UnlockMutex(q->mutex);
 }
 
-/* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block,
-                            int *serial)
+static void perf_audio_close(void)
 {
-	MyAVPacketList *pkt1;
-	int ret;
+}
+#endif
 
-	SDL_LockMutex(q->mutex);
+/**
+ * Start counting a hot region on the calling thread. Returns nonzero if
+ * counting, in which case perf_end() must be called with the same values.
+ */
+static int perf_begin(uint64_t *v)
+{
+	PerfThread *pt = &perf_thread;
 
-	while (1) {
-		if (q->abort_request) {
-			ret = -1;
-			break;
-		}
-
-		pkt1 = q->first_pkt;
-		if (pkt1) {
-			q->first_pkt = pkt1->next;
-			if (!q->first_pkt)
-				q->last_pkt = NULL;
-			q->nb_packets--;
-			q->size -= pkt1->pkt.size + sizeof(*pkt1);
-			q->duration -= pkt1->pkt.duration;
-			*pkt = pkt1->pkt;
-			if (serial)
-				*serial = pkt1->serial;
-			av_free(pkt1);
-			ret = 1;
-			break;
-		} else if (!block) {
-			ret = 0;
-			break;
-		} else {
-			SDL_CondWait(q->cond, q->mutex);
-		}
-	}
-	SDL_UnlockMutex(q->mutex);
-	return ret;
+	if (!perf_counters)
+		return 0;
+#ifdef __linux__
+	if (!pt->state)
+		perf_thread_open(pt);
+#endif
+	return pt->state > 0 && !perf_read(pt, v);
 }
 
-static void decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue,
-                         SDL_cond *empty_queue_cond)
+static void perf_end(enum PerfRegionId id, const uint64_t *start, int64_t units)
 {
-	memset(d, 0, sizeof(Decoder));
-	d->avctx = avctx;
-	d->queue = queue;
-	d->empty_queue_cond = empty_queue_cond;
-	d->start_pts = AV_NOPTS_VALUE;
+	PerfRegion *r = &perf_regions[id];
+	uint64_t v[PERF_COUNTER_NB];
+	int i;
+
+	if (perf_read(&perf_thread, v) < 0)
+		return;
+	for (i = 0; i < PERF_COUNTER_NB; i++)
+		__atomic_fetch_add(&r->count[i], v[i] - start[i], __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->units, units, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->calls, 1, __ATOMIC_RELAXED);
 }
 
-static int decoder_decode_frame(Decoder *d, AVFrame *frame)
+static void perf_print_report(void)
 {
-	int got_frame = 0;
-	AVPacket pkt;
-
-	do {
-		int ret = -1;
-
-		if (d->queue->abort_request)
-			return -1;
-
-		if (!d->packet_pending || d->queue->serial != d->pkt_serial) {
-			do {
-				if (d->queue->nb_packets == 0)
-					SDL_CondSignal(d->empty_queue_cond);
-				if (packet_queue_get(d->queue, &pkt, 1, &d->pkt_serial) < 0)
-					return -1;
-				if (pkt.data == flush_pkt.data) {
-					avcodec_flush_buffers(d->avctx);
-					d->finished = 0;
-					d->next_pts = d->start_pts;
-					d->next_pts_tb = d->start_pts_tb;
-				}
-			} while (pkt.data == flush_pkt.data || d->queue->serial != d->pkt_serial);
-			av_packet_unref(&d->pkt);
-			d->pkt_temp = d->pkt = pkt;
-			d->packet_pending = 1;
-		}
+	int i;
 
-		switch (d->avctx->codec_type) {
-		case AVMEDIA_TYPE_VIDEO:
-			ret = avcodec_decode_video2(d->avctx, frame, &got_frame, &d->pkt_temp);
-			if (got_frame) {
-				if (decoder_reorder_pts == -1) {
-					frame->pts = av_frame_get_best_effort_timestamp(frame);
-				} else if (!decoder_reorder_pts) {
-					frame->pts = frame->pkt_dts;
-				}
-			}
-			break;
-		case AVMEDIA_TYPE_AUDIO:
-			ret = avcodec_decode_audio4(d->avctx, frame, &got_frame, &d->pkt_temp);
-			if (got_frame) {
-				AVRational tb = (AVRational) {
-					1, frame->sample_rate
-				};
-				if (frame->pts != AV_NOPTS_VALUE)
-					frame->pts = av_rescale_q(frame->pts, av_codec_get_pkt_timebase(d->avctx), tb);
-				else if (d->next_pts != AV_NOPTS_VALUE)
-					frame->pts = av_rescale_q(d->next_pts, d->next_pts_tb, tb);
-				if (frame->pts != AV_NOPTS_VALUE) {
-					d->next_pts = frame->pts + frame->nb_samples;
-					d->next_pts_tb = tb;
-				}
-			}
-			break;
-		default:
-			break;
-		}
+	av_log(NULL, AV_LOG_INFO, "%-16s %10s %14s %8s %12s %12s %12s\n", "region", "calls",
+	       perf_software ? "task-clock ns" : "cycles", "ipc", "cache-miss", "branch-miss",
+	       perf_software ? "ns/unit" : "cycles/unit");
+	for (i = 0; i < PERF_REGION_NB; i++) {
+		PerfRegion *r = &perf_regions[i];
+		if (!r->calls)
+			continue;
+		av_log(NULL, AV_LOG_INFO, "%-16s %10"PRIu64" %14"PRIu64" %8.2f %12"PRIu64" %12"PRIu64" %12.3f per %s\n",
+		       r->name, r->calls, r->count[PERF_CYCLES],
+		       r->count[PERF_CYCLES] ? (double)r->count[PERF_INSTRUCTIONS] / r->count[PERF_CYCLES] : 0.0,
+		       r->count[PERF_CACHE_MISSES], r->count[PERF_BRANCH_MISSES],
+		       r->units ? (double)r->count[PERF_CYCLES] / r->units : 0.0, r->unit);
+	}
+}
 
-		if (ret < 0) {
-			d->packet_pending = 0;
-		} else {
-			d->pkt_temp.dts = d->pkt_temp.pts = AV_NOPTS_VALUE;
-			if (d->pkt_temp.data) {
-				if (d->avctx->codec_type != AVMEDIA_TYPE_AUDIO)
-					ret = d->pkt_temp.size;
-				d->pkt_temp.data += ret;
-				d->pkt_temp.size -= ret;
-				if (d->pkt_temp.size <= 0)
-					d->packet_pending = 0;
-			} else {
-				if (!got_frame) {
-					d->packet_pending = 0;
-					d->finished = d->pkt_serial;
-				}
-			}
-		}
-	} while (!got_frame && !d->finished);
+static PacketArena *packet_arena_alloc(int64_t size)
+{
+	PacketArena *a = av_mallocz(sizeof(*a));
 
-	return got_frame;
+	if (!a)
+		return NULL;
+	a->size = FFALIGN(size, ARENA_ALIGN);
+	if (posix_memalign((void **)&a->buf, ARENA_ALIGN, a->size) || !(a->mutex = SDL_CreateMutex())) {
+		free(a->buf);
+		av_free(a);
+		return NULL;
+	}
+	return a;
 }
 
-static void frame_queue_unref_item(Frame *vp)
+static void packet_arena_free(PacketArena *a)
 {
-	av_frame_unref(vp->frame);
+	SDL_DestroyMutex(a->mutex);
+	free(a->buf);
+	av_free(a);
 }
 
-static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size,
-                            int keep_last)
+/* advance the tail over the released blocks, with the mutex held */
+static void packet_arena_reclaim(PacketArena *a)
 {
-	int i;
-	memset(f, 0, sizeof(FrameQueue));
-	if (!(f->mutex = SDL_CreateMutex())) {
-		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
-		return AVERROR(ENOMEM);
-	}
-	if (!(f->cond = SDL_CreateCond())) {
-		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
-		return AVERROR(ENOMEM);
+	while (a->tail < a->head) {
+		ArenaBlock *b = (ArenaBlock *)(a->buf + a->tail % a->size);
+		if (!b->released)
+			break;
+		a->tail += b->size;
 	}
-	f->pktq = pktq;
-	f->max_size = FFMIN(max_size, FRAME_QUEUE_SIZE);
-	f->keep_last = !!keep_last;
-	for (i = 0; i < f->max_size; i++)
-		if (!(f->queue[i].frame = av_frame_alloc()))
-			return AVERROR(ENOMEM);
-	return 0;
 }
 
-static Frame *frame_queue_peek(FrameQueue *f)
+static void packet_arena_release(void *opaque, uint8_t *data)
 {
-	return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+	PacketArena *a = opaque;
+	int last;
+
+	SDL_LockMutex(a->mutex);
+	((ArenaBlock *)(data - ARENA_ALIGN))->released = 1;
+	a->live--;
+	packet_arena_reclaim(a);
+	last = a->closed && !a->live;
+	SDL_UnlockMutex(a->mutex);
+	if (last)
+		packet_arena_free(a);
 }
 
-static Frame *frame_queue_peek_next(FrameQueue *f)
+static void packet_arena_close(PacketArena *a)
 {
-	return &f->queue[(f->rindex + f->rindex_shown + 1) % f->max_size];
+	int last;
+
+	if (!a)
+		return;
+	SDL_LockMutex(a->mutex);
+	a->closed = 1;
+	last = !a->live;
+	SDL_UnlockMutex(a->mutex);
+	if (last)
+		packet_arena_free(a);
 }
 
-static Frame *frame_queue_peek_last(FrameQueue *f)
+/**
+ * Move the payload of pkt into the arena. The packet is left as it is when
+ * the arena has no room, so the caller queues it from the heap.
+ */
+static void packet_arena_store(PacketArena *a, AVPacket *pkt)
 {
-	return &f->queue[f->rindex];
+	int64_t need = FFALIGN(ARENA_ALIGN + pkt->size + AV_INPUT_BUFFER_PADDING_SIZE, ARENA_ALIGN);
+	int64_t off, skip;
+	ArenaBlock *b;
+	AVBufferRef *buf;
+
+	SDL_LockMutex(a->mutex);
+	off = a->head % a->size;
+	/* a block does not wrap, the end of the ring is skipped instead */
+	skip = off + need > a->size ? a->size - off : 0;
+	if (need > a->size / 4 || a->size - (a->head - a->tail) < skip + need) {
+		a->nb_heap++;
+		SDL_UnlockMutex(a->mutex);
+		return;
+	}
+	if (skip) {
+		b = (ArenaBlock *)(a->buf + off);
+		b->size = skip;
+		b->released = 1;
+		a->head += skip;
+		off = 0;
+	}
+	b = (ArenaBlock *)(a->buf + off);
+	b->size = need;
+	b->released = 0;
+	a->head += need;
+	a->live++;
+	SDL_UnlockMutex(a->mutex);
+
+	memcpy((uint8_t *)b + ARENA_ALIGN, pkt->data, pkt->size);
+	memset((uint8_t *)b + ARENA_ALIGN + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	buf = av_buffer_create((uint8_t *)b + ARENA_ALIGN, pkt->size + AV_INPUT_BUFFER_PADDING_SIZE,
+	                       packet_arena_release, a, 0);
+	SDL_LockMutex(a->mutex);
+	if (buf)
+		a->nb_arena++;
+	else
+		a->nb_heap++;
+	SDL_UnlockMutex(a->mutex);
+	if (!buf) {
+		packet_arena_release(a, (uint8_t *)b + ARENA_ALIGN);
+		return;
+	}
+	av_buffer_unref(&pkt->buf);
+	pkt->buf = buf;
+	pkt->data = buf->data;
 }
 
-static Frame *frame_queue_peek_writable(FrameQueue *f)
+static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
 {
-	/* wait until we have space to put a new frame */
-	SDL_LockMutex(f->mutex);
-	while (f->size >= f->max_size &&
-	       !f->pktq->abort_request) {
-		SDL_CondWait(f->cond, f->mutex);
-	}
-	SDL_UnlockMutex(f->mutex);
+	MyAVPacketList *pkt1;
 
-	if (f->pktq->abort_request)
-		return NULL;
+	if (q->abort_request)
+		return -1;
 
-	return &f->queue[f->windex];
+	pkt1 = av_malloc(sizeof(MyAVPacketList));
+	if (!pkt1)
+		return -1;
+	pkt1->pkt = *pkt;
+	pkt1->next = NULL;
+	if (pkt == &flush_pkt)
+		q->serial++;
+	pkt1->serial = q->serial;
+
+	if (!q->last_pkt)
+		q->first_pkt = pkt1;
+	else
+		q->last_pkt->next = pkt1;
+	q->last_pkt = pkt1;
+	q->nb_packets++;
+	q->size += pkt1->pkt.size + sizeof(*pkt1);
+	q->duration += pkt1->pkt.duration;
+	/* XXX: should duplicate packet data in DV case */
+	SDL_CondSignal(q->cond);
+	return 0;
 }
 
-static Frame *frame_queue_peek_readable(FrameQueue *f)
+static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
-	/* wait until we have a readable a new frame */
-	SDL_LockMutex(f->mutex);
-	while (f->size - f->rindex_shown <= 0 &&
-	       !f->pktq->abort_request) {
-		SDL_CondWait(f->cond, f->mutex);
-	}
-	SDL_UnlockMutex(f->mutex);
+	int ret;
 
-	if (f->pktq->abort_request)
-		return NULL;
+	if (q->arena && pkt != &flush_pkt && pkt->size)
+		packet_arena_store(q->arena, pkt);
 
-	return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+	SDL_LockMutex(q->mutex);
+	ret = packet_queue_put_private(q, pkt);
+	SDL_UnlockMutex(q->mutex);
+
+	if (pkt != &flush_pkt && ret < 0)
+		av_packet_unref(pkt);
+
+	return ret;
 }
 
-static void frame_queue_push(FrameQueue *f)
+static int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
 {
-	if (++f->windex == f->max_size)
-		f->windex = 0;
-	SDL_LockMutex(f->mutex);
-	f->size++;
-	SDL_CondSignal(f->cond);
-	SDL_UnlockMutex(f->mutex);
+	AVPacket pkt1, *pkt = &pkt1;
+	av_init_packet(pkt);
+	pkt->data = NULL;
+	pkt->size = 0;
+	pkt->stream_index = stream_index;
+	return packet_queue_put(q, pkt);
 }
 
-static void frame_queue_next(FrameQueue *f)
+/* packet queue handling */
+static int packet_queue_init(PacketQueue *q)
 {
-	if (f->keep_last && !f->rindex_shown) {
-		f->rindex_shown = 1;
-		return;
+	memset(q, 0, sizeof(PacketQueue));
+	q->mutex = SDL_CreateMutex();
+	if (!q->mutex) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
 	}
-	frame_queue_unref_item(&f->queue[f->rindex]);
-	if (++f->rindex == f->max_size)
-		f->rindex = 0;
-	SDL_LockMutex(f->mutex);
-	f->size--;
-	SDL_CondSignal(f->cond);
-	SDL_UnlockMutex(f->mutex);
+	q->cond = SDL_CreateCond();
+	if (!q->cond) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
+	}
+	q->abort_request = 1;
+	return 0;
 }
 
-/* return the number of undisplayed frames in the queue */
-static int frame_queue_nb_remaining(FrameQueue *f)
+static void packet_queue_flush(PacketQueue *q)
 {
-	return f->size - f->rindex_shown;
-}
+	MyAVPacketList *pkt, *pkt1;
 
-static inline void fill_rectangle(int x, int y, int w, int h)
-{
-	SDL_Rect rect;
-	rect.x = x;
-	rect.y = y;
-	rect.w = w;
-	rect.h = h;
-	if (w && h)
-		SDL_RenderFillRect(renderer, &rect);
+	SDL_LockMutex(q->mutex);
+	for (pkt = q->first_pkt; pkt; pkt = pkt1) {
+		pkt1 = pkt->next;
+		av_packet_unref(&pkt->pkt);
+		av_freep(&pkt);
+	}
+	q->last_pkt = NULL;
+	q->first_pkt = NULL;
+	q->nb_packets = 0;
+	q->size = 0;
+	q->duration = 0;
+	SDL_UnlockMutex(q->mutex);
 }
 
-static int realloc_texture(SDL_Texture **texture, Uint32 new_format,
-                           int new_width, int new_height, SDL_BlendMode blendmode, int init_texture)
+static void packet_queue_destroy(PacketQueue *q)
 {
-	Uint32 format;
-	int access, w, h;
-	if (SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 ||
-	    new_width != w || new_height != h || new_format != format) {
-		void *pixels;
-		int pitch;
-		SDL_DestroyTexture(*texture);
-		if (!(*texture = SDL_CreateTexture(renderer, new_format,
-		                                   SDL_TEXTUREACCESS_STREAMING, new_width, new_height)))
-			return -1;
-		if (SDL_SetTextureBlendMode(*texture, blendmode) < 0)
-			return -1;
-		if (init_texture) {
-			if (SDL_LockTexture(*texture, NULL, &pixels, &pitch) < 0)
-				return -1;
-			memset(pixels, 0, pitch * new_height);
-			SDL_UnlockTexture(*texture);
-		}
-	}
-	return 0;
+	packet_queue_flush(q);
+	packet_arena_close(q->arena);
+	SDL_DestroyMutex(q->mutex);
+	SDL_DestroyCond(q->cond);
 }
 
-static void calculate_display_rect(SDL_Rect *rect, int scr_width,
-                                   int scr_height)
+static void packet_queue_abort(PacketQueue *q)
 {
-	rect->x = 0;
-	rect->y = 0;
-	rect->w = FFMAX(scr_width,  1);
-	rect->h = FFMAX(scr_height, 1);
+	SDL_LockMutex(q->mutex);
+	q->abort_request = 1;
+	SDL_CondSignal(q->cond);
+	SDL_UnlockMutex(q->mutex);
 }
 
-static int upload_texture(SDL_Texture *tex, AVFrame *frame,
-                          struct SwsContext **img_convert_ctx)
+static void packet_queue_start(PacketQueue *q)
 {
-	int ret = 0;
-	switch (frame->format) {
-	case AV_PIX_FMT_YUV420P:
-		ret = SDL_UpdateYUVTexture(tex, NULL, frame->data[0], frame->linesize[0],
-		                           frame->data[1], frame->linesize[1],
-		                           frame->data[2], frame->linesize[2]);
-		break;
-	case AV_PIX_FMT_BGRA:
-		ret = SDL_UpdateTexture(tex, NULL, frame->data[0], frame->linesize[0]);
-		break;
-	default:
-		/* This should only happen if we are not using avfilter... */
-		*img_convert_ctx = sws_getCachedContext(*img_convert_ctx,
-		                                        frame->width, frame->height, frame->format, frame->width, frame->height,
-		                                        AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
-		if (*img_convert_ctx != NULL) {
-			uint8_t *pixels[4];
-			int pitch[4];
-			if (!SDL_LockTexture(tex, NULL, (void **)pixels, pitch)) {
-				sws_scale(*img_convert_ctx, (const uint8_t *const *)frame->data,
-				          frame->linesize,
-				          0, frame->height, pixels, pitch);
-				SDL_UnlockTexture(tex);
-			}
-		} else {
-			av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
-			ret = -1;
-		}
-		break;
-	}
-	return ret;
+	SDL_LockMutex(q->mutex);
+	q->abort_request = 0;
+	packet_queue_put_private(q, &flush_pkt);
+	SDL_UnlockMutex(q->mutex);
 }
 
-static void video_image_display(VideoState *is)
+/* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block,
+                            int *serial)
 {
-	Frame *vp;
-	Frame *sp = NULL;
-	SDL_Rect rect;
+	MyAVPacketList *pkt1;
+	uint64_t pc[PERF_COUNTER_NB];
+	int perf = perf_begin(pc);
+	int ret;
 
-	vp = frame_queue_peek_last(&is->pictq);
-	if (vp->bmp) {
-		calculate_display_rect(&rect, is->width, is->height);
+	SDL_LockMutex(q->mutex);
 
-		if (!vp->uploaded) {
-			if (upload_texture(vp->bmp, vp->frame, &is->img_convert_ctx) < 0)
-				return;
-			vp->uploaded = 1;
+	while (1) {
+		if (q->abort_request) {
+			ret = -1;
+			break;
 		}
 
-		SDL_RenderCopy(renderer, vp->bmp, NULL, &rect);
-		if (sp) {
-			SDL_RenderCopy(renderer, is->sub_texture, NULL, &rect);
+		pkt1 = q->first_pkt;
+		if (pkt1) {
+			q->first_pkt = pkt1->next;
+			if (!q->first_pkt)
+				q->last_pkt = NULL;
+			q->nb_packets--;
+			q->size -= pkt1->pkt.size + sizeof(*pkt1);
+			q->duration -= pkt1->pkt.duration;
+			*pkt = pkt1->pkt;
+			if (serial)
+				*serial = pkt1->serial;
+			av_free(pkt1);
+			ret = 1;
+			break;
+		} else if (!block) {
+			ret = 0;
+			break;
+		} else {
+			cond_wait(q->cond, q->mutex);
 		}
 	}
+	SDL_UnlockMutex(q->mutex);
+	if (perf && ret > 0)
+		perf_end(PERF_REGION_PACKET_GET, pc, 1);
+	return ret;
 }
 
-static void do_exit(VideoState *is)
+static void decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue,
+                         SDL_cond *empty_queue_cond)
 {
-	av_log(NULL, AV_LOG_QUIET, "%s", "");
-	exit(0);
+	memset(d, 0, sizeof(Decoder));
+	d->avctx = avctx;
+	d->queue = queue;
+	d->empty_queue_cond = empty_queue_cond;
+	d->start_pts = AV_NOPTS_VALUE;
+	d->bypass_format = -1;
 }
 
-static void set_default_window_size(int width, int height)
+/**
+ * Return the pixel or sample format of a stream whose packets can be used
+ * as frames as they are, or -1 if it has to go through its decoder.
+ */
+static int decoder_bypass_format(AVCodecParameters *par)
 {
-	default_width = width;
-	default_height = height;
+	static const struct {
+		enum AVCodecID codec_id;
+		enum AVSampleFormat fmt;
+	} pcm_fmts[] = {
+		{ AV_CODEC_ID_PCM_U8,                                   AV_SAMPLE_FMT_U8 },
+		{ AV_NE(AV_CODEC_ID_PCM_S16BE, AV_CODEC_ID_PCM_S16LE),  AV_SAMPLE_FMT_S16 },
+		{ AV_NE(AV_CODEC_ID_PCM_S32BE, AV_CODEC_ID_PCM_S32LE),  AV_SAMPLE_FMT_S32 },
+		{ AV_NE(AV_CODEC_ID_PCM_F32BE, AV_CODEC_ID_PCM_F32LE),  AV_SAMPLE_FMT_FLT },
+		{ AV_NE(AV_CODEC_ID_PCM_F64BE, AV_CODEC_ID_PCM_F64LE),  AV_SAMPLE_FMT_DBL },
+	};
+	const AVPixFmtDescriptor *desc;
+	int i;
+
+	switch (par->codec_type) {
+	case AVMEDIA_TYPE_VIDEO:
+		/* tagged raw video may be flipped or packed differently, leave it to rawdec */
+		if (par->codec_id != AV_CODEC_ID_RAWVIDEO || par->codec_tag ||
+		    !(desc = av_pix_fmt_desc_get(par->format)) ||
+		    (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM |
+		                    AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PSEUDOPAL)))
+			return -1;
+		return par->format;
+	case AVMEDIA_TYPE_AUDIO:
+		for (i = 0; i < FF_ARRAY_ELEMS(pcm_fmts); i++)
+			if (par->codec_id == pcm_fmts[i].codec_id && par->channels > 0)
+				return pcm_fmts[i].fmt;
+		return -1;
+	default:
+		return -1;
+	}
 }
 
-static int video_open(VideoState *is, Frame *vp)
+/**
+ * Reference a whole packet of an uncompressed stream as a frame. Returns
+ * the number of bytes used, or a negative value if the packet has to be
+ * decoded instead.
+ */
+static int decoder_wrap_packet(Decoder *d, AVFrame *frame, AVPacket *pkt)
 {
-	int w, h;
-
-	if (vp && vp->width)
-		set_default_window_size(vp->width, vp->height);
-
-	if (screen_width) {
-		w = screen_width;
-		h = screen_height;
+	AVCodecContext *avctx = d->avctx;
+	int size, bps;
+
+	if (!pkt->buf || !pkt->data || pkt->data != d->pkt.data)
+		return AVERROR(EAGAIN);
+
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		size = av_image_fill_arrays(frame->data, frame->linesize, pkt->data,
+		                            d->bypass_format, avctx->width, avctx->height, 1);
+		if (size < 0 || size > pkt->size)
+			return AVERROR(EAGAIN);
+		frame->format = d->bypass_format;
+		frame->width = avctx->width;
+		frame->height = avctx->height;
+		frame->sample_aspect_ratio = avctx->sample_aspect_ratio;
+		frame->key_frame = 1;
+		frame->pict_type = AV_PICTURE_TYPE_I;
+		frame->pkt_dts = pkt->dts;
+		av_frame_set_best_effort_timestamp(frame, pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts);
 	} else {
-		w = default_width;
-		h = default_height;
+		bps = av_get_bytes_per_sample(d->bypass_format) * avctx->channels;
+		if (!(frame->nb_samples = pkt->size / bps))
+			return AVERROR(EAGAIN);
+		frame->format = d->bypass_format;
+		frame->sample_rate = avctx->sample_rate;
+		frame->channel_layout = avctx->channel_layout;
+		av_frame_set_channels(frame, avctx->channels);
+		frame->data[0] = pkt->data;
+		frame->linesize[0] = frame->nb_samples * bps;
+		frame->extended_data = frame->data;
 	}
-
-	if (!window) {
-		int flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
-		if (!window_title)
-			window_title = input_filename;
-		window = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED,
-		                          SDL_WINDOWPOS_UNDEFINED, w, h, flags);
-		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-		if (window) {
-			SDL_RendererInfo info;
-			renderer = SDL_CreateRenderer(window, -1,
-			                              SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-			if (renderer) {
-				if (!SDL_GetRendererInfo(renderer, &info))
-					av_log(NULL, AV_LOG_VERBOSE, "Initialized %s renderer.\n", info.name);
-			}
-		}
-	} else {
-		SDL_SetWindowSize(window, w, h);
+	frame->buf[0] = av_buffer_ref(pkt->buf);
+	if (!frame->buf[0]) {
+		av_frame_unref(frame);
+		return AVERROR(ENOMEM);
 	}
+	frame->pts = pkt->pts;
+	av_frame_set_pkt_pos(frame, pkt->pos);
+	av_frame_set_pkt_duration(frame, pkt->duration);
+	return pkt->size;
+}
 
-	if (!window || !renderer) {
-		av_log(NULL, AV_LOG_FATAL, "SDL: could not set video mode - exiting\n");
-		do_exit(is);
-	}
+/**
+ * Buffers of the decoded pictures, handed to the video decoders through
+ * get_buffer2. Idle buffers are kept by size class, four per octave, not by
+ * exact size, so that those of a previous resolution are reused after a
+ * change. Planes are 64-byte aligned; with -hugepages buffers of 2 MiB and
+ * more are backed by huge pages.
+ */
+#define FRAME_POOL_ALIGN    64
+#define FRAME_POOL_CLASSES  96
+#define FRAME_POOL_IDLE_MAX (256 * 1024 * 1024)
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+
+typedef struct PoolBuffer {
+	struct PoolBuffer *next;
+	uint8_t *data;
+	size_t size;
+	int cls;                /* size class, -1 for buffers too large to keep */
+	int huge;               /* 1 for mmap()ed huge pages, 2 for transparent ones */
+} PoolBuffer;
+
+typedef struct FramePool {
+	SDL_mutex *mutex;
+	PoolBuffer *idle[FRAME_POOL_CLASSES];
+	int64_t idle_bytes;
+	int64_t used_bytes;
+	int64_t nb_allocs;
+	int64_t nb_reuses;
+	int nb_huge;
+} FramePool;
 
-	is->width = w;
-	is->height = h;
+static FramePool frame_pool;
 
-	return 0;
+static int frame_pool_class(size_t size, size_t *class_size)
+{
+	int l = av_log2(FFMAX(size, 4096));
+	size_t step = (size_t)1 << (l - 2);
+
+	*class_size = FFALIGN(FFMAX(size, 4096), step);
+	return (l - 12) * 4 + *class_size / step - 4;
 }
 
-/* display the current picture, if any */
-static void video_display(VideoState *is)
+static PoolBuffer *pool_buffer_alloc(size_t size, int cls)
 {
-	if (!window)
-		video_open(is, NULL);
+	PoolBuffer *b = av_mallocz(sizeof(*b));
+	void *data;
 
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-	SDL_RenderClear(renderer);
-	video_image_display(is);
-	SDL_RenderPresent(renderer);
+	if (!b)
+		return NULL;
+	b->cls = cls;
+	if (hugepages && size >= HUGE_PAGE_SIZE) {
+		size = FFALIGN(size, HUGE_PAGE_SIZE);
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED) {
+			b->huge = 1;
+		} else if (!posix_memalign(&data, HUGE_PAGE_SIZE, size)) {
+			/* no huge pages reserved, ask for transparent ones */
+			madvise(data, size, MADV_HUGEPAGE);
+			b->huge = 2;
+		} else {
+			data = NULL;
+		}
+	} else if (posix_memalign(&data, FRAME_POOL_ALIGN, size)) {
+		data = NULL;
+	}
+	if (!data) {
+		av_free(b);
+		return NULL;
+	}
+	b->data = data;
+	b->size = size;
+	return b;
 }
 
-static double get_clock(Clock *c)
+static void pool_buffer_free(PoolBuffer *b)
 {
-	if (*c->queue_serial != c->serial)
-		return NAN;
-	if (c->paused) {
-		return c->pts;
-	} else {
-		double time = av_gettime_relative() / 1000000.0;
-		return c->pts_drift + time - (time - c->last_updated) * (1.0 - c->speed);
-	}
+	if (b->huge == 1)
+		munmap(b->data, b->size);
+	else
+		free(b->data);
+	av_free(b);
 }
 
-static void set_clock_at(Clock *c, double pts, int serial, double time)
+static void pool_buffer_release(void *opaque, uint8_t *data)
 {
-	c->pts = pts;
-	c->last_updated = time;
-	c->pts_drift = c->pts - time;
-	c->serial = serial;
+	FramePool *p = &frame_pool;
+	PoolBuffer *b = opaque;
+
+	SDL_LockMutex(p->mutex);
+	p->used_bytes -= b->size;
+	if (b->cls >= 0 && p->idle_bytes + b->size <= FRAME_POOL_IDLE_MAX) {
+		b->next = p->idle[b->cls];
+		p->idle[b->cls] = b;
+		p->idle_bytes += b->size;
+		b = NULL;
+	}
+	SDL_UnlockMutex(p->mutex);
+	if (b)
+		pool_buffer_free(b);
 }
 
-static void set_clock(Clock *c, double pts, int serial)
+static AVBufferRef *frame_pool_get(size_t size)
 {
-	double time = av_gettime_relative() / 1000000.0;
-	set_clock_at(c, pts, serial, time);
+	FramePool *p = &frame_pool;
+	PoolBuffer *b = NULL;
+	AVBufferRef *buf;
+	size_t class_size;
+	int cls = frame_pool_class(size, &class_size);
+
+	if (cls >= FRAME_POOL_CLASSES) {
+		cls = -1;
+		class_size = size;
+	}
+	SDL_LockMutex(p->mutex);
+	if (cls >= 0 && (b = p->idle[cls])) {
+		p->idle[cls] = b->next;
+		p->idle_bytes -= b->size;
+		p->nb_reuses++;
+	}
+	SDL_UnlockMutex(p->mutex);
+	if (!b) {
+		if (!(b = pool_buffer_alloc(class_size, cls)))
+			return NULL;
+		SDL_LockMutex(p->mutex);
+		p->nb_allocs++;
+		p->nb_huge += b->huge != 0;
+		SDL_UnlockMutex(p->mutex);
+	}
+	SDL_LockMutex(p->mutex);
+	p->used_bytes += b->size;
+	SDL_UnlockMutex(p->mutex);
+	if (!(buf = av_buffer_create(b->data, size, pool_buffer_release, b, 0)))
+		pool_buffer_release(b, b->data);
+	return buf;
 }
 
-static void init_clock(Clock *c, int *queue_serial)
+static int frame_pool_get_buffer(AVCodecContext *avctx, AVFrame *frame, int flags)
 {
-	c->speed = 1.0;
-	c->paused = 0;
-	c->queue_serial = queue_serial;
-	set_clock(c, NAN, -1);
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	int w = frame->width, h = frame->height;
+	int linesize[4], size, i;
+	uint8_t *data[4];
+
+	if (avctx->codec_type != AVMEDIA_TYPE_VIDEO || !desc ||
+	    desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL | AV_PIX_FMT_FLAG_HWACCEL))
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+
+	/* the padding the decoder expects, as the default allocator does */
+	avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+	if ((size = av_image_fill_linesizes(linesize, frame->format, w)) < 0)
+		return size;
+	for (i = 0; i < 4; i++)
+		linesize[i] = FFALIGN(linesize[i], FRAME_POOL_ALIGN);
+	if ((size = av_image_fill_pointers(data, frame->format, h, NULL, linesize)) < 0)
+		return size;
+
+	if (!(frame->buf[0] = frame_pool_get(size + 16 + FRAME_POOL_ALIGN)))
+		return AVERROR(ENOMEM);
+	av_image_fill_pointers(frame->data, frame->format, h, frame->buf[0]->data, linesize);
+	for (i = 0; i < 4; i++)
+		frame->linesize[i] = linesize[i];
+	frame->extended_data = frame->data;
+	return 0;
 }
 
-static void sync_clock_to_slave(Clock *c, Clock *slave)
+/* free at least bytes of idle buffers, the largest first, returns the amount released */
+static int64_t frame_pool_trim(void *opaque, int64_t bytes)
 {
-	double clock = get_clock(c);
-	double slave_clock = get_clock(slave);
-	if (!isnan(slave_clock) && (isnan(clock) ||
-	                            fabs(clock - slave_clock) > AV_NOSYNC_THRESHOLD))
-		set_clock(c, slave_clock, slave->serial);
+	FramePool *p = &frame_pool;
+	PoolBuffer *list = NULL, *b;
+	int64_t released = 0;
+	int i;
+
+	SDL_LockMutex(p->mutex);
+	for (i = FRAME_POOL_CLASSES - 1; i >= 0 && released < bytes; i--) {
+		while (released < bytes && (b = p->idle[i])) {
+			p->idle[i] = b->next;
+			b->next = list;
+			list = b;
+			released += b->size;
+		}
+	}
+	p->idle_bytes -= released;
+	SDL_UnlockMutex(p->mutex);
+	while ((b = list)) {
+		list = b->next;
+		pool_buffer_free(b);
+	}
+	return released;
 }
 
-/* get the current master clock value */
-static double get_master_clock(VideoState *is)
+static int64_t frame_pool_idle(void *opaque)
 {
-	return get_clock(&is->audclk);
+	int64_t idle;
+
+	SDL_LockMutex(frame_pool.mutex);
+	idle = frame_pool.idle_bytes;
+	SDL_UnlockMutex(frame_pool.mutex);
+	return idle;
 }
 
-/* seek in the stream */
-static void stream_seek(VideoState *is, int64_t pos, int64_t rel,
-                        int seek_by_bytes)
+static int frame_pool_init(void)
 {
-	if (!is->seek_req) {
-		is->seek_pos = pos;
-		is->seek_rel = rel;
-		is->seek_flags &= ~AVSEEK_FLAG_BYTE;
-		if (seek_by_bytes)
-			is->seek_flags |= AVSEEK_FLAG_BYTE;
-		is->seek_req = 1;
-		SDL_CondSignal(is->continue_read_thread);
+	if (!(frame_pool.mutex = SDL_CreateMutex())) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
 	}
+	mem_budget_register("idle frame buffers", MEM_PRIO_SLACK, NULL,
+	                    frame_pool_idle, frame_pool_trim, NULL);
+	return 0;
 }
 
-static void update_volume(VideoState *is, int sign, int step)
+static void frame_pool_install(AVCodecContext *avctx, AVCodec *codec)
 {
-	is->audio_volume = av_clip(is->audio_volume + sign * step, 0,
-	                           SDL_MIX_MAXVOLUME);
+	if (!frame_pool_enabled || avctx->codec_type != AVMEDIA_TYPE_VIDEO ||
+	    !(codec->capabilities & AV_CODEC_CAP_DR1))
+		return;
+	avctx->get_buffer2 = frame_pool_get_buffer;
+	/* the pool is locked, frame threads may call it directly */
+	avctx->thread_safe_callbacks = 1;
 }
 
-static double compute_target_delay(double delay, VideoState *is)
+static void decoder_flush(Decoder *d)
 {
-	double sync_threshold, diff = 0;
+	avcodec_flush_buffers(d->avctx);
+	d->flush_time = av_gettime_relative();
+	d->finished = 0;
+	d->next_pts = d->start_pts;
+	d->next_pts_tb = d->start_pts_tb;
+	d->nb_skipped = 0;
+}
 
-	/* if video is slave, we try to correct big delays by
-	   duplicating or deleting a frame */
-	diff = get_clock(&is->vidclk) - get_master_clock(is);
+/* remember the pts of a packet sent while the decoder discards pictures */
+static void decoder_add_skipped(Decoder *d, int64_t pts)
+{
+	int i;
 
-	/* skip or repeat frame. We take into account the
-	   delay to compute the threshold. I still don't know
-	   if it is the best guess */
-	sync_threshold = FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX,
-	                       delay));
-	if (!isnan(diff) && fabs(diff) < is->max_frame_duration) {
-		if (diff <= -sync_threshold)
-			delay = FFMAX(0, delay + diff);
-		else if (diff >= sync_threshold && delay > AV_SYNC_FRAMEDUP_THRESHOLD)
-			delay = delay + diff;
-		else if (diff >= sync_threshold)
-			delay = 2 * delay;
+	/* pts no picture ever matched, forget the lowest */
+	if (d->nb_skipped == DECODER_SKIPPED_MAX) {
+		d->nb_skipped--;
+		memmove(d->skipped_pts, d->skipped_pts + 1, d->nb_skipped * sizeof(*d->skipped_pts));
 	}
-
-	av_log(NULL, AV_LOG_TRACE, "video: delay=%0.3f A-V=%f\n", delay, -diff);
-
-	return delay;
+	for (i = d->nb_skipped; i > 0 && d->skipped_pts[i - 1] > pts; i--)
+		d->skipped_pts[i] = d->skipped_pts[i - 1];
+	d->skipped_pts[i] = pts;
+	d->nb_skipped++;
 }
 
-static double vp_duration(VideoState *is, Frame *vp, Frame *nextvp)
+/*
+ * Pictures come out in pts order, so the remembered pts below that of the
+ * picture just decoded belong to pictures that were discarded. Move them
+ * to pts[], ascending, and return their number. The picture's own pts is
+ * dropped from the list.
+ */
+static int decoder_take_skipped(Decoder *d, int64_t frame_pts, int64_t *pts)
 {
-	if (vp->serial == nextvp->serial) {
-		double duration = nextvp->pts - vp->pts;
-		if (isnan(duration) || duration <= 0 || duration > is->max_frame_duration)
-			return vp->duration;
-		else
-			return duration;
-	} else {
-		return 0.0;
+	int n = 0, i;
+
+	while (n < d->nb_skipped && d->skipped_pts[n] < frame_pts) {
+		pts[n] = d->skipped_pts[n];
+		n++;
 	}
+	i = n < d->nb_skipped && d->skipped_pts[n] == frame_pts ? n + 1 : n;
+	d->nb_skipped -= i;
+	memmove(d->skipped_pts, d->skipped_pts + i, d->nb_skipped * sizeof(*d->skipped_pts));
+	return n;
 }
 
-static void update_video_pts(VideoState *is, double pts, int64_t pos,
-                             int serial)
+static int intra_worker_thread(void *arg)
 {
-	/* update current video pts */
-	set_clock(&is->vidclk, pts, serial);
-	sync_clock_to_slave(&is->extclk, &is->vidclk);
+	IntraWorker *w = arg;
+	IntraPool *p = w->pool;
+	IntraJob *job;
+
+	SDL_LockMutex(p->mutex);
+	for (;;) {
+		while (!p->abort && !p->nb_queued)
+			cond_wait(p->cond, p->mutex);
+		if (p->abort)
+			break;
+		job = &p->jobs[p->next];
+		p->next = (p->next + 1) % p->nb_jobs;
+		p->nb_queued--;
+		job->state = INTRA_JOB_BUSY;
+		SDL_UnlockMutex(p->mutex);
+
+		/* intra-only decoders have no delay, so a NULL packet needs no draining */
+		job->got_frame = 0;
+		if (job->pkt.data && job->serial == p->queue->serial)
+			avcodec_decode_video2(w->avctx, job->frame, &job->got_frame, &job->pkt);
+		av_packet_unref(&job->pkt);
+
+		SDL_LockMutex(p->mutex);
+		job->state = INTRA_JOB_DONE;
+		SDL_CondSignal(p->done_cond);
+	}
+	SDL_UnlockMutex(p->mutex);
+	return 0;
 }
 
-/* called to display each frame */
-static void video_refresh(void *opaque, double *remaining_time)
+static void intra_pool_free(IntraPool **pp)
 {
-	VideoState *is = opaque;
-	double time;
+	IntraPool *p = *pp;
+	int i;
 
-	if (is->show_mode != SHOW_MODE_VIDEO && is->audio_st) {
-		time = av_gettime_relative() / 1000000.0;
-		if (is->force_refresh || is->last_vis_time + rdftspeed < time) {
-			video_display(is);
-			is->last_vis_time = time;
-		}
-		*remaining_time = FFMIN(*remaining_time, is->last_vis_time + rdftspeed - time);
+	if (!p)
+		return;
+	SDL_LockMutex(p->mutex);
+	p->abort = 1;
+	SDL_CondBroadcast(p->cond);
+	SDL_UnlockMutex(p->mutex);
+	for (i = 0; i < p->nb_workers; i++) {
+		if (p->workers[i].tid)
+			SDL_WaitThread(p->workers[i].tid, NULL);
+		avcodec_free_context(&p->workers[i].avctx);
 	}
-
-	if (is->video_st) {
-retry:
-		if (frame_queue_nb_remaining(&is->pictq) == 0) {
-			// nothing to do, no picture to display in the queue
-		} else {
-			double last_duration, duration, delay;
-			Frame *vp, *lastvp;
-
-			/* dequeue the picture */
-			lastvp = frame_queue_peek_last(&is->pictq);
-			vp = frame_queue_peek(&is->pictq);
-
-			if (vp->serial != is->videoq.serial) {
-				frame_queue_next(&is->pictq);
-				goto retry;
-			}
-
-			if (lastvp->serial != vp->serial)
-				is->frame_timer = av_gettime_relative() / 1000000.0;
-
-			/* compute nominal last_duration */
-			last_duration = vp_duration(is, lastvp, vp);
-			delay = compute_target_delay(last_duration, is);
-
-			time = av_gettime_relative() / 1000000.0;
-			if (time < is->frame_timer + delay) {
-				*remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
-				goto display;
-			}
-
-			is->frame_timer += delay;
-			if (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX)
-				is->frame_timer = time;
-
-			SDL_LockMutex(is->pictq.mutex);
-			if (!isnan(vp->pts))
-				update_video_pts(is, vp->pts, vp->pos, vp->serial);
-			SDL_UnlockMutex(is->pictq.mutex);
-
-			if (frame_queue_nb_remaining(&is->pictq) > 1) {
-				Frame *nextvp = frame_queue_peek_next(&is->pictq);
-				duration = vp_duration(is, vp, nextvp);
-				if ((framedrop > 0 || framedrop) && time > is->frame_timer + duration) {
-					is->frame_drops_late++;
-					frame_queue_next(&is->pictq);
-					goto retry;
-				}
-			}
-
-			frame_queue_next(&is->pictq);
-			is->force_refresh = 1;
-		}
-display:
-		/* display picture */
-		if (is->force_refresh && is->show_mode == SHOW_MODE_VIDEO &&
-		    is->pictq.rindex_shown)
-			video_display(is);
+	for (i = 0; i < p->nb_jobs; i++) {
+		av_packet_unref(&p->jobs[i].pkt);
+		av_frame_free(&p->jobs[i].frame);
 	}
-	is->force_refresh = 0;
+	av_freep(&p->workers);
+	av_freep(&p->jobs);
+	SDL_DestroyCond(p->done_cond);
+	SDL_DestroyCond(p->cond);
+	SDL_DestroyMutex(p->mutex);
+	av_freep(pp);
 }
 
-/* allocate a picture (needs to do that in main thread to avoid
-   potential locking problems */
-static void alloc_picture(VideoState *is)
+/**
+ * Set up -intra_threads decoder contexts for a stream whose codec only has
+ * intra frames. Packets are then decoded on every context at once and the
+ * frames returned in submission order, which is presentation order as
+ * there is no reordering in such codecs. Falls back to the single decoder
+ * if the codec is not intra-only or on failure.
+ */
+static void intra_pool_open(Decoder *d, AVStream *st)
 {
-	Frame *vp;
-	int sdl_format;
-
-	vp = &is->pictq.queue[is->pictq.windex];
+	const AVCodecDescriptor *desc = avcodec_descriptor_get(st->codecpar->codec_id);
+	AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+	IntraPool *p;
+	int i;
 
-	video_open(is, vp);
+	if (!desc || !(desc->props & AV_CODEC_PROP_INTRA_ONLY) || !codec)
+		return;
 
-	if (vp->format == AV_PIX_FMT_YUV420P)
-		sdl_format = SDL_PIXELFORMAT_YV12;
-	else
-		sdl_format = SDL_PIXELFORMAT_ARGB8888;
+	p = av_mallocz(sizeof(*p));
+	if (!p)
+		goto fail;
+	p->queue = d->queue;
+	p->nb_workers = intra_threads;
+	p->nb_jobs = 2 * intra_threads;
+	p->workers = av_mallocz_array(p->nb_workers, sizeof(*p->workers));
+	p->jobs = av_mallocz_array(p->nb_jobs, sizeof(*p->jobs));
+	p->mutex = SDL_CreateMutex();
+	p->cond = SDL_CreateCond();
+	p->done_cond = SDL_CreateCond();
+	if (!p->workers || !p->jobs || !p->mutex || !p->cond || !p->done_cond)
+		goto fail;
+	for (i = 0; i < p->nb_jobs; i++) {
+		av_init_packet(&p->jobs[i].pkt);
+		p->jobs[i].pkt.data = NULL;
+		p->jobs[i].pkt.size = 0;
+		if (!(p->jobs[i].frame = av_frame_alloc()))
+			goto fail;
+	}
+	for (i = 0; i < p->nb_workers; i++) {
+		IntraWorker *w = &p->workers[i];
+		AVDictionary *opts = NULL;
+		int ret;
 
-	if (realloc_texture(&vp->bmp, sdl_format, vp->width, vp->height,
-	                    SDL_BLENDMODE_NONE, 0) < 0) {
-		/* SDL allocates a buffer smaller than requested if the video
-		 * overlay hardware is unable to support the requested size. */
-		av_log(NULL, AV_LOG_FATAL,
-		       "Error: the video system does not support an image\n"
-		       "size of %dx%d pixels. Try using -lowres or -vf \"scale=w:h\"\n"
-		       "to reduce the image size.\n", vp->width, vp->height);
-		do_exit(is);
+		w->pool = p;
+		if (!(w->avctx = avcodec_alloc_context3(NULL)))
+			goto fail;
+		if (avcodec_parameters_to_context(w->avctx, st->codecpar) < 0)
+			goto fail;
+		av_codec_set_pkt_timebase(w->avctx, st->time_base);
+		av_dict_set(&opts, "threads", "1", 0);
+		av_dict_set(&opts, "refcounted_frames", "1", 0);
+		frame_pool_install(w->avctx, codec);
+		ret = avcodec_open2(w->avctx, codec, &opts);
+		av_dict_free(&opts);
+		if (ret < 0)
+			goto fail;
+		if (!(w->tid = SDL_CreateThread(intra_worker_thread, "intra_decoder", w)))
+			goto fail;
 	}
+	av_log(NULL, AV_LOG_VERBOSE, "Decoding %s on %d intra-only decoders\n",
+	       desc->name, p->nb_workers);
+	d->intra = p;
+	return;
 
-	SDL_LockMutex(is->pictq.mutex);
-	vp->allocated = 1;
-	SDL_CondSignal(is->pictq.cond);
-	SDL_UnlockMutex(is->pictq.mutex);
+fail:
+	av_log(NULL, AV_LOG_WARNING, "Could not set up the intra-only decoders, decoding serially\n");
+	intra_pool_free(&p);
 }
 
-static int queue_picture(VideoState *is, AVFrame *src_frame, double pts,
-                         double duration, int64_t pos, int serial)
+static int intra_pool_decode_frame(Decoder *d, AVFrame *frame)
 {
-	Frame *vp;
-
-	if (!(vp = frame_queue_peek_writable(&is->pictq)))
-		return -1;
-
-	vp->sar = src_frame->sample_aspect_ratio;
-	vp->uploaded = 0;
-
-	/* alloc or resize hardware picture buffer */
-	if (!vp->bmp || !vp->allocated ||
-	    vp->width != src_frame->width ||
-	    vp->height != src_frame->height ||
-	    vp->format != src_frame->format) {
-		SDL_Event event;
+	IntraPool *p = d->intra;
+	IntraJob *job;
+	AVPacket pkt;
+	int ret;
 
-		vp->allocated = 0;
-		vp->width = src_frame->width;
-		vp->height = src_frame->height;
-		vp->format = src_frame->format;
+	for (;;) {
+		if (d->queue->abort_request)
+			return -1;
 
-		/* the allocation must be done in the main thread to avoid
-		   locking problems. */
-		event.type = FF_ALLOC_EVENT;
-		event.user.data1 = is;
-		SDL_PushEvent(&event);
+		/* keep the window full, only blocking when nothing is being decoded */
+		while (p->nb_pending < p->nb_jobs) {
+			if (d->queue->nb_packets == 0)
+				SDL_CondSignal(d->empty_queue_cond);
+			ret = packet_queue_get(d->queue, &pkt, !p->nb_pending, &d->pkt_serial);
+			if (ret < 0)
+				return -1;
+			if (!ret)
+				break;
+			if (pkt.data == flush_pkt.data) {
+				decoder_flush(d);
+				continue;
+			}
+			if (d->queue->serial != d->pkt_serial) {
+				av_packet_unref(&pkt);
+				continue;
+			}
+			SDL_LockMutex(p->mutex);
+			job = &p->jobs[p->head];
+			job->pkt = pkt;
+			job->eof = !pkt.data;
+			job->serial = d->pkt_serial;
+			job->state = INTRA_JOB_QUEUED;
+			p->head = (p->head + 1) % p->nb_jobs;
+			p->nb_queued++;
+			p->nb_pending++;
+			SDL_CondSignal(p->cond);
+			SDL_UnlockMutex(p->mutex);
+		}
+		if (!p->nb_pending)
+			continue;
 
-		/* wait until the picture is allocated */
-		SDL_LockMutex(is->pictq.mutex);
-		while (!vp->allocated && !is->videoq.abort_request) {
-			SDL_CondWait(is->pictq.cond, is->pictq.mutex);
+		SDL_LockMutex(p->mutex);
+		job = &p->jobs[p->tail];
+		while (job->state != INTRA_JOB_DONE)
+			cond_wait(p->done_cond, p->mutex);
+		job->state = INTRA_JOB_FREE;
+		p->tail = (p->tail + 1) % p->nb_jobs;
+		p->nb_pending--;
+		SDL_UnlockMutex(p->mutex);
+
+		if (job->serial != d->queue->serial) {
+			av_frame_unref(job->frame);
+			continue;
 		}
-		/* if the queue is aborted, we have to pop the pending ALLOC event or wait for the allocation to complete */
-		if (is->videoq.abort_request &&
-		    SDL_PeepEvents(&event, 1, SDL_GETEVENT, FF_ALLOC_EVENT, FF_ALLOC_EVENT) != 1) {
-			while (!vp->allocated && !is->abort_request) {
-				SDL_CondWait(is->pictq.cond, is->pictq.mutex);
+		d->pkt_serial = job->serial;
+		if (!job->got_frame) {
+			if (job->eof) {
+				d->finished = job->serial;
+				return 0;
 			}
+			continue;
 		}
-		SDL_UnlockMutex(is->pictq.mutex);
-
-		if (is->videoq.abort_request)
-			return -1;
-	}
-
-	/* if the frame is not skipped, then display it */
-	if (vp->bmp) {
-		vp->pts = pts;
-		vp->duration = duration;
-		vp->pos = pos;
-		vp->serial = serial;
-
-		av_frame_move_ref(vp->frame, src_frame);
-		frame_queue_push(&is->pictq);
+		av_frame_move_ref(frame, job->frame);
+		if (decoder_reorder_pts == -1) {
+			frame->pts = av_frame_get_best_effort_timestamp(frame);
+		} else if (!decoder_reorder_pts) {
+			frame->pts = frame->pkt_dts;
+		}
+		return 1;
 	}
-	return 0;
 }
 
-static int get_video_frame(VideoState *is, AVFrame *frame)
+static int decoder_decode_frame(Decoder *d, AVFrame *frame)
 {
-	int got_picture;
+	int got_frame = 0;
+	AVPacket pkt;
 
-	if ((got_picture = decoder_decode_frame(&is->viddec, frame)) < 0)
-		return -1;
+	if (d->intra)
+		return intra_pool_decode_frame(d, frame);
 
-	if (got_picture) {
-		double dpts = NAN;
+	do {
+		int ret = -1;
 
-		if (frame->pts != AV_NOPTS_VALUE)
-			dpts = av_q2d(is->video_st->time_base) * frame->pts;
+		if (d->queue->abort_request)
+			return -1;
 
-		frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_st,
-		                             frame);
+		if (!d->packet_pending || d->queue->serial != d->pkt_serial) {
+			do {
+				if (d->queue->nb_packets == 0)
+					SDL_CondSignal(d->empty_queue_cond);
+				if (packet_queue_get(d->queue, &pkt, 1, &d->pkt_serial) < 0)
+					return -1;
+				if (pkt.data == flush_pkt.data)
+					decoder_flush(d);
+			} while (pkt.data == flush_pkt.data || d->queue->serial != d->pkt_serial);
+			av_packet_unref(&d->pkt);
+			d->pkt_temp = d->pkt = pkt;
+			d->packet_pending = 1;
+			/* the pictures come out with these pts unless reorder_pts is off */
+			if (d->avctx->codec_type == AVMEDIA_TYPE_VIDEO && d->avctx->skip_frame > AVDISCARD_DEFAULT &&
+			    pkt.data && pkt.pts != AV_NOPTS_VALUE && decoder_reorder_pts)
+				decoder_add_skipped(d, pkt.pts);
+		}
 
-		if (framedrop > 0 || framedrop) {
-			if (frame->pts != AV_NOPTS_VALUE) {
-				double diff = dpts - get_master_clock(is);
-				if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
-				    diff - is->frame_last_filter_delay < 0 &&
-				    is->viddec.pkt_serial == is->vidclk.serial &&
-				    is->videoq.nb_packets) {
-					is->frame_drops_early++;
-					av_frame_unref(frame);
-					got_picture = 0;
+		switch (d->avctx->codec_type) {
+		case AVMEDIA_TYPE_VIDEO:
+			if (d->bypass_format >= 0 && (ret = decoder_wrap_packet(d, frame, &d->pkt_temp)) >= 0)
+				got_frame = 1;
+			else
+				ret = avcodec_decode_video2(d->avctx, frame, &got_frame, &d->pkt_temp);
+			if (got_frame) {
+				if (decoder_reorder_pts == -1) {
+					frame->pts = av_frame_get_best_effort_timestamp(frame);
+				} else if (!decoder_reorder_pts) {
+					frame->pts = frame->pkt_dts;
+				}
+			}
+			break;
+		case AVMEDIA_TYPE_AUDIO:
+			if (d->bypass_format >= 0 && (ret = decoder_wrap_packet(d, frame, &d->pkt_temp)) >= 0)
+				got_frame = 1;
+			else
+				ret = avcodec_decode_audio4(d->avctx, frame, &got_frame, &d->pkt_temp);
+			if (got_frame) {
+				AVRational tb = (AVRational) {
+					1, frame->sample_rate
+				};
+				if (frame->pts != AV_NOPTS_VALUE)
+					frame->pts = av_rescale_q(frame->pts, av_codec_get_pkt_timebase(d->avctx), tb);
+				else if (d->next_pts != AV_NOPTS_VALUE)
+					frame->pts = av_rescale_q(d->next_pts, d->next_pts_tb, tb);
+				if (frame->pts != AV_NOPTS_VALUE) {
+					d->next_pts = frame->pts + frame->nb_samples;
+					d->next_pts_tb = tb;
 				}
 			}
+			break;
+		default:
+			break;
 		}
-	}
-
-	return got_picture;
-}
 
-static int configure_filtergraph(AVFilterGraph *graph, const char *filtergraph,
-                                 AVFilterContext *source_ctx, AVFilterContext *sink_ctx)
-{
+		if (ret < 0) {
+			d->packet_pending = 0;
+		} else {
+			d->pkt_temp.dts = d->pkt_temp.pts = AV_NOPTS_VALUE;
+			if (d->pkt_temp.data) {
+				if (d->avctx->codec_type != AVMEDIA_TYPE_AUDIO)
+					ret = d->pkt_temp.size;
+				d->pkt_temp.data += ret;
+				d->pkt_temp.size -= ret;
+				if (d->pkt_temp.size <= 0)
+					d->packet_pending = 0;
+			} else {
+				if (!got_frame) {
+					d->packet_pending = 0;
+					d->finished = d->pkt_serial;
+				}
+			}
+		}
+	} while (!got_frame && !d->finished);
+
+	return got_frame;
+}
+
+static void decoder_destroy(Decoder *d)
+{
+	intra_pool_free(&d->intra);
+	av_packet_unref(&d->pkt);
+	avcodec_free_context(&d->avctx);
+}
+
+static void frame_queue_unref_item(Frame *vp)
+{
+	av_frame_unref(vp->frame);
+}
+
+static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size,
+                            int keep_last)
+{
+	int i;
+	memset(f, 0, sizeof(FrameQueue));
+	if (!(f->mutex = SDL_CreateMutex())) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
+	}
+	if (!(f->cond = SDL_CreateCond())) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
+	}
+	f->pktq = pktq;
+	f->max_size = FFMIN(max_size, FRAME_QUEUE_SIZE);
+	f->limit = f->max_size;
+	f->keep_last = !!keep_last;
+	for (i = 0; i < f->max_size; i++)
+		if (!(f->queue[i].frame = av_frame_alloc()))
+			return AVERROR(ENOMEM);
+	return 0;
+}
+
+static void frame_free_tiles(Frame *vp)
+{
+	int i;
+
+	if (!vp->tiles)
+		return;
+	for (i = 0; i < vp->tiles_x * vp->tiles_y; i++)
+		if (vp->tiles[i])
+			SDL_DestroyTexture(vp->tiles[i]);
+	av_freep(&vp->tiles);
+	vp->bmp = NULL;
+	vp->tiles_x = vp->tiles_y = 0;
+}
+
+static void frame_queue_destroy(FrameQueue *f)
+{
+	int i;
+	for (i = 0; i < f->max_size; i++) {
+		Frame *vp = &f->queue[i];
+		frame_queue_unref_item(vp);
+		av_frame_free(&vp->frame);
+		frame_free_tiles(vp);
+		if (vp->bmp)
+			SDL_DestroyTexture(vp->bmp);
+		vp->bmp = NULL;
+	}
+	SDL_DestroyMutex(f->mutex);
+	SDL_DestroyCond(f->cond);
+}
+
+static void frame_queue_signal(FrameQueue *f)
+{
+	SDL_LockMutex(f->mutex);
+	SDL_CondSignal(f->cond);
+	SDL_UnlockMutex(f->mutex);
+}
+
+static Frame *frame_queue_peek(FrameQueue *f)
+{
+	return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+}
+
+static Frame *frame_queue_peek_next(FrameQueue *f)
+{
+	return &f->queue[(f->rindex + f->rindex_shown + 1) % f->max_size];
+}
+
+static Frame *frame_queue_peek_last(FrameQueue *f)
+{
+	return &f->queue[f->rindex];
+}
+
+static Frame *frame_queue_peek_writable(FrameQueue *f)
+{
+	/* wait until we have space to put a new frame */
+	SDL_LockMutex(f->mutex);
+	while (f->size >= f->limit &&
+	       !f->pktq->abort_request) {
+		cond_wait(f->cond, f->mutex);
+	}
+	SDL_UnlockMutex(f->mutex);
+
+	if (f->pktq->abort_request)
+		return NULL;
+
+	return &f->queue[f->windex];
+}
+
+static void frame_queue_set_limit(FrameQueue *f, int limit)
+{
+	SDL_LockMutex(f->mutex);
+	f->limit = av_clip(limit, f->keep_last + 2, f->max_size);
+	SDL_CondSignal(f->cond);
+	SDL_UnlockMutex(f->mutex);
+}
+
+static Frame *frame_queue_peek_readable(FrameQueue *f)
+{
+	/* wait until we have a readable a new frame */
+	SDL_LockMutex(f->mutex);
+	while (f->size - f->rindex_shown <= 0 &&
+	       !f->pktq->abort_request) {
+		cond_wait(f->cond, f->mutex);
+	}
+	SDL_UnlockMutex(f->mutex);
+
+	if (f->pktq->abort_request)
+		return NULL;
+
+	return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+}
+
+static void frame_queue_push(FrameQueue *f)
+{
+	if (++f->windex == f->max_size)
+		f->windex = 0;
+	SDL_LockMutex(f->mutex);
+	f->size++;
+	SDL_CondSignal(f->cond);
+	SDL_UnlockMutex(f->mutex);
+}
+
+static void frame_queue_next(FrameQueue *f)
+{
+	if (f->keep_last && !f->rindex_shown) {
+		f->rindex_shown = 1;
+		return;
+	}
+	frame_queue_unref_item(&f->queue[f->rindex]);
+	if (++f->rindex == f->max_size)
+		f->rindex = 0;
+	SDL_LockMutex(f->mutex);
+	f->size--;
+	SDL_CondSignal(f->cond);
+	SDL_UnlockMutex(f->mutex);
+}
+
+/* return the number of undisplayed frames in the queue */
+static int frame_queue_nb_remaining(FrameQueue *f)
+{
+	return f->size - f->rindex_shown;
+}
+
+static const char *const seek_stage_names[SEEK_STAGE_NB] = {
+	"request", "seek", "flush", "decoder_flush", "keyframe", "filter", "upload", "present"
+};
+
+static void seek_stats_start(VideoState *is)
+{
+	SeekStats *s = &is->seek_stats;
+
+	SDL_LockMutex(s->mutex);
+	memset(s->t, 0, sizeof(s->t));
+	s->serial = -1;
+	s->t[SEEK_STAGE_REQUEST] = av_gettime_relative();
+	s->active = 1;
+	SDL_UnlockMutex(s->mutex);
+}
+
+/* the seek failed or no frame will follow it */
+static void seek_stats_cancel(VideoState *is)
+{
+	SDL_LockMutex(is->seek_stats.mutex);
+	is->seek_stats.active = 0;
+	SDL_UnlockMutex(is->seek_stats.mutex);
+}
+
+/* whether the first frame of the seek in flight with the given serial, or
+   of any seek if serial < 0, has yet to be presented */
+static int seek_stats_pending(VideoState *is, int serial)
+{
+	SeekStats *s = &is->seek_stats;
+	int ret;
+
+	SDL_LockMutex(s->mutex);
+	ret = s->active && (serial < 0 || s->serial == serial);
+	SDL_UnlockMutex(s->mutex);
+	return ret;
+}
+
+/* record the time a stage was first reached for the seek with the given serial */
+static void seek_stats_mark(VideoState *is, enum SeekStage stage, int serial,
+                            int64_t time)
+{
+	SeekStats *s = &is->seek_stats;
+
+	SDL_LockMutex(s->mutex);
+	if (s->active && s->serial == serial && !s->t[stage])
+		s->t[stage] = time ? time : av_gettime_relative();
+	SDL_UnlockMutex(s->mutex);
+}
+
+static void seek_stats_flushed(VideoState *is, int serial)
+{
+	SeekStats *s = &is->seek_stats;
+
+	SDL_LockMutex(s->mutex);
+	if (s->active) {
+		s->serial = serial;
+		s->t[SEEK_STAGE_FLUSH] = av_gettime_relative();
+	}
+	SDL_UnlockMutex(s->mutex);
+}
+
+/* called by the main thread after each presented video frame */
+static void seek_stats_present(VideoState *is, int serial)
+{
+	SeekStats *s = &is->seek_stats;
+	int64_t last;
+	char buf[256] = "";
+	int i;
+
+	SDL_LockMutex(s->mutex);
+	if (!s->active || s->serial != serial) {
+		SDL_UnlockMutex(s->mutex);
+		return;
+	}
+	s->t[SEEK_STAGE_PRESENT] = av_gettime_relative();
+
+	last = s->t[SEEK_STAGE_REQUEST];
+	for (i = SEEK_STAGE_REQUEST + 1; i < SEEK_STAGE_NB; i++) {
+		/* a skipped stage took no time */
+		int64_t d = s->t[i] ? FFMAX(s->t[i] - last, 0) : 0;
+		s->total[i] += d;
+		s->max[i] = FFMAX(s->max[i], d);
+		av_strlcatf(buf, sizeof(buf), " %s %.1f", seek_stage_names[i], d / 1000.0);
+		last = FFMAX(last, s->t[i]);
+	}
+	s->nb_seeks++;
+	s->active = 0;
+	last = s->t[SEEK_STAGE_PRESENT] - s->t[SEEK_STAGE_REQUEST];
+	SDL_UnlockMutex(s->mutex);
+	av_log(NULL, AV_LOG_INFO, "seek: first frame after %.1f ms:%s\n", last / 1000.0, buf);
+}
+
+static inline void fill_rectangle(int x, int y, int w, int h)
+{
+	SDL_Rect rect;
+	rect.x = x;
+	rect.y = y;
+	rect.w = w;
+	rect.h = h;
+	if (w && h)
+		SDL_RenderFillRect(renderer, &rect);
+}
+
+static int realloc_texture(SDL_Texture **texture, Uint32 new_format,
+                           int new_width, int new_height, SDL_BlendMode blendmode, int init_texture)
+{
+	Uint32 format;
+	int access, w, h;
+	if (SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 ||
+	    new_width != w || new_height != h || new_format != format) {
+		void *pixels;
+		int pitch;
+		SDL_DestroyTexture(*texture);
+		if (!(*texture = SDL_CreateTexture(renderer, new_format,
+		                                   SDL_TEXTUREACCESS_STREAMING, new_width, new_height)))
+			return -1;
+		if (SDL_SetTextureBlendMode(*texture, blendmode) < 0)
+			return -1;
+		if (init_texture) {
+			if (SDL_LockTexture(*texture, NULL, &pixels, &pitch) < 0)
+				return -1;
+			memset(pixels, 0, pitch * new_height);
+			SDL_UnlockTexture(*texture);
+		}
+	}
+	return 0;
+}
+
+/* the largest rectangle of the picture aspect ratio centered on the screen */
+static void calculate_display_rect(SDL_Rect *rect, int scr_width, int scr_height,
+                                   int pic_width, int pic_height, AVRational pic_sar)
+{
+	double aspect_ratio = pic_sar.num > 0 && pic_sar.den > 0 ? av_q2d(pic_sar) : 1.0;
+	int width, height;
+
+	/* the screen is assumed to have square pixels */
+	aspect_ratio *= (double)pic_width / pic_height;
+	height = scr_height;
+	width = lrint(height * aspect_ratio) & ~1;
+	if (width > scr_width) {
+		width = scr_width;
+		height = lrint(width / aspect_ratio) & ~1;
+	}
+	rect->x = (scr_width - width) / 2;
+	rect->y = (scr_height - height) / 2;
+	rect->w = FFMAX(width,  1);
+	rect->h = FFMAX(height, 1);
+}
+
+#define ZOOM_MAX 16.0
+
+/**
+ * The part of the picture that is visible at the current zoom, which is
+ * all that gets converted and uploaded. It starts on a chroma sample so
+ * that the planes can be addressed from its corner.
+ */
+static SDL_Rect calculate_viewport(VideoState *is, Frame *vp)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(vp->format);
+	int ax = desc ? (1 << desc->log2_chroma_w) - 1 : 0;
+	int ay = desc ? (1 << desc->log2_chroma_h) - 1 : 0;
+	SDL_Rect r;
+
+	r.w = av_clip(lrint(vp->width / is->zoom), 1, vp->width);
+	r.h = av_clip(lrint(vp->height / is->zoom), 1, vp->height);
+	r.x = av_clip(lrint(is->zoom_cx * vp->width - r.w / 2.0), 0, vp->width - r.w);
+	r.y = av_clip(lrint(is->zoom_cy * vp->height - r.h / 2.0), 0, vp->height - r.h);
+	r.w += r.x & ax;
+	r.x &= ~ax;
+	r.h += r.y & ay;
+	r.y &= ~ay;
+	return r;
+}
+
+static void set_zoom(VideoState *is, double zoom, double cx, double cy)
+{
+	is->zoom = av_clipd(zoom, 1.0, ZOOM_MAX);
+	is->zoom_cx = av_clipd(cx, 0.5 / is->zoom, 1.0 - 0.5 / is->zoom);
+	is->zoom_cy = av_clipd(cy, 0.5 / is->zoom, 1.0 - 0.5 / is->zoom);
+	is->force_refresh = 1;
+}
+
+/* pointers to the corner of r in the planes of frame, 0 if they cannot be addressed so */
+static int frame_region(const AVFrame *frame, const SDL_Rect *r, uint8_t *data[4])
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int max_step[4], i;
+
+	if (!desc || desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL))
+		return 0;
+	av_image_fill_max_pixsteps(max_step, NULL, desc);
+	for (i = 0; i < 4; i++) {
+		int sx = i == 1 || i == 2 ? desc->log2_chroma_w : 0;
+		int sy = i == 1 || i == 2 ? desc->log2_chroma_h : 0;
+		data[i] = frame->data[i] ? frame->data[i] + (r->y >> sy) * frame->linesize[i] +
+		          (r->x >> sx) * max_step[i] : NULL;
+	}
+	return 1;
+}
+
+/**
+ * Convert and upload the part *src of frame. *src is widened to the whole
+ * picture if the pixel format cannot be addressed by region.
+ */
+static int upload_texture(SDL_Texture *tex, AVFrame *frame,
+                          struct SwsContext **img_convert_ctx, SDL_Rect *src)
+{
+	uint64_t pc[PERF_COUNTER_NB], pc_sws[PERF_COUNTER_NB];
+	int perf = perf_begin(pc);
+	uint8_t *data[4];
+	int ret = 0;
+
+	if (!frame_region(frame, src, data)) {
+		src->x = src->y = 0;
+		src->w = frame->width;
+		src->h = frame->height;
+		memcpy(data, frame->data, sizeof(data));
+	}
+	switch (frame->format) {
+	case AV_PIX_FMT_YUV420P:
+		ret = SDL_UpdateYUVTexture(tex, src, data[0], frame->linesize[0],
+		                           data[1], frame->linesize[1],
+		                           data[2], frame->linesize[2]);
+		break;
+	case AV_PIX_FMT_BGRA:
+		ret = SDL_UpdateTexture(tex, src, data[0], frame->linesize[0]);
+		break;
+	default:
+		/* This should only happen if we are not using avfilter... */
+		*img_convert_ctx = sws_getCachedContext(*img_convert_ctx,
+		                                        src->w, src->h, frame->format, src->w, src->h,
+		                                        AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
+		if (*img_convert_ctx != NULL) {
+			uint8_t *pixels[4];
+			int pitch[4];
+			if (!SDL_LockTexture(tex, src, (void **)pixels, pitch)) {
+				int perf_sws = perf_begin(pc_sws);
+				sws_scale(*img_convert_ctx, (const uint8_t *const *)data,
+				          frame->linesize,
+				          0, src->h, pixels, pitch);
+				if (perf_sws)
+					perf_end(PERF_REGION_SWS, pc_sws, src->w * src->h);
+				SDL_UnlockTexture(tex);
+			}
+		} else {
+			av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
+			ret = -1;
+		}
+		break;
+	}
+	if (perf)
+		perf_end(PERF_REGION_UPLOAD, pc, src->w * src->h);
+	return ret;
+}
+
+/**
+ * Threads of the main thread's rendering work: the jobs of one call are
+ * spread over them and the calling thread, which returns when all are done.
+ */
+#define WORK_THREADS_MAX 8
+
+typedef struct WorkPool {
+	SDL_Thread *threads[WORK_THREADS_MAX];
+	int nb_threads;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	int quit;
+	void (*func)(void *opaque, int job);
+	void *opaque;
+	int nb_jobs;
+	int next;
+	int done;
+} WorkPool;
+
+static WorkPool render_pool;
+
+static int work_pool_thread(void *arg)
+{
+	WorkPool *p = arg;
+	int job;
+
+	SDL_LockMutex(p->mutex);
+	for (;;) {
+		while (!p->quit && p->next >= p->nb_jobs)
+			cond_wait(p->cond, p->mutex);
+		if (p->quit)
+			break;
+		job = p->next++;
+		SDL_UnlockMutex(p->mutex);
+		p->func(p->opaque, job);
+		SDL_LockMutex(p->mutex);
+		if (++p->done == p->nb_jobs)
+			SDL_CondBroadcast(p->cond);
+	}
+	SDL_UnlockMutex(p->mutex);
+	return 0;
+}
+
+static int work_pool_init(WorkPool *p, const char *name)
+{
+	int i;
+
+	if (p->mutex)
+		return 0;
+	if (!(p->mutex = SDL_CreateMutex()) || !(p->cond = SDL_CreateCond()))
+		return AVERROR(ENOMEM);
+	p->nb_threads = av_clip(SDL_GetCPUCount() - 1, 0, WORK_THREADS_MAX);
+	for (i = 0; i < p->nb_threads; i++)
+		if (!(p->threads[i] = SDL_CreateThread(work_pool_thread, name, p))) {
+			p->nb_threads = i;
+			break;
+		}
+	return 0;
+}
+
+static void work_pool_run(WorkPool *p, void (*func)(void *opaque, int job), void *opaque, int nb_jobs)
+{
+	int job;
+
+	SDL_LockMutex(p->mutex);
+	p->func = func;
+	p->opaque = opaque;
+	p->nb_jobs = nb_jobs;
+	p->next = p->done = 0;
+	SDL_CondBroadcast(p->cond);
+	while (p->next < p->nb_jobs) {
+		job = p->next++;
+		SDL_UnlockMutex(p->mutex);
+		func(opaque, job);
+		SDL_LockMutex(p->mutex);
+		p->done++;
+	}
+	while (p->done < p->nb_jobs)
+		cond_wait(p->cond, p->mutex);
+	p->nb_jobs = p->next = p->done = 0;
+	SDL_UnlockMutex(p->mutex);
+}
+
+static void work_pool_close(WorkPool *p)
+{
+	int i;
+
+	if (!p->mutex)
+		return;
+	SDL_LockMutex(p->mutex);
+	p->quit = 1;
+	SDL_CondBroadcast(p->cond);
+	SDL_UnlockMutex(p->mutex);
+	for (i = 0; i < p->nb_threads; i++)
+		SDL_WaitThread(p->threads[i], NULL);
+	SDL_DestroyMutex(p->mutex);
+	SDL_DestroyCond(p->cond);
+	memset(p, 0, sizeof(*p));
+}
+
+/**
+ * Pictures larger than the renderer's maximum texture size are split into a
+ * grid of textures. The tiles are locked by the main thread, filled in
+ * parallel on the render pool and composited by the renderer.
+ */
+#define TILES_MAX 64
+
+typedef struct TileUploader {
+	const AVFrame *frame;
+	Frame *vp;
+	int jobs[TILES_MAX];    /* tile indices to copy */
+	uint8_t *pixels[TILES_MAX];
+	int pitch[TILES_MAX];
+	int nb_jobs;
+	AVFrame *conv;          /* BGRA copy of pictures in other formats */
+} TileUploader;
+
+static TileUploader tile_uploader;
+
+static int alloc_tiles(Frame *vp, Uint32 format)
+{
+	int max_w = renderer_info.max_texture_width & ~1;
+	int max_h = renderer_info.max_texture_height & ~1;
+	int i;
+
+	frame_free_tiles(vp);
+	if (vp->bmp)
+		SDL_DestroyTexture(vp->bmp);
+	vp->bmp = NULL;
+
+	vp->tiles_x = (vp->width + max_w - 1) / max_w;
+	vp->tiles_y = (vp->height + max_h - 1) / max_h;
+	if (vp->tiles_x * vp->tiles_y > TILES_MAX)
+		return -1;
+	/* even sizes, the chroma of each tile starts on a sample */
+	vp->tile_w = FFALIGN((vp->width + vp->tiles_x - 1) / vp->tiles_x, 2);
+	vp->tile_h = FFALIGN((vp->height + vp->tiles_y - 1) / vp->tiles_y, 2);
+	if (!(vp->tiles = av_mallocz_array(vp->tiles_x * vp->tiles_y, sizeof(*vp->tiles))))
+		return -1;
+	for (i = 0; i < vp->tiles_x * vp->tiles_y; i++) {
+		int x = i % vp->tiles_x * vp->tile_w, y = i / vp->tiles_x * vp->tile_h;
+		if (realloc_texture(&vp->tiles[i], format, FFMIN(vp->tile_w, vp->width - x),
+		                    FFMIN(vp->tile_h, vp->height - y), SDL_BLENDMODE_NONE, 0) < 0)
+			return -1;
+	}
+	vp->bmp = vp->tiles[0];
+	av_log(NULL, AV_LOG_VERBOSE, "%dx%d picture split into %dx%d textures of %dx%d\n",
+	       vp->width, vp->height, vp->tiles_x, vp->tiles_y, vp->tile_w, vp->tile_h);
+	return 0;
+}
+
+/* position of tile i in the picture */
+static SDL_Rect tile_rect(Frame *vp, int i)
+{
+	SDL_Rect r;
+
+	r.x = i % vp->tiles_x * vp->tile_w;
+	r.y = i / vp->tiles_x * vp->tile_h;
+	r.w = FFMIN(vp->tile_w, vp->width - r.x);
+	r.h = FFMIN(vp->tile_h, vp->height - r.y);
+	return r;
+}
+
+static void tile_copy(void *opaque, int job)
+{
+	TileUploader *u = opaque;
+	const AVFrame *f = u->frame;
+	SDL_Rect r = tile_rect(u->vp, u->jobs[job]);
+	uint8_t *dst = u->pixels[job];
+	int pitch = u->pitch[job];
+
+	if (f->format == AV_PIX_FMT_YUV420P) {
+		/* YV12 as locked: Y, then V and U at half the pitch */
+		int cw = (r.w + 1) / 2, ch = (r.h + 1) / 2;
+		av_image_copy_plane(dst, pitch, f->data[0] + r.y * f->linesize[0] + r.x,
+		                    f->linesize[0], r.w, r.h);
+		dst += pitch * r.h;
+		av_image_copy_plane(dst, pitch / 2, f->data[2] + r.y / 2 * f->linesize[2] + r.x / 2,
+		                    f->linesize[2], cw, ch);
+		dst += pitch / 2 * ch;
+		av_image_copy_plane(dst, pitch / 2, f->data[1] + r.y / 2 * f->linesize[1] + r.x / 2,
+		                    f->linesize[1], cw, ch);
+	} else {
+		av_image_copy_plane(dst, pitch, f->data[0] + r.y * f->linesize[0] + r.x * 4,
+		                    f->linesize[0], r.w * 4, r.h);
+	}
+}
+
+/* upload the tiles of vp that intersect the visible part of the picture */
+static int upload_tiles(VideoState *is, Frame *vp, const SDL_Rect *visible)
+{
+	TileUploader *u = &tile_uploader;
+	const AVFrame *frame = vp->frame;
+	int i, ret = 0;
+
+	if (work_pool_init(&render_pool, "render") < 0)
+		return -1;
+	u->vp = vp;
+	u->nb_jobs = 0;
+	for (i = 0; i < vp->tiles_x * vp->tiles_y; i++) {
+		SDL_Rect r = tile_rect(vp, i);
+		if (vp->tiles_uploaded & (1ULL << i) || !SDL_HasIntersection(&r, visible))
+			continue;
+		if (SDL_LockTexture(vp->tiles[i], NULL, (void **)&u->pixels[u->nb_jobs],
+		                    &u->pitch[u->nb_jobs]) < 0) {
+			ret = -1;
+			break;
+		}
+		u->jobs[u->nb_jobs++] = i;
+	}
+	if (!u->nb_jobs)
+		return ret;
+
+	if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_BGRA) {
+		is->img_convert_ctx = sws_getCachedContext(is->img_convert_ctx,
+		                      frame->width, frame->height, frame->format, frame->width, frame->height,
+		                      AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
+		if (!u->conv && !(u->conv = av_frame_alloc()))
+			ret = -1;
+		else if (u->conv->width != frame->width || u->conv->height != frame->height) {
+			av_frame_unref(u->conv);
+			u->conv->format = AV_PIX_FMT_BGRA;
+			u->conv->width = frame->width;
+			u->conv->height = frame->height;
+			if (av_frame_get_buffer(u->conv, 32) < 0)
+				ret = -1;
+		}
+		if (ret < 0 || !is->img_convert_ctx) {
+			for (i = 0; i < u->nb_jobs; i++)
+				SDL_UnlockTexture(vp->tiles[u->jobs[i]]);
+			u->nb_jobs = 0;
+			return -1;
+		}
+		sws_scale(is->img_convert_ctx, (const uint8_t *const *)frame->data, frame->linesize,
+		          0, frame->height, u->conv->data, u->conv->linesize);
+		frame = u->conv;
+	}
+	u->frame = frame;
+
+	work_pool_run(&render_pool, tile_copy, u, u->nb_jobs);
+
+	for (i = 0; i < u->nb_jobs; i++) {
+		SDL_UnlockTexture(vp->tiles[u->jobs[i]]);
+		vp->tiles_uploaded |= 1ULL << u->jobs[i];
+	}
+	u->nb_jobs = 0;
+	return ret;
+}
+
+/**
+ * Presentation without a renderer, for hosts where SDL only has its
+ * software one, which would convert and scale the texture again on every
+ * present. The picture is converted and scaled once, straight into the
+ * display rectangle of the window surface, and the bars around it are
+ * cleared. The picture is scaled in one piece: a scaler only sees the rows
+ * it is given, so bands would clamp the vertical filter taps and chroma
+ * phase at their edges. The scaler is kept for as long as the sizes do not
+ * change.
+ */
+typedef struct SwOutput {
+	int active;
+	enum AVPixelFormat format;      /* of the window surface */
+	struct SwsContext *sws;
+} SwOutput;
+
+static SwOutput sw_out;
+
+static enum AVPixelFormat sdl_to_av_format(Uint32 format)
+{
+	switch (format) {
+	case SDL_PIXELFORMAT_ARGB8888: return AV_PIX_FMT_RGB32;
+	case SDL_PIXELFORMAT_RGB888:   return AV_PIX_FMT_0RGB32;
+	case SDL_PIXELFORMAT_ABGR8888: return AV_PIX_FMT_BGR32;
+	case SDL_PIXELFORMAT_BGR888:   return AV_PIX_FMT_0BGR32;
+	case SDL_PIXELFORMAT_RGB565:   return AV_PIX_FMT_RGB565;
+	}
+	return AV_PIX_FMT_NONE;
+}
+
+static int sw_output_open(void)
+{
+	SDL_Surface *surface = SDL_GetWindowSurface(window);
+
+	if (!surface || (sw_out.format = sdl_to_av_format(surface->format->format)) == AV_PIX_FMT_NONE)
+		return -1;
+	sw_out.active = 1;
+	av_log(NULL, AV_LOG_VERBOSE, "Presenting %s frames through the window surface.\n",
+	       av_get_pix_fmt_name(sw_out.format));
+	return 0;
+}
+
+static void sw_output_close(void)
+{
+	sws_freeContext(sw_out.sws);
+	memset(&sw_out, 0, sizeof(sw_out));
+}
+
+static void sw_output_display(VideoState *is)
+{
+	SwOutput *o = &sw_out;
+	SDL_Surface *surface = SDL_GetWindowSurface(window);
+	Frame *vp = frame_queue_peek_last(&is->pictq);
+	uint64_t pc[PERF_COUNTER_NB];
+	uint8_t *src_data[4], *dst[4] = { NULL };
+	int dst_linesize[4] = { 0 };
+	SDL_Rect src, rect, bars[4];
+	int i, perf;
+
+	if (!surface)
+		return;
+	if (!is->video_st || !is->pictq.rindex_shown) {
+		SDL_FillRect(surface, NULL, 0);
+		SDL_UpdateWindowSurface(window);
+		return;
+	}
+
+	src = calculate_viewport(is, vp);
+	if (!frame_region(vp->frame, &src, src_data)) {
+		src.x = src.y = 0;
+		src.w = vp->frame->width;
+		src.h = vp->frame->height;
+		memcpy(src_data, vp->frame->data, sizeof(src_data));
+	}
+	calculate_display_rect(&rect, surface->w, surface->h, src.w, src.h, vp->sar);
+	rect.w = FFMIN(rect.w, surface->w);
+	rect.h = FFMIN(rect.h, surface->h);
+	o->sws = sws_getCachedContext(o->sws, src.w, src.h, vp->frame->format,
+	                              rect.w, rect.h, o->format, sws_flags, NULL, NULL, NULL);
+	if (!o->sws) {
+		av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
+		return;
+	}
+
+	/* above, below, left and right of the picture */
+	bars[0] = (SDL_Rect) { 0, 0, surface->w, rect.y };
+	bars[1] = (SDL_Rect) { 0, rect.y + rect.h, surface->w, surface->h - rect.y - rect.h };
+	bars[2] = (SDL_Rect) { 0, rect.y, rect.x, rect.h };
+	bars[3] = (SDL_Rect) { rect.x + rect.w, rect.y, surface->w - rect.x - rect.w, rect.h };
+	for (i = 0; i < 4; i++)
+		if (bars[i].w > 0 && bars[i].h > 0)
+			SDL_FillRect(surface, &bars[i], 0);
+
+	if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0)
+		return;
+	dst[0] = (uint8_t *)surface->pixels + rect.y * surface->pitch + rect.x * surface->format->BytesPerPixel;
+	dst_linesize[0] = surface->pitch;
+	perf = perf_begin(pc);
+	sws_scale(o->sws, (const uint8_t * const *)src_data, vp->frame->linesize, 0, src.h, dst, dst_linesize);
+	if (perf)
+		perf_end(PERF_REGION_SWS, pc, rect.w * rect.h);
+	if (SDL_MUSTLOCK(surface))
+		SDL_UnlockSurface(surface);
+	SDL_UpdateWindowSurface(window);
+
+	if (!vp->uploaded) {
+		vp->uploaded = 1;
+		seek_stats_mark(is, SEEK_STAGE_UPLOAD, vp->serial, 0);
+	}
+}
+
+/* draw the part src of the picture into dst, skipping the tiles outside of it */
+static void render_tiles(Frame *vp, const SDL_Rect *src, const SDL_Rect *dst)
+{
+	int i;
+
+	for (i = 0; i < vp->tiles_x * vp->tiles_y; i++) {
+		SDL_Rect r = tile_rect(vp, i), part, from, to;
+		int x1, y1;
+
+		if (!SDL_IntersectRect(&r, src, &part))
+			continue;
+		/* map both edges so that neighbouring tiles meet without a gap */
+		to.x = dst->x + (int64_t)(part.x - src->x) * dst->w / src->w;
+		to.y = dst->y + (int64_t)(part.y - src->y) * dst->h / src->h;
+		x1 = dst->x + (int64_t)(part.x + part.w - src->x) * dst->w / src->w;
+		y1 = dst->y + (int64_t)(part.y + part.h - src->y) * dst->h / src->h;
+		to.w = x1 - to.x;
+		to.h = y1 - to.y;
+		from.x = part.x - r.x;
+		from.y = part.y - r.y;
+		from.w = part.w;
+		from.h = part.h;
+		SDL_RenderCopy(renderer, vp->tiles[i], &from, &to);
+	}
+}
+
+static void video_image_display(VideoState *is)
+{
+	Frame *vp;
+	Frame *sp = NULL;
+	SDL_Rect rect;
+
+	vp = frame_queue_peek_last(&is->pictq);
+	if (vp->tiles) {
+		SDL_Rect src = calculate_viewport(is, vp);
+
+		calculate_display_rect(&rect, is->width, is->height, src.w, src.h, vp->sar);
+		if (upload_tiles(is, vp, &src) < 0)
+			return;
+		if (!vp->uploaded) {
+			vp->uploaded = 1;
+			seek_stats_mark(is, SEEK_STAGE_UPLOAD, vp->serial, 0);
+		}
+		render_tiles(vp, &src, &rect);
+	} else if (vp->bmp) {
+		SDL_Rect src = calculate_viewport(is, vp), part;
+
+		calculate_display_rect(&rect, is->width, is->height, src.w, src.h, vp->sar);
+
+		/* upload again when panning or zooming out uncovers more of the picture */
+		if (!vp->uploaded || !SDL_IntersectRect(&vp->uploaded_rect, &src, &part) ||
+		    part.w != src.w || part.h != src.h) {
+			vp->uploaded_rect = src;
+			if (upload_texture(vp->bmp, vp->frame, &is->img_convert_ctx, &vp->uploaded_rect) < 0)
+				return;
+			if (!vp->uploaded)
+				seek_stats_mark(is, SEEK_STAGE_UPLOAD, vp->serial, 0);
+			vp->uploaded = 1;
+		}
+
+		SDL_RenderCopy(renderer, vp->bmp, &src, &rect);
+		if (sp) {
+			SDL_RenderCopy(renderer, is->sub_texture, NULL, &rect);
+		}
+	}
+}
+
+static const char *scenario_action_name(enum ScenarioActionType type)
+{
+	static const char *const names[] = {
+		"seek", "seek_rel", "key", "resize", "volume", "quit"
+	};
+	return names[type];
+}
+
+static int scenario_drops(VideoState *is)
+{
+	return is->frame_drops_early + is->frame_drops_late;
+}
+
+/* called by the main thread after each presented video frame */
+static void scenario_on_present(VideoState *is, int serial)
+{
+	ScenarioAction *a;
+
+	if (scenario.pending < 0)
+		return;
+	a = &scenario.actions[scenario.pending];
+	if ((a->wait == SCENARIO_WAIT_SERIAL && serial != a->serial) ||
+	    (a->wait == SCENARIO_WAIT_RESIZE && is->width == a->width &&
+	     is->height == a->height)) {
+		a->latency = av_gettime_relative() / 1000000.0 - a->start_time;
+		scenario.pending = -1;
+	}
+}
+
+static void scenario_print_report(VideoState *is)
+{
+	FILE *f = NULL;
+	int i;
+
+	if (!scenario.nb_actions)
+		return;
+	if (scenario_report && !(f = fopen(scenario_report, "w")))
+		av_log(NULL, AV_LOG_ERROR, "%s: %s\n", scenario_report, strerror(errno));
+	if (f)
+		fprintf(f, "#action\tscheduled\tstarted\tlatency_ms\tdrops\n");
+
+	for (i = 0; i < scenario.next; i++) {
+		ScenarioAction *a = &scenario.actions[i];
+
+		/* the last injected action collects the drops up to now */
+		if (i == scenario.next - 1 && is)
+			a->drops = scenario_drops(is) - a->drops_start;
+		av_log(NULL, AV_LOG_INFO,
+		       "scenario: %-8s at %7.3f (started %7.3f) latency %8.2f ms, %d frames dropped\n",
+		       scenario_action_name(a->type), a->time, a->start_time - scenario.start,
+		       a->latency * 1000.0, a->drops);
+		if (f)
+			fprintf(f, "%s\t%.3f\t%.3f\t%.2f\t%d\n", scenario_action_name(a->type),
+			        a->time, a->start_time - scenario.start, a->latency * 1000.0, a->drops);
+	}
+	if (scenario.next < scenario.nb_actions)
+		av_log(NULL, AV_LOG_WARNING, "scenario: %d actions were never run\n",
+		       scenario.nb_actions - scenario.next);
+	if (f)
+		fclose(f);
+}
+
+static void seek_stats_print_report(VideoState *is)
+{
+	SeekStats *s = &is->seek_stats;
+	int64_t total = 0;
+	int i;
+
+	SDL_LockMutex(s->mutex);
+	if (s->nb_seeks) {
+		for (i = SEEK_STAGE_REQUEST + 1; i < SEEK_STAGE_NB; i++)
+			total += s->total[i];
+		/* run the same scenario with and without -fast_seek to compare the stages */
+		av_log(NULL, AV_LOG_INFO, "seek latency over %d seeks%s: mean %.1f ms\n",
+		       s->nb_seeks, fast_seek ? " with -fast_seek" : "", total / 1000.0 / s->nb_seeks);
+		for (i = SEEK_STAGE_REQUEST + 1; i < SEEK_STAGE_NB; i++)
+			av_log(NULL, AV_LOG_INFO, "  %-14s mean %7.1f ms  max %7.1f ms\n",
+			       seek_stage_names[i], s->total[i] / 1000.0 / s->nb_seeks, s->max[i] / 1000.0);
+	}
+	SDL_UnlockMutex(s->mutex);
+}
+
+static int64_t get_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long pages = -1;
+
+	if (!f)
+		return -1;
+	if (fscanf(f, "%*d %ld", &pages) != 1)
+		pages = -1;
+	fclose(f);
+	return pages < 0 ? -1 : (int64_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+static int64_t get_heap_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#else
+	return -1;
+#endif
+}
+
+static void soak_sample(double time)
+{
+	SoakSample *s;
+
+	if (av_reallocp_array(&soak.samples, soak.nb_samples + 1, sizeof(*soak.samples)) < 0) {
+		soak.nb_samples = 0;
+		return;
+	}
+	s = &soak.samples[soak.nb_samples++];
+	s->time = time;
+	s->rss = get_rss();
+	s->heap = get_heap_in_use();
+}
+
+/* least squares slope of a memory counter over the steady state samples, in bytes/s */
+static double soak_growth_rate(int heap)
+{
+	/* the first quarter of the run is warmup: caches, pools and queues filling up */
+	int i, first = soak.nb_samples / 4, n = soak.nb_samples - first;
+	double mt = 0, mv = 0, stt = 0, stv = 0;
+
+	if (n < 3)
+		return NAN;
+	for (i = first; i < soak.nb_samples; i++) {
+		double v = heap ? soak.samples[i].heap : soak.samples[i].rss;
+		if (v < 0)
+			return NAN;
+		mt += soak.samples[i].time / n;
+		mv += v / n;
+	}
+	for (i = first; i < soak.nb_samples; i++) {
+		double dt = soak.samples[i].time - mt;
+		double v = heap ? soak.samples[i].heap : soak.samples[i].rss;
+		stt += dt * dt;
+		stv += dt * (v - mv);
+	}
+	return stt > 0 ? stv / stt : NAN;
+}
+
+/* print the soak test results, return nonzero if memory kept growing */
+static int soak_print_report(void)
+{
+	double rss_rate, heap_rate;
+	int64_t heap_end;
+	int failed = 0;
+
+	if (!soak.nb_samples)
+		return 0;
+	rss_rate = soak_growth_rate(0) * 3600.0 / 1024.0;
+	heap_rate = soak_growth_rate(1) * 3600.0 / 1024.0;
+
+	av_log(NULL, AV_LOG_INFO,
+	       "soak: %.0f s, %d seeks, %d reconfigurations, rss %"PRId64" -> %"PRId64" KiB\n",
+	       soak.samples[soak.nb_samples - 1].time - soak.start, soak.nb_seeks,
+	       soak.nb_reconfigs, soak.samples[0].rss / 1024,
+	       soak.samples[soak.nb_samples - 1].rss / 1024);
+	if (isnan(rss_rate)) {
+		av_log(NULL, AV_LOG_WARNING, "soak: too few samples to estimate the memory growth\n");
+	} else {
+		av_log(NULL, AV_LOG_INFO, "soak: steady state growth rss %.1f KiB/h, heap %.1f KiB/h\n",
+		       rss_rate, heap_rate);
+		failed = rss_rate > soak_max_growth || heap_rate > soak_max_growth;
+		if (failed)
+			av_log(NULL, AV_LOG_ERROR, "soak: memory grows faster than %.1f KiB/h\n",
+			       soak_max_growth);
+	}
+	/* everything the player allocated itself should be gone after stream_close() */
+	heap_end = get_heap_in_use();
+	if (heap_end >= 0 && soak.baseline_heap >= 0)
+		av_log(NULL, AV_LOG_INFO, "soak: heap after teardown %+"PRId64" KiB over the baseline\n",
+		       (heap_end - soak.baseline_heap) / 1024);
+	av_freep(&soak.samples);
+	return failed;
+}
+
+static void stream_close(VideoState *is);
+static void print_stats(VideoState *is);
+static void shm_ring_publish(AVFrame *frame, double pts, double duration, int serial);
+static void framecrc_close(void);
+
+static int export_open(ExportSink *s, const char *url)
+{
+	s->url = url;
+	if (!strcmp(url, "-") || !strcmp(url, "pipe:"))
+		s->fd = STDOUT_FILENO;
+	else
+		s->fd = open(url, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (s->fd < 0) {
+		int ret = AVERROR(errno);
+		av_log(NULL, AV_LOG_FATAL, "%s: %s\n", url, strerror(errno));
+		return ret;
+	}
+	return 0;
+}
+
+static void export_close(ExportSink *s)
+{
+	if (s->fd < 0)
+		return;
+	av_log(NULL, AV_LOG_INFO, "%s: wrote %"PRId64" frames, %"PRId64" bytes\n",
+	       s->url, s->nb_frames, s->bytes);
+	if (s->fd != STDOUT_FILENO)
+		close(s->fd);
+	s->fd = -1;
+}
+
+static void shm_ring_close(void)
+{
+	if (shm_ring.map) {
+		__atomic_store_n(&shm_ring.hdr->closed, 1, __ATOMIC_RELEASE);
+		munmap(shm_ring.map, shm_ring.map_size);
+	}
+	if (shm_ring.fd >= 0) {
+		close(shm_ring.fd);
+		shm_unlink(shm_name);
+	}
+	shm_ring.map = NULL;
+	shm_ring.fd = -1;
+}
+
+static void shm_input_close(void)
+{
+	ShmInput *in = &shm_in;
+	const char *name = in->name;
+
+	if (in->map)
+		munmap(in->map, in->map_size);
+	if (in->fd >= 0)
+		close(in->fd);
+	memset(in, 0, sizeof(*in));
+	in->fd = -1;
+	in->name = name;
+}
+
+static void pipe_input_close(void)
+{
+	PipeRing *r = &pipe_in;
+
+	if (r->tid) {
+		SDL_LockMutex(r->mutex);
+		r->abort = 1;
+		SDL_CondBroadcast(r->cond);
+		SDL_UnlockMutex(r->mutex);
+		SDL_WaitThread(r->tid, NULL);
+	}
+	if (r->pb) {
+		av_freep(&r->pb->buffer);
+		av_freep(&r->pb);
+	}
+	if (r->own_fd)
+		close(r->fd);
+	av_freep(&r->buf);
+	if (r->cond)
+		SDL_DestroyCond(r->cond);
+	if (r->mutex)
+		SDL_DestroyMutex(r->mutex);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+static void cache_input_close(void)
+{
+	CacheInput *c = &cache_in;
+
+	if (c->map_fd >= 0)
+		close(c->map_fd);
+	if (c->fd >= 0) {
+		/* also drops the lock */
+		close(c->fd);
+		av_log(NULL, AV_LOG_INFO, "cache: %.1f MiB read from disk, %.1f MiB from the network\n",
+		       c->disk_bytes / 1048576.0, c->net_bytes / 1048576.0);
+	}
+	if (c->pb) {
+		av_freep(&c->pb->buffer);
+		av_freep(&c->pb);
+	}
+	avio_closep(&c->remote);
+	av_freep(&c->url);
+	av_freep(&c->path);
+	av_freep(&c->map);
+	av_freep(&c->block);
+	memset(c, 0, sizeof(*c));
+	c->fd = c->map_fd = -1;
+	c->block_index = -1;
+}
+
+static void do_exit(VideoState *is)
+{
+	int ret = 0;
+
+	scenario_print_report(is);
+	if (is) {
+		seek_stats_print_report(is);
+		if (stats_interval >= 0)
+			print_stats(is);
+		else if (perf_counters)
+			perf_print_report();
+		stream_close(is);
+	}
+	export_close(&export_video_sink);
+	export_close(&export_audio_sink);
+	framecrc_close();
+	if (framecrc_mutex)
+		SDL_DestroyMutex(framecrc_mutex);
+	shm_ring_close();
+	shm_input_close();
+	pipe_input_close();
+	cache_input_close();
+	if (mem_budget.psi_fd >= 0)
+		close(mem_budget.psi_fd);
+	if (mem_budget.mutex)
+		SDL_DestroyMutex(mem_budget.mutex);
+	sw_output_close();
+	work_pool_close(&render_pool);
+	av_frame_free(&tile_uploader.conv);
+	if (frame_pool.mutex) {
+		frame_pool_trim(NULL, INT64_MAX);
+		SDL_DestroyMutex(frame_pool.mutex);
+	}
+	if (renderer)
+		SDL_DestroyRenderer(renderer);
+	if (window)
+		SDL_DestroyWindow(window);
+	av_dict_free(&swr_opts);
+	av_dict_free(&sws_dict);
+	av_dict_free(&format_opts);
+	av_dict_free(&codec_opts);
+	av_freep(&scenario.actions);
+	av_freep(&abr.variants);
+	avformat_network_deinit();
+	SDL_Quit();
+	if (soak_duration > 0)
+		ret = soak_print_report();
+	av_log(NULL, AV_LOG_QUIET, "%s", "");
+	exit(ret);
+}
+
+static void set_default_window_size(int width, int height)
+{
+	default_width = width;
+	default_height = height;
+}
+
+static int video_open(VideoState *is, Frame *vp)
+{
+	int w, h;
+
+	if (vp && vp->width)
+		set_default_window_size(vp->width, vp->height);
+
+	if (screen_width) {
+		w = screen_width;
+		h = screen_height;
+	} else {
+		w = default_width;
+		h = default_height;
+	}
+
+	if (!window) {
+		int flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
+		if (!window_title)
+			window_title = input_filename;
+		window = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED,
+		                          SDL_WINDOWPOS_UNDEFINED, w, h, flags);
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+		if (window) {
+			renderer = SDL_CreateRenderer(window, -1,
+			                              SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+			if (renderer) {
+				if (!SDL_GetRendererInfo(renderer, &renderer_info))
+					av_log(NULL, AV_LOG_VERBOSE, "Initialized %s renderer, textures up to %dx%d.\n",
+					       renderer_info.name, renderer_info.max_texture_width,
+					       renderer_info.max_texture_height);
+			}
+			if (sw_output > 0 || (sw_output < 0 && renderer &&
+			                      renderer_info.flags & SDL_RENDERER_SOFTWARE)) {
+				/* a window cannot have both a renderer and a surface */
+				if (renderer)
+					SDL_DestroyRenderer(renderer);
+				renderer = NULL;
+				memset(&renderer_info, 0, sizeof(renderer_info));
+				if (sw_output_open() < 0) {
+					av_log(NULL, AV_LOG_WARNING, "Window surface not usable, using the renderer.\n");
+					if ((renderer = SDL_CreateRenderer(window, -1, 0)))
+						SDL_GetRendererInfo(renderer, &renderer_info);
+				}
+			}
+		}
+	} else {
+		SDL_SetWindowSize(window, w, h);
+	}
+
+	if (!window || (!renderer && !sw_out.active)) {
+		av_log(NULL, AV_LOG_FATAL, "SDL: could not set video mode - exiting\n");
+		do_exit(is);
+	}
+
+	is->width = w;
+	is->height = h;
+
+	return 0;
+}
+
+/* display the current picture, if any */
+static void video_display(VideoState *is)
+{
+	if (!window)
+		video_open(is, NULL);
+
+	if (sw_out.active) {
+		sw_output_display(is);
+	} else {
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+		SDL_RenderClear(renderer);
+		video_image_display(is);
+		SDL_RenderPresent(renderer);
+	}
+	if (is->video_st && is->pictq.rindex_shown) {
+		int serial = frame_queue_peek_last(&is->pictq)->serial;
+		seek_stats_present(is, serial);
+		scenario_on_present(is, serial);
+	}
+}
+
+static double get_clock(Clock *c)
+{
+	if (*c->queue_serial != c->serial)
+		return NAN;
+	if (c->paused) {
+		return c->pts;
+	} else {
+		double time = av_gettime_relative() / 1000000.0;
+		return c->pts_drift + time - (time - c->last_updated) * (1.0 - c->speed);
+	}
+}
+
+static void set_clock_at(Clock *c, double pts, int serial, double time)
+{
+	c->pts = pts;
+	c->last_updated = time;
+	c->pts_drift = c->pts - time;
+	c->serial = serial;
+}
+
+static void set_clock(Clock *c, double pts, int serial)
+{
+	double time = av_gettime_relative() / 1000000.0;
+	set_clock_at(c, pts, serial, time);
+}
+
+static void init_clock(Clock *c, int *queue_serial)
+{
+	c->speed = 1.0;
+	c->paused = 0;
+	c->queue_serial = queue_serial;
+	set_clock(c, NAN, -1);
+}
+
+static void sync_clock_to_slave(Clock *c, Clock *slave)
+{
+	double clock = get_clock(c);
+	double slave_clock = get_clock(slave);
+	if (!isnan(slave_clock) && (isnan(clock) ||
+	                            fabs(clock - slave_clock) > AV_NOSYNC_THRESHOLD))
+		set_clock(c, slave_clock, slave->serial);
+}
+
+/* get the current master clock value */
+static double get_master_clock(VideoState *is)
+{
+	return get_clock(&is->audclk);
+}
+
+/* seek in the stream */
+static void stream_seek(VideoState *is, int64_t pos, int64_t rel,
+                        int seek_by_bytes)
+{
+	if (!is->seek_req) {
+		is->seek_pos = pos;
+		is->seek_rel = rel;
+		is->seek_flags &= ~AVSEEK_FLAG_BYTE;
+		if (seek_by_bytes)
+			is->seek_flags |= AVSEEK_FLAG_BYTE;
+		is->seek_req = 1;
+		if (is->video_st)
+			seek_stats_start(is);
+		SDL_CondSignal(is->continue_read_thread);
+	}
+}
+
+/* seek relative to the current playback position, in seconds */
+static void stream_seek_relative(VideoState *is, double incr)
+{
+	double pos;
+
+	pos = get_master_clock(is);
+	if (isnan(pos))
+		pos = (double)is->seek_pos / AV_TIME_BASE;
+	pos += incr;
+	if (is->ic->start_time != AV_NOPTS_VALUE &&
+	    pos < is->ic->start_time / (double)AV_TIME_BASE)
+		pos = is->ic->start_time / (double)AV_TIME_BASE;
+	stream_seek(is, (int64_t)(pos * AV_TIME_BASE), (int64_t)(incr * AV_TIME_BASE), 0);
+}
+
+static void update_volume(VideoState *is, int sign, int step)
+{
+	is->audio_volume = av_clip(is->audio_volume + sign * step, 0,
+	                           SDL_MIX_MAXVOLUME);
+}
+
+static double compute_target_delay(double delay, VideoState *is)
+{
+	double sync_threshold, diff = 0;
+
+	/* if video is slave, we try to correct big delays by
+	   duplicating or deleting a frame */
+	diff = get_clock(&is->vidclk) - get_master_clock(is);
+
+	/* skip or repeat frame. We take into account the
+	   delay to compute the threshold. I still don't know
+	   if it is the best guess */
+	sync_threshold = FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX,
+	                       delay));
+	if (!isnan(diff) && fabs(diff) < is->max_frame_duration) {
+		if (diff <= -sync_threshold)
+			delay = FFMAX(0, delay + diff);
+		else if (diff >= sync_threshold && delay > AV_SYNC_FRAMEDUP_THRESHOLD)
+			delay = delay + diff;
+		else if (diff >= sync_threshold)
+			delay = 2 * delay;
+	}
+
+	av_log(NULL, AV_LOG_TRACE, "video: delay=%0.3f A-V=%f\n", delay, -diff);
+
+	return delay;
+}
+
+static double vp_duration(VideoState *is, Frame *vp, Frame *nextvp)
+{
+	if (vp->serial == nextvp->serial) {
+		double duration = nextvp->pts - vp->pts;
+		if (isnan(duration) || duration <= 0 || duration > is->max_frame_duration)
+			return vp->duration;
+		else
+			return duration;
+	} else {
+		return 0.0;
+	}
+}
+
+static void update_video_pts(VideoState *is, double pts, int64_t pos,
+                             int serial)
+{
+	/* update current video pts */
+	set_clock(&is->vidclk, pts, serial);
+	sync_clock_to_slave(&is->extclk, &is->vidclk);
+}
+
+/* called to display each frame */
+static void video_refresh(void *opaque, double *remaining_time)
+{
+	VideoState *is = opaque;
+	/* the read thread may reopen the stream meanwhile, the AVStream stays */
+	AVStream *video_st = is->video_st;
+	double time;
+
+	if (is->show_mode != SHOW_MODE_VIDEO && is->audio_st) {
+		time = av_gettime_relative() / 1000000.0;
+		if (is->force_refresh || is->last_vis_time + rdftspeed < time) {
+			video_display(is);
+			is->last_vis_time = time;
+		}
+		*remaining_time = FFMIN(*remaining_time, is->last_vis_time + rdftspeed - time);
+	}
+
+	if (video_st) {
+retry:
+		if (frame_queue_nb_remaining(&is->pictq) == 0) {
+			// nothing to do, no picture to display in the queue
+		} else {
+			double last_duration, duration, delay;
+			Frame *vp, *lastvp;
+			int bypass;
+
+			/* dequeue the picture */
+			lastvp = frame_queue_peek_last(&is->pictq);
+			vp = frame_queue_peek(&is->pictq);
+
+			if (vp->serial != is->videoq.serial) {
+				frame_queue_next(&is->pictq);
+				goto retry;
+			}
+
+			if (lastvp->serial != vp->serial)
+				is->frame_timer = av_gettime_relative() / 1000000.0;
+
+			/* with -fast_seek the first picture of a seek is shown as soon as
+			   it is decoded, neither frame_timer nor the master clock, which
+			   the audio has yet to restart, may hold it back or drop it */
+			bypass = fast_seek && lastvp->serial != vp->serial &&
+			         seek_stats_pending(is, vp->serial);
+
+			/* compute nominal last_duration */
+			last_duration = vp_duration(is, lastvp, vp);
+			delay = bypass ? 0 : compute_target_delay(last_duration, is);
+
+			time = av_gettime_relative() / 1000000.0;
+			if (time < is->frame_timer + delay) {
+				*remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
+				goto display;
+			}
+
+			is->frame_timer += delay;
+			if (bypass || (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX))
+				is->frame_timer = time;
+			if (lastvp->serial == vp->serial) {
+				is->pacing_delay_sum += delay;
+				is->pacing_delay_sum2 += delay * delay;
+				is->pacing_err2 += (time - is->frame_timer) * (time - is->frame_timer);
+				is->nb_paced++;
+			}
+
+			SDL_LockMutex(is->pictq.mutex);
+			if (!isnan(vp->pts))
+				update_video_pts(is, vp->pts, vp->pos, vp->serial);
+			SDL_UnlockMutex(is->pictq.mutex);
+
+			if (!bypass && frame_queue_nb_remaining(&is->pictq) > 1) {
+				Frame *nextvp = frame_queue_peek_next(&is->pictq);
+				duration = vp_duration(is, vp, nextvp);
+				if ((framedrop > 0 || framedrop) && time > is->frame_timer + duration) {
+					is->frame_drops_late++;
+					frame_queue_next(&is->pictq);
+					goto retry;
+				}
+			}
+
+			/* publish the frames that are shown, not those video_refresh() drops */
+			if (shm_name && vp->frame->data[0])
+				shm_ring_publish(vp->frame, vp->pts, vp->duration, vp->serial);
+			frame_queue_next(&is->pictq);
+			is->frames_presented++;
+			is->force_refresh = 1;
+		}
+display:
+		/* display picture */
+		if (is->force_refresh && is->show_mode == SHOW_MODE_VIDEO &&
+		    is->pictq.rindex_shown) {
+			video_display(is);
+			/* keep the texture of a cover or a single picture stream, it is only
+			   presented again on expose and resize, nothing is decoded after seeks */
+			if (!is->still_image && frame_queue_peek_last(&is->pictq)->uploaded &&
+			    (video_st->disposition & AV_DISPOSITION_ATTACHED_PIC ||
+			     video_st->nb_frames == 1)) {
+				av_log(NULL, AV_LOG_VERBOSE, "Still picture cached, video pipeline idle\n");
+				is->still_image = 1;
+			}
+		}
+	}
+	is->force_refresh = 0;
+}
+
+/* allocate a picture (needs to do that in main thread to avoid
+   potential locking problems */
+static void alloc_picture(VideoState *is)
+{
+	Frame *vp;
+	int sdl_format;
+
+	vp = &is->pictq.queue[is->pictq.windex];
+
+	video_open(is, vp);
+
+	if (vp->format == AV_PIX_FMT_YUV420P)
+		sdl_format = SDL_PIXELFORMAT_YV12;
+	else
+		sdl_format = SDL_PIXELFORMAT_ARGB8888;
+
+	if (sw_out.active) {
+		/* presented from the frame itself, see sw_output_display() */
+		frame_free_tiles(vp);
+		if (vp->bmp)
+			SDL_DestroyTexture(vp->bmp);
+		vp->bmp = NULL;
+	} else if ((renderer_info.max_texture_width && vp->width > renderer_info.max_texture_width) ||
+	    (renderer_info.max_texture_height && vp->height > renderer_info.max_texture_height)) {
+		if (alloc_tiles(vp, sdl_format) < 0) {
+			av_log(NULL, AV_LOG_FATAL, "Could not split the %dx%d picture into textures of at most %dx%d\n",
+			       vp->width, vp->height, renderer_info.max_texture_width, renderer_info.max_texture_height);
+			do_exit(is);
+		}
+	} else {
+		frame_free_tiles(vp);
+		if (realloc_texture(&vp->bmp, sdl_format, vp->width, vp->height,
+		                    SDL_BLENDMODE_NONE, 0) < 0) {
+			/* SDL allocates a buffer smaller than requested if the video
+			 * overlay hardware is unable to support the requested size. */
+			av_log(NULL, AV_LOG_FATAL,
+			       "Error: the video system does not support an image\n"
+			       "size of %dx%d pixels. Try using -lowres or -vf \"scale=w:h\"\n"
+			       "to reduce the image size.\n", vp->width, vp->height);
+			do_exit(is);
+		}
+	}
+
+	SDL_LockMutex(is->pictq.mutex);
+	vp->allocated = 1;
+	SDL_CondSignal(is->pictq.cond);
+	SDL_UnlockMutex(is->pictq.mutex);
+}
+
+/* create the ring, its slots are sized for the given frame */
+static int shm_ring_open(AVFrame *frame)
+{
+	ShmRing *r = &shm_ring;
+	int size = av_image_get_buffer_size(frame->format, frame->width, frame->height, 64);
+	uint32_t slot_size;
+
+	if (size < 0)
+		return size;
+	slot_size = FFALIGN(SHM_SLOT_HEADER_SIZE + size, 4096);
+	r->map_size = 4096 + (size_t)slot_size * shm_slots;
+
+	/* never truncate a segment readers of a previous run may still have
+	   mapped, they would fault; they keep the old one and we make a new one */
+	shm_unlink(shm_name);
+	r->fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (r->fd < 0)
+		goto fail;
+	if (ftruncate(r->fd, r->map_size) < 0)
+		goto fail;
+	r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		goto fail;
+	}
+
+	r->hdr = (ShmRingHeader *)r->map;
+	r->hdr->nb_slots = shm_slots;
+	r->hdr->slot_size = slot_size;
+	r->hdr->data_offset = 4096;
+	r->hdr->version = SHM_RING_VERSION;
+	__atomic_store_n(&r->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+	av_log(NULL, AV_LOG_INFO, "Publishing %dx%d %s frames to shared memory %s, %d slots of %u bytes\n",
+	       frame->width, frame->height, av_get_pix_fmt_name(frame->format),
+	       shm_name, shm_slots, slot_size);
+	return 0;
+
+fail:
+	av_log(NULL, AV_LOG_ERROR, "%s: %s\n", shm_name, strerror(errno));
+	shm_ring_close();
+	return AVERROR(errno);
+}
+
+/* copy a displayed frame into the next slot of the ring, overwriting the oldest one */
+static void shm_ring_publish(AVFrame *frame, double pts, double duration, int serial)
+{
+	ShmRing *r = &shm_ring;
+	ShmSlotHeader *slot;
+	uint8_t *data[4];
+	int linesize[4];
+	uint64_t n;
+	int i;
+
+	if (r->disabled)
+		return;
+	if (!r->map && shm_ring_open(frame) < 0) {
+		r->disabled = 1;
+		return;
+	}
+	if (SHM_SLOT_HEADER_SIZE +
+	    av_image_get_buffer_size(frame->format, frame->width, frame->height, 64) > r->hdr->slot_size) {
+		/* readers see closed and follow to the new segment */
+		shm_ring_close();
+		if (shm_ring_open(frame) < 0) {
+			r->disabled = 1;
+			return;
+		}
+	}
+
+	n = r->hdr->write_seq;
+	slot = (ShmSlotHeader *)(r->map + r->hdr->data_offset + (n % r->hdr->nb_slots) * r->hdr->slot_size);
+	__atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->pts = pts;
+	slot->duration = duration;
+	slot->serial = serial;
+	slot->format = frame->format;
+	slot->width = frame->width;
+	slot->height = frame->height;
+	slot->sar_num = frame->sample_aspect_ratio.num;
+	slot->sar_den = frame->sample_aspect_ratio.den;
+	av_image_fill_arrays(data, linesize, (uint8_t *)slot + SHM_SLOT_HEADER_SIZE,
+	                     frame->format, frame->width, frame->height, 64);
+	av_image_copy(data, linesize, (const uint8_t **)frame->data, frame->linesize,
+	              frame->format, frame->width, frame->height);
+	for (i = 0; i < 4; i++) {
+		slot->linesize[i] = linesize[i];
+		slot->offset[i] = data[i] ? data[i] - (uint8_t *)slot : 0;
+	}
+
+	__atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->hdr->write_seq, n + 1, __ATOMIC_RELEASE);
+}
+
+static int queue_picture(VideoState *is, AVFrame *src_frame, double pts,
+                         double duration, int64_t pos, int serial)
+{
+	Frame *vp;
+
+	if (!(vp = frame_queue_peek_writable(&is->pictq)))
+		return -1;
+	__atomic_store_n(&is->pictq.frame_bytes,
+	                 av_image_get_buffer_size(src_frame->format, src_frame->width, src_frame->height, 1),
+	                 __ATOMIC_RELAXED);
+
+	vp->sar = src_frame->sample_aspect_ratio;
+	vp->uploaded = 0;
+	vp->tiles_uploaded = 0;
+
+	/* alloc or resize hardware picture buffer */
+	if ((!vp->bmp && !sw_out.active) || !vp->allocated ||
+	    vp->width != src_frame->width ||
+	    vp->height != src_frame->height ||
+	    vp->format != src_frame->format) {
+		SDL_Event event;
+
+		vp->allocated = 0;
+		vp->width = src_frame->width;
+		vp->height = src_frame->height;
+		vp->format = src_frame->format;
+
+		/* the allocation must be done in the main thread to avoid
+		   locking problems. */
+		event.type = FF_ALLOC_EVENT;
+		event.user.data1 = is;
+		SDL_PushEvent(&event);
+
+		/* wait until the picture is allocated */
+		SDL_LockMutex(is->pictq.mutex);
+		while (!vp->allocated && !is->videoq.abort_request) {
+			cond_wait(is->pictq.cond, is->pictq.mutex);
+		}
+		/* if the queue is aborted, we have to pop the pending ALLOC event or wait for the allocation to complete */
+		if (is->videoq.abort_request &&
+		    SDL_PeepEvents(&event, 1, SDL_GETEVENT, FF_ALLOC_EVENT, FF_ALLOC_EVENT) != 1) {
+			while (!vp->allocated && !is->abort_request) {
+				cond_wait(is->pictq.cond, is->pictq.mutex);
+			}
+		}
+		SDL_UnlockMutex(is->pictq.mutex);
+
+		if (is->videoq.abort_request)
+			return -1;
+	}
+
+	/* if the frame is not skipped, then display it */
+	if (vp->bmp || sw_out.active) {
+		vp->pts = pts;
+		vp->duration = duration;
+		vp->pos = pos;
+		vp->serial = serial;
+
+		av_frame_move_ref(vp->frame, src_frame);
+		frame_queue_push(&is->pictq);
+	}
+	return 0;
+}
+
+static int shm_input_attach(const char *name, int log_level)
+{
+	ShmInput *in = &shm_in;
+	ShmRingHeader *hdr;
+	struct stat st;
+	int ret;
+
+	in->name = name;
+	in->fd = shm_open(name, O_RDONLY, 0);
+	if (in->fd < 0 || fstat(in->fd, &st) < 0)
+		goto fail;
+	in->map_size = st.st_size;
+	if (in->map_size < sizeof(ShmRingHeader)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	in->map = mmap(NULL, in->map_size, PROT_READ, MAP_SHARED, in->fd, 0);
+	if (in->map == MAP_FAILED) {
+		in->map = NULL;
+		goto fail;
+	}
+	hdr = in->hdr = (ShmRingHeader *)in->map;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+	    hdr->version != SHM_RING_VERSION || !hdr->nb_slots ||
+	    hdr->slot_size < SHM_SLOT_HEADER_SIZE ||
+	    hdr->data_offset + (uint64_t)hdr->nb_slots * hdr->slot_size > in->map_size) {
+		av_log(NULL, log_level, "%s: not a frame ring\n", name);
+		shm_input_close();
+		return AVERROR_INVALIDDATA;
+	}
+	/* the publisher may rewrite the header, only these validated values are used */
+	in->nb_slots = hdr->nb_slots;
+	in->slot_size = hdr->slot_size;
+	in->data_offset = hdr->data_offset;
+
+	/* start at the newest frame */
+	in->next = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+	if (in->next)
+		in->next--;
+	return 0;
+
+fail:
+	ret = AVERROR(errno);
+	av_log(NULL, log_level, "%s: %s\n", name, strerror(errno));
+	shm_input_close();
+	return ret;
+}
+
+/* check that the planes a slot header describes lie within the slot */
+static int shm_slot_check(const ShmSlotHeader *h, uint32_t slot_size)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(h->format);
+	int i, nb_planes;
+
+	if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+	    av_image_check_size(h->width, h->height, 0, NULL) < 0)
+		return AVERROR_INVALIDDATA;
+	nb_planes = av_pix_fmt_count_planes(h->format);
+	for (i = 0; i < 4; i++) {
+		int64_t size;
+
+		if (i == 1 && (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL))) {
+			size = AVPALETTE_SIZE;
+		} else if (i < nb_planes) {
+			int rows = i == 1 || i == 2 ? -((-h->height) >> desc->log2_chroma_h) : h->height;
+			if (h->linesize[i] < av_image_get_linesize(h->format, h->width, i))
+				return AVERROR_INVALIDDATA;
+			size = (int64_t)h->linesize[i] * rows;
+		} else {
+			continue;
+		}
+		if (h->offset[i] < SHM_SLOT_HEADER_SIZE || h->offset[i] + size > slot_size)
+			return AVERROR_INVALIDDATA;
+	}
+	return 0;
+}
+
+/* the publisher moved to a new segment or exited: attach to whatever now has the name */
+static int shm_input_reattach(ShmInput *in)
+{
+	const char *name = in->name;
+	struct stat st, cur;
+
+	/* nothing new until the name is recreated */
+	if (in->fd >= 0 && !fstat(in->fd, &cur)) {
+		int fd = shm_open(name, O_RDONLY, 0);
+		int same = fd < 0 || (!fstat(fd, &st) && st.st_ino == cur.st_ino);
+		if (fd >= 0)
+			close(fd);
+		if (same)
+			return AVERROR(EAGAIN);
+	}
+	shm_input_close();
+	if (shm_input_attach(name, AV_LOG_DEBUG) < 0)
+		return AVERROR(EAGAIN);
+	av_log(NULL, AV_LOG_VERBOSE, "%s: publisher moved to a new segment\n", name);
+	return 0;
+}
+
+/**
+ * Slot of the next frame if it is published, NULL if it is not there yet.
+ * Its header is copied to h and read again seqlock style, the copy is only
+ * returned once the slot was seen complete before and after it and its
+ * planes were checked to lie within the slot.
+ */
+static ShmSlotHeader *shm_input_peek(ShmInput *in, ShmSlotHeader *h)
+{
+	uint64_t write_seq;
+	ShmSlotHeader *slot;
+
+	if (!in->map && shm_input_reattach(in) < 0)
+		return NULL;
+	write_seq = __atomic_load_n(&in->hdr->write_seq, __ATOMIC_ACQUIRE);
+	if (in->next >= write_seq) {
+		/* closed is stored after the last write_seq, which must be read again once it is seen */
+		if (__atomic_load_n(&in->hdr->closed, __ATOMIC_ACQUIRE) &&
+		    in->next >= __atomic_load_n(&in->hdr->write_seq, __ATOMIC_ACQUIRE))
+			shm_input_reattach(in);
+		return NULL;
+	}
+	/* the publisher lapped us, resync on its newest frame */
+	if (write_seq - in->next > in->nb_slots)
+		in->next = write_seq - 1;
+	slot = (ShmSlotHeader *)(in->map + in->data_offset +
+	                         (in->next % in->nb_slots) * in->slot_size);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != 2 * in->next + 2)
+		return NULL;
+	memcpy(h, slot, sizeof(*h));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != 2 * in->next + 2)
+		return NULL;
+	if (shm_slot_check(h, in->slot_size) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "shm: frame %"PRIu64" has an invalid geometry, skipped\n", in->next);
+		in->next++;
+		return NULL;
+	}
+	return slot;
+}
+
+/**
+ * Take the next frame of the ring. It is copied out, the publisher may
+ * reuse the slot at any time; a copy it overwrote meanwhile is discarded.
+ */
+static int shm_input_get_frame(VideoState *is, AVFrame *frame)
+{
+	ShmInput *in = &shm_in;
+	ShmSlotHeader *slot, h;
+	const uint8_t *src[4];
+	int i, ret;
+
+retry:
+	while (!(slot = shm_input_peek(in, &h))) {
+		if (is->videoq.abort_request)
+			return -1;
+		av_usleep(1000);
+	}
+	for (i = 0; i < 4; i++)
+		src[i] = h.offset[i] ? (uint8_t *)slot + h.offset[i] : NULL;
+
+	frame->format = h.format;
+	frame->width = h.width;
+	frame->height = h.height;
+	if ((ret = av_frame_get_buffer(frame, 64)) < 0)
+		return ret;
+	av_image_copy(frame->data, frame->linesize, src, h.linesize,
+	              h.format, h.width, h.height);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != 2 * in->next + 2) {
+		/* overwritten while copying */
+		av_frame_unref(frame);
+		in->next++;
+		goto retry;
+	}
+	frame->sample_aspect_ratio = (AVRational) { h.sar_num, h.sar_den };
+	frame->pts = isnan(h.pts) ? AV_NOPTS_VALUE : llrint(h.pts * 1000000);
+
+	in->next++;
+	is->viddec.pkt_serial = is->videoq.serial;
+	return 1;
+}
+
+/* account for a picture's pts, also for those dropped before they are queued */
+static void duration_estimate_add(VideoState *is, DurationEstimate *e, double pts, int serial)
+{
+	double step;
+
+	if (e->serial != serial) {
+		e->serial = serial;
+		e->last_pts = NAN;
+		e->step = 0;
+	}
+	step = pts - e->last_pts;
+	if (!isnan(step) && step > 0 && step < is->max_frame_duration)
+		e->step = step;
+	if (!isnan(pts))
+		e->last_pts = pts;
+}
+
+static double estimate_frame_duration(VideoState *is, DurationEstimate *e, double pts,
+                                      double pkt_duration, AVRational frame_rate, int serial)
+{
+	duration_estimate_add(is, e, pts, serial);
+	if (pkt_duration > 0 && pkt_duration < is->max_frame_duration)
+		return pkt_duration;
+	if (e->step > 0)
+		return e->step;
+	return frame_rate.num && frame_rate.den ? av_q2d((AVRational) {
+		frame_rate.den, frame_rate.num
+	}) : 0;
+}
+
+static int get_video_frame(VideoState *is, AVFrame *frame)
+{
+	int got_picture;
+
+	if (shm_in.name) {
+		got_picture = shm_input_get_frame(is, frame);
+	} else {
+		/* the time not spent waiting for packets is the decoding time */
+		int64_t start = av_gettime_relative();
+		int64_t blocked = thread_stats[THREAD_VIDEO_DECODE].blocked;
+		got_picture = decoder_decode_frame(&is->viddec, frame);
+		if (got_picture > 0) {
+			__atomic_store_n(&is->decode_time, is->decode_time + av_gettime_relative() - start -
+			                 (thread_stats[THREAD_VIDEO_DECODE].blocked - blocked), __ATOMIC_RELAXED);
+			__atomic_store_n(&is->nb_decoded, is->nb_decoded + 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (got_picture < 0)
+		return -1;
+
+	if (got_picture) {
+		double dpts = NAN;
+
+		if (frame->pts != AV_NOPTS_VALUE) {
+			int64_t skipped[DECODER_SKIPPED_MAX];
+			int i, n = decoder_take_skipped(&is->viddec, frame->pts, skipped);
+
+			dpts = av_q2d(is->video_st->time_base) * frame->pts;
+			/* pictures skip_frame discarded still step the duration estimate,
+			   with user filters the pts seen after the graph may differ */
+			for (i = 0; i < n && !vfilters_list; i++)
+				duration_estimate_add(is, &is->frame_dur, av_q2d(is->video_st->time_base) * skipped[i],
+				                      is->viddec.pkt_serial);
+		}
+
+		frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_st,
+		                             frame);
+
+		seek_stats_mark(is, SEEK_STAGE_DECODER_FLUSH, is->viddec.pkt_serial,
+		                is->viddec.flush_time);
+		seek_stats_mark(is, SEEK_STAGE_KEYFRAME, is->viddec.pkt_serial, 0);
+
+		if (framedrop > 0 || framedrop) {
+			if (frame->pts != AV_NOPTS_VALUE) {
+				double diff = dpts - get_master_clock(is);
+				int in_sync = !isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
+				              is->viddec.pkt_serial == is->vidclk.serial;
+
+				/* with -nonref_skip, once video falls behind by more than
+				   AV_SYNC_THRESHOLD_MAX the decoder is told to throw away the
+				   non-reference frames before decoding them, until it has
+				   caught up again */
+				if (nonref_skip && is->viddec.avctx) {
+					int late = in_sync && diff < (is->skipping_nonref ? 0 : -AV_SYNC_THRESHOLD_MAX);
+					if (late != is->skipping_nonref) {
+						is->skipping_nonref = late;
+						is->nb_nonref_skips += late;
+						is->viddec.avctx->skip_frame = late ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+						av_log(NULL, AV_LOG_VERBOSE, "%s non-reference frames, video %.3f s late\n",
+						       late ? "Skipping" : "Decoding", -diff);
+					}
+				}
+				if (in_sync && diff - is->frame_last_filter_delay < 0 &&
+				    is->videoq.nb_packets) {
+					/* keep the pts step of the next picture to one frame; with
+					   user filters the pts seen after the graph may differ */
+					if (!vfilters_list)
+						duration_estimate_add(is, &is->frame_dur, dpts, is->viddec.pkt_serial);
+					is->frame_drops_early++;
+					av_frame_unref(frame);
+					got_picture = 0;
+				}
+			}
+		}
+	}
+
+	return got_picture;
+}
+
+static int configure_filtergraph(AVFilterGraph *graph, const char *filtergraph,
+                                 AVFilterContext *source_ctx, AVFilterContext *sink_ctx)
+{
 	int ret, i;
 	int nb_filters = graph->nb_filters;
 	AVFilterInOut *outputs = NULL, *inputs = NULL;
 
-	if (filtergraph) {
-		outputs = avfilter_inout_alloc();
-		inputs = avfilter_inout_alloc();
-		if (!outputs || !inputs) {
-			ret = AVERROR(ENOMEM);
-			goto fail;
+	if (filtergraph) {
+		outputs = avfilter_inout_alloc();
+		inputs = avfilter_inout_alloc();
+		if (!outputs || !inputs) {
+			ret = AVERROR(ENOMEM);
+			goto fail;
+		}
+
+		outputs->name = av_strdup("in");
+		outputs->filter_ctx = source_ctx;
+		outputs->pad_idx = 0;
+		outputs->next = NULL;
+
+		inputs->name = av_strdup("out");
+		inputs->filter_ctx = sink_ctx;
+		inputs->pad_idx = 0;
+		inputs->next = NULL;
+
+		if ((ret = avfilter_graph_parse_ptr(graph, filtergraph, &inputs, &outputs,
+		                                    NULL)) < 0)
+			goto fail;
+	} else {
+		if ((ret = avfilter_link(source_ctx, 0, sink_ctx, 0)) < 0)
+			goto fail;
+	}
+
+	/* Reorder the filters to ensure that inputs of the custom filters are merged first */
+	for (i = 0; i < graph->nb_filters - nb_filters; i++)
+		FFSWAP(AVFilterContext *, graph->filters[i], graph->filters[i + nb_filters]);
+
+	ret = avfilter_graph_config(graph, NULL);
+fail:
+	avfilter_inout_free(&outputs);
+	avfilter_inout_free(&inputs);
+	return ret;
+}
+
+static int configure_video_filters(AVFilterGraph *graph, VideoState *is,
+                                   const char *vfilters, AVFrame *frame)
+{
+	static const enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGRA, AV_PIX_FMT_NONE };
+	static const enum AVPixelFormat export_pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
+	char sws_flags_str[512] = "";
+	char buffersrc_args[256];
+	int ret;
+	AVFilterContext *filt_src = NULL, *filt_out = NULL, *last_filter = NULL;
+	AVCodecParameters *codecpar = is->video_st->codecpar;
+	AVRational fr = av_guess_frame_rate(is->ic, is->video_st, NULL);
+	AVDictionaryEntry *e = NULL;
+
+	while ((e = av_dict_get(sws_dict, "", e, AV_DICT_IGNORE_SUFFIX))) {
+		if (!strcmp(e->key, "sws_flags")) {
+			av_strlcatf(sws_flags_str, sizeof(sws_flags_str), "%s=%s:", "flags", e->value);
+		} else
+			av_strlcatf(sws_flags_str, sizeof(sws_flags_str), "%s=%s:", e->key, e->value);
+	}
+	if (strlen(sws_flags_str))
+		sws_flags_str[strlen(sws_flags_str) - 1] = '\0';
+
+	graph->scale_sws_opts = av_strdup(sws_flags_str);
+	if (deterministic)
+		graph->nb_threads = 1;
+
+	snprintf(buffersrc_args, sizeof(buffersrc_args),
+	         "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+	         frame->width, frame->height, frame->format,
+	         is->video_st->time_base.num, is->video_st->time_base.den,
+	         codecpar->sample_aspect_ratio.num, FFMAX(codecpar->sample_aspect_ratio.den, 1));
+	if (fr.num && fr.den)
+		av_strlcatf(buffersrc_args, sizeof(buffersrc_args), ":frame_rate=%d/%d", fr.num,
+		            fr.den);
+
+	if ((ret = avfilter_graph_create_filter(&filt_src,
+	                                        avfilter_get_by_name("buffer"),
+	                                        "ffplay_buffer", buffersrc_args, NULL,
+	                                        graph)) < 0)
+		goto fail;
+
+	ret = avfilter_graph_create_filter(&filt_out,
+	                                   avfilter_get_by_name("buffersink"),
+	                                   "ffplay_buffersink", NULL, NULL, graph);
+	if (ret < 0)
+		goto fail;
+
+	if ((ret = av_opt_set_int_list(filt_out, "pix_fmts",
+	                               export_video && !framecrc ? export_pix_fmts : pix_fmts,
+	                               AV_PIX_FMT_NONE,
+	                               AV_OPT_SEARCH_CHILDREN)) < 0)
+		goto fail;
+
+	last_filter = filt_out;
+
+	if ((ret = configure_filtergraph(graph, vfilters, filt_src, last_filter)) < 0)
+		goto fail;
+
+	is->in_video_filter = filt_src;
+	is->out_video_filter = filt_out;
+
+fail:
+	return ret;
+}
+
+static int configure_audio_filters(VideoState *is, const char *afilters,
+                                   int force_output_format)
+{
+	static const enum AVSampleFormat sample_fmts[] = { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE };
+	int sample_rates[2] = { 0, -1 };
+	int64_t channel_layouts[2] = { 0, -1 };
+	int channels[2] = { 0, -1 };
+	AVFilterContext *filt_asrc = NULL, *filt_asink = NULL;
+	char aresample_swr_opts[512] = "";
+	AVDictionaryEntry *e = NULL;
+	char asrc_args[256];
+	int ret;
+
+	avfilter_graph_free(&is->agraph);
+	if (!(is->agraph = avfilter_graph_alloc()))
+		return AVERROR(ENOMEM);
+	if (deterministic)
+		is->agraph->nb_threads = 1;
+
+	while ((e = av_dict_get(swr_opts, "", e, AV_DICT_IGNORE_SUFFIX)))
+		av_strlcatf(aresample_swr_opts, sizeof(aresample_swr_opts), "%s=%s:", e->key,
+		            e->value);
+	if (strlen(aresample_swr_opts))
+		aresample_swr_opts[strlen(aresample_swr_opts) - 1] = '\0';
+	av_opt_set(is->agraph, "aresample_swr_opts", aresample_swr_opts, 0);
+
+	ret = snprintf(asrc_args, sizeof(asrc_args),
+	               "sample_rate=%d:sample_fmt=%s:channels=%d:time_base=%d/%d",
+	               is->audio_filter_src.freq, av_get_sample_fmt_name(is->audio_filter_src.fmt),
+	               is->audio_filter_src.channels,
+	               1, is->audio_filter_src.freq);
+	if (is->audio_filter_src.channel_layout)
+		snprintf(asrc_args + ret, sizeof(asrc_args) - ret,
+		         ":channel_layout=0x%"PRIx64,  is->audio_filter_src.channel_layout);
+
+	ret = avfilter_graph_create_filter(&filt_asrc,
+	                                   avfilter_get_by_name("abuffer"), "ffplay_abuffer",
+	                                   asrc_args, NULL, is->agraph);
+	if (ret < 0)
+		goto end;
+
+
+	ret = avfilter_graph_create_filter(&filt_asink,
+	                                   avfilter_get_by_name("abuffersink"), "ffplay_abuffersink",
+	                                   NULL, NULL, is->agraph);
+	if (ret < 0)
+		goto end;
+
+	if ((ret = av_opt_set_int_list(filt_asink, "sample_fmts", sample_fmts,
+	                               AV_SAMPLE_FMT_NONE, AV_OPT_SEARCH_CHILDREN)) < 0)
+		goto end;
+	if ((ret = av_opt_set_int(filt_asink, "all_channel_counts", 1,
+	                          AV_OPT_SEARCH_CHILDREN)) < 0)
+		goto end;
+
+	if (force_output_format) {
+		channel_layouts[0] = is->audio_tgt.channel_layout;
+		channels[0] = is->audio_tgt.channels;
+		sample_rates[0] = is->audio_tgt.freq;
+		if ((ret = av_opt_set_int(filt_asink, "all_channel_counts", 0,
+		                          AV_OPT_SEARCH_CHILDREN)) < 0)
+			goto end;
+		if ((ret = av_opt_set_int_list(filt_asink, "channel_layouts", channel_layouts,
+		                               -1, AV_OPT_SEARCH_CHILDREN)) < 0)
+			goto end;
+		if ((ret = av_opt_set_int_list(filt_asink, "channel_counts", channels, -1,
+		                               AV_OPT_SEARCH_CHILDREN)) < 0)
+			goto end;
+		if ((ret = av_opt_set_int_list(filt_asink, "sample_rates", sample_rates, -1,
+		                               AV_OPT_SEARCH_CHILDREN)) < 0)
+			goto end;
+	}
+
+	if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc,
+	                                 filt_asink)) < 0)
+		goto end;
+
+	is->in_audio_filter = filt_asrc;
+	is->out_audio_filter = filt_asink;
+
+end:
+	if (ret < 0)
+		avfilter_graph_free(&is->agraph);
+	return ret;
+}
+
+/* write out the gathered vectors, retrying after short writes */
+static int export_flush(VideoState *is, ExportSink *s)
+{
+	struct iovec *iov = s->iov;
+	int nb = s->nb_iov;
+
+	s->nb_iov = 0;
+	while (nb > 0) {
+		ssize_t n = writev(s->fd, iov, nb);
+		if (n < 0) {
+			int ret = AVERROR(errno);
+			SDL_Event event;
+
+			if (errno == EINTR)
+				continue;
+			av_log(NULL, AV_LOG_ERROR, "%s: %s\n", s->url, strerror(errno));
+			event.type = FF_QUIT_EVENT;
+			event.user.data1 = is;
+			SDL_PushEvent(&event);
+			return ret;
+		}
+		s->bytes += n;
+		while (nb > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			nb--;
+		}
+		if (nb > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int export_add(VideoState *is, ExportSink *s, const void *data, size_t size)
+{
+	int ret;
+
+	if (s->nb_iov == EXPORT_IOV_MAX && (ret = export_flush(is, s)) < 0)
+		return ret;
+	s->iov[s->nb_iov].iov_base = (void *)data;
+	s->iov[s->nb_iov].iov_len = size;
+	s->nb_iov++;
+	return 0;
+}
+
+/* write a YUV420P frame as a Y4M frame or as raw planes, with one writev() per frame */
+static int export_video_frame(VideoState *is, AVFrame *frame, AVRational frame_rate)
+{
+	ExportSink *s = &export_video_sink;
+	char header[128];
+	int i, y, ret;
+
+	if (!export_raw) {
+		if (!s->nb_frames) {
+			AVRational sar = frame->sample_aspect_ratio;
+			if (!frame_rate.num || !frame_rate.den)
+				frame_rate = (AVRational) { 25, 1 };
+			snprintf(header, sizeof(header),
+			         "YUV4MPEG2 W%d H%d F%d:%d Ip A%d:%d C420jpeg XYSCSS=420JPEG\n",
+			         frame->width, frame->height, frame_rate.num, frame_rate.den,
+			         sar.num, sar.num ? sar.den : 0);
+			if ((ret = export_add(is, s, header, strlen(header))) < 0)
+				return ret;
+			s->width = frame->width;
+			s->height = frame->height;
+		} else if (frame->width != s->width || frame->height != s->height) {
+			av_log(NULL, AV_LOG_WARNING, "%s: dropping a %dx%d frame in a %dx%d Y4M stream\n",
+			       s->url, frame->width, frame->height, s->width, s->height);
+			return 0;
+		}
+		if ((ret = export_add(is, s, "FRAME\n", 6)) < 0)
+			return ret;
+	}
+
+	for (i = 0; i < 3; i++) {
+		int w = i ? (frame->width + 1) >> 1 : frame->width;
+		int h = i ? (frame->height + 1) >> 1 : frame->height;
+
+		if (frame->linesize[i] == w) {
+			if ((ret = export_add(is, s, frame->data[i], w * h)) < 0)
+				return ret;
+			continue;
+		}
+		for (y = 0; y < h; y++)
+			if ((ret = export_add(is, s, frame->data[i] + y * frame->linesize[i], w)) < 0)
+				return ret;
+	}
+	s->nb_frames++;
+	return export_flush(is, s);
+}
+
+static int export_audio_frame(VideoState *is, AVFrame *frame)
+{
+	ExportSink *s = &export_audio_sink;
+	int size = av_samples_get_buffer_size(NULL, av_frame_get_channels(frame),
+	                                      frame->nb_samples, frame->format, 1);
+	int ret;
+
+	if (size < 0)
+		return size;
+	if ((ret = export_add(is, s, frame->data[0], size)) < 0)
+		return ret;
+	s->nb_frames++;
+	return export_flush(is, s);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	for (; len; len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+#endif
+
+/* the crc32 instruction when the CPU has it, otherwise the same reflected CRC from a table */
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crc32c_hw)
+		return crc32c_sse42(crc, p, len);
+#endif
+	return av_crc(crc32c_table, crc, p, len);
+}
+
+static int framecrc_open(const char *url)
+{
+	int ret;
+
+	if (av_crc_init(crc32c_table, 1, 32, 0x82F63B78, sizeof(crc32c_table)) < 0)
+		return AVERROR_BUG;
+#if defined(__x86_64__) && defined(__GNUC__)
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+	if (!(framecrc_mutex = SDL_CreateMutex()))
+		return AVERROR(ENOMEM);
+	if ((ret = export_open(&framecrc_sink, url)) < 0)
+		return ret;
+	av_log(NULL, AV_LOG_VERBOSE, "framecrc: %s CRC32C\n", crc32c_hw ? "sse4.2" : "table");
+	return 0;
+}
+
+/* a stream that will write lines, must be declared before any decoder starts */
+static void framecrc_expect(int stream_index)
+{
+	if (framecrc_nb_streams < FF_ARRAY_ELEMS(framecrc_streams))
+		framecrc_streams[framecrc_nb_streams++].index = stream_index;
+}
+
+/*
+ * Write the pending lines in pts order, ties in the order the streams were
+ * declared, for as long as every stream that is not finished has one to
+ * compare, or until all are written if flush is set. Each stream's lines come in a fixed order,
+ * so the merge is the same whatever the thread timing was.
+ */
+static int framecrc_drain(VideoState *is, int flush)
+{
+	ExportSink *s = &framecrc_sink;
+	int i, ret = 0;
+
+	while (1) {
+		FrameCrcStream *best = NULL;
+		FrameCrcLine *l;
+		char line[128];
+
+		for (i = 0; i < framecrc_nb_streams; i++) {
+			FrameCrcStream *fs = &framecrc_streams[i];
+			if (!fs->nb) {
+				if (flush || fs->finished)
+					continue;
+				return ret;
+			}
+			if (!best || fs->lines[fs->head].pts < best->lines[best->head].pts)
+				best = fs;
+		}
+		if (!best)
+			return ret;
+		l = &best->lines[best->head++];
+		best->nb--;
+		snprintf(line, sizeof(line), "%d, %12"PRId64", %9d, 0x%08"PRIx32"\n",
+		         best->index, l->pts, l->size, l->crc);
+		if (ret >= 0 && (ret = export_add(is, s, line, strlen(line))) >= 0)
+			ret = export_flush(is, s);
+		s->nb_frames++;
+	}
+}
+
+/* one line per frame: stream index, pts in microseconds, hashed size, crc */
+static int framecrc_write(VideoState *is, int stream_index, int64_t pts, AVRational tb,
+                          int size, uint32_t crc)
+{
+	FrameCrcStream *fs = NULL;
+	int i, ret;
+
+	if (pts != AV_NOPTS_VALUE)
+		pts = av_rescale_q(pts, tb, AV_TIME_BASE_Q);
+	SDL_LockMutex(framecrc_mutex);
+	for (i = 0; i < framecrc_nb_streams; i++)
+		if (framecrc_streams[i].index == stream_index)
+			fs = &framecrc_streams[i];
+	if (!fs) {
+		SDL_UnlockMutex(framecrc_mutex);
+		return AVERROR_BUG;
+	}
+	if (fs->head + fs->nb == fs->allocated) {
+		if (fs->head) {
+			memmove(fs->lines, fs->lines + fs->head, fs->nb * sizeof(*fs->lines));
+			fs->head = 0;
+		} else if ((ret = av_reallocp_array(&fs->lines, FFMAX(2 * fs->allocated, 64),
+		                                     sizeof(*fs->lines))) < 0) {
+			fs->nb = fs->allocated = 0;
+			SDL_UnlockMutex(framecrc_mutex);
+			return ret;
+		} else {
+			fs->allocated = FFMAX(2 * fs->allocated, 64);
+		}
+	}
+	fs->lines[fs->head + fs->nb++] = (FrameCrcLine) { pts, size, crc ^ UINT32_MAX };
+	fs->finished = 0;
+	ret = framecrc_drain(is, 0);
+	SDL_UnlockMutex(framecrc_mutex);
+	return ret;
+}
+
+/*
+ * The stream writes no more lines: its decoder reached the end, stopped or
+ * could not be opened. The others are not held back waiting for it.
+ */
+static void framecrc_finish(VideoState *is, int stream_index)
+{
+	int i;
+
+	if (!framecrc || stream_index < 0)
+		return;
+	SDL_LockMutex(framecrc_mutex);
+	for (i = 0; i < framecrc_nb_streams; i++)
+		if (framecrc_streams[i].index == stream_index && !framecrc_streams[i].finished) {
+			framecrc_streams[i].finished = 1;
+			framecrc_drain(is, 0);
+		}
+	SDL_UnlockMutex(framecrc_mutex);
+}
+
+/* write the lines left once the decoders have stopped */
+static void framecrc_close(void)
+{
+	int i;
+
+	if (framecrc_sink.fd >= 0)
+		framecrc_drain(NULL, 1);
+	for (i = 0; i < framecrc_nb_streams; i++)
+		av_freep(&framecrc_streams[i].lines);
+	framecrc_nb_streams = 0;
+	export_close(&framecrc_sink);
+}
+
+/* hash the visible part of every plane, row by row, skipping the line padding */
+static int framecrc_video_frame(VideoState *is, AVFrame *frame, AVRational tb)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	uint32_t crc = UINT32_MAX;
+	int linesizes[4];
+	int i, y, ret, size = 0;
+
+	if (!desc || (ret = av_image_fill_linesizes(linesizes, frame->format, frame->width)) < 0)
+		return AVERROR(EINVAL);
+	for (i = 0; i < 4 && frame->data[i]; i++) {
+		int h = frame->height;
+
+		if (i == 1 && (desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+			crc = crc32c(crc, frame->data[1], AVPALETTE_SIZE);
+			size += AVPALETTE_SIZE;
+			break;
+		}
+		if (i == 1 || i == 2)
+			h = -((-h) >> desc->log2_chroma_h);
+		for (y = 0; y < h; y++)
+			crc = crc32c(crc, frame->data[i] + y * frame->linesize[i], linesizes[i]);
+		size += linesizes[i] * h;
+	}
+	return framecrc_write(is, is->video_stream, frame->pts, tb, size, crc);
+}
+
+static int framecrc_audio_frame(VideoState *is, AVFrame *frame, AVRational tb)
+{
+	int channels = av_frame_get_channels(frame);
+	int planes = av_sample_fmt_is_planar(frame->format) ? channels : 1;
+	uint32_t crc = UINT32_MAX;
+	int i, plane_size;
+	int size = av_samples_get_buffer_size(&plane_size, channels, frame->nb_samples,
+	                                      frame->format, 1);
+
+	if (size < 0)
+		return size;
+	for (i = 0; i < planes; i++)
+		crc = crc32c(crc, frame->extended_data[i], plane_size);
+	return framecrc_write(is, is->audio_stream, frame->pts, tb, size, crc);
+}
+
+/* audio parameters of the PCM export, the counterpart of audio_open() */
+static int export_audio_open(int64_t channel_layout, int nb_channels, int sample_rate,
+                             struct AudioParams *audio_hw_params)
+{
+	if (!channel_layout ||
+	    nb_channels != av_get_channel_layout_nb_channels(channel_layout))
+		channel_layout = av_get_default_channel_layout(nb_channels);
+	audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+	audio_hw_params->freq = sample_rate;
+	audio_hw_params->channel_layout = channel_layout;
+	audio_hw_params->channels = nb_channels;
+	audio_hw_params->frame_size = av_samples_get_buffer_size(NULL, nb_channels, 1,
+	                              AV_SAMPLE_FMT_S16, 1);
+	audio_hw_params->bytes_per_sec = av_samples_get_buffer_size(NULL, nb_channels,
+	                                 sample_rate, AV_SAMPLE_FMT_S16, 1);
+	return 0;
+}
+
+/* hand a filtered audio frame to the output, taking its reference */
+static int queue_audio_frame(VideoState *is, AVFrame *frame, AVRational tb)
+{
+	Frame *af;
+	int ret;
+
+	if (export_audio) {
+		ret = framecrc ? framecrc_audio_frame(is, frame, tb) : export_audio_frame(is, frame);
+		av_frame_unref(frame);
+		return ret;
+	}
+	if (!(af = frame_queue_peek_writable(&is->sampq)))
+		return -1;
+	__atomic_store_n(&is->sampq.frame_bytes,
+	                 av_samples_get_buffer_size(NULL, av_frame_get_channels(frame),
+	                                            frame->nb_samples, frame->format, 1),
+	                 __ATOMIC_RELAXED);
+
+	af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+	af->pos = av_frame_get_pkt_pos(frame);
+	af->serial = is->auddec.pkt_serial;
+	af->duration = av_q2d((AVRational) {
+		frame->nb_samples, frame->sample_rate
+	});
+
+	av_frame_move_ref(af->frame, frame);
+	frame_queue_push(&is->sampq);
+	return 0;
+}
+
+static int audio_thread(void *arg)
+{
+	VideoState *is = arg;
+	AVFrame *frame = av_frame_alloc();
+	int last_serial = -1;
+	int64_t dec_channel_layout;
+	int reconfigure;
+	int got_frame = 0;
+	AVRational tb;
+	int ret = 0;
+
+	if (!frame)
+		return AVERROR(ENOMEM);
+
+	thread_stats_enter(THREAD_AUDIO_DECODE);
+	do {
+		if ((got_frame = decoder_decode_frame(&is->auddec, frame)) < 0)
+			goto the_end;
+		if (!got_frame && is->auddec.finished == is->auddec.pkt_serial)
+			framecrc_finish(is, is->audio_stream);
+
+		if (got_frame) {
+			tb = (AVRational) {
+				1, frame->sample_rate
+			};
+
+			dec_channel_layout = get_valid_channel_layout(frame->channel_layout,
+			                     av_frame_get_channels(frame));
+
+			/* PCM that is already in the output format does not need the filter graph */
+			if (is->auddec.bypass_format == frame->format && !afilters &&
+			    frame->format == is->audio_tgt.fmt &&
+			    frame->sample_rate == is->audio_tgt.freq &&
+			    av_frame_get_channels(frame) == is->audio_tgt.channels) {
+				if ((ret = queue_audio_frame(is, frame, tb)) < 0)
+					goto the_end;
+				continue;
+			}
+
+			reconfigure =
+			    cmp_audio_fmts(is->audio_filter_src.fmt, is->audio_filter_src.channels,
+			                   frame->format, av_frame_get_channels(frame)) ||
+			    is->audio_filter_src.channel_layout != dec_channel_layout ||
+			    is->audio_filter_src.freq != frame->sample_rate ||
+			    is->auddec.pkt_serial != last_serial;
+
+			if (reconfigure) {
+				char buf1[1024], buf2[1024];
+				av_get_channel_layout_string(buf1, sizeof(buf1), -1,
+				                             is->audio_filter_src.channel_layout);
+				av_get_channel_layout_string(buf2, sizeof(buf2), -1, dec_channel_layout);
+				av_log(NULL, AV_LOG_DEBUG,
+				       "Audio frame changed from rate:%d ch:%d fmt:%s layout:%s serial:%d to rate:%d ch:%d fmt:%s layout:%s serial:%d\n",
+				       is->audio_filter_src.freq, is->audio_filter_src.channels,
+				       av_get_sample_fmt_name(is->audio_filter_src.fmt), buf1, last_serial,
+				       frame->sample_rate, av_frame_get_channels(frame),
+				       av_get_sample_fmt_name(frame->format), buf2, is->auddec.pkt_serial);
+
+				is->audio_filter_src.fmt = frame->format;
+				is->audio_filter_src.channels = av_frame_get_channels(frame);
+				is->audio_filter_src.channel_layout = dec_channel_layout;
+				is->audio_filter_src.freq = frame->sample_rate;
+				last_serial = is->auddec.pkt_serial;
+
+				if ((ret = configure_audio_filters(is, afilters, 1)) < 0)
+					goto the_end;
+			}
+
+			if ((ret = av_buffersrc_add_frame(is->in_audio_filter, frame)) < 0)
+				goto the_end;
+
+			while ((ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame,
+			              0)) >= 0) {
+				tb = is->out_audio_filter->inputs[0]->time_base;
+				if (queue_audio_frame(is, frame, tb) < 0)
+					goto the_end;
+
+				if (is->audioq.serial != is->auddec.pkt_serial)
+					break;
+			}
+			if (ret == AVERROR_EOF)
+				is->auddec.finished = is->auddec.pkt_serial;
+		}
+	} while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
+the_end:
+	framecrc_finish(is, is->audio_stream);
+	avfilter_graph_free(&is->agraph);
+	av_frame_free(&frame);
+	thread_stats_update();
+	perf_thread_close();
+	return ret;
+}
+
+static int decoder_start(Decoder *d, int (*fn)(void *), void *arg)
+{
+	packet_queue_start(d->queue);
+	d->decoder_tid = SDL_CreateThread(fn, "decoder", arg);
+	if (!d->decoder_tid) {
+		av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
+	}
+	return 0;
+}
+
+static void decoder_abort(Decoder *d, FrameQueue *fq)
+{
+	packet_queue_abort(d->queue);
+	frame_queue_signal(fq);
+	SDL_WaitThread(d->decoder_tid, NULL);
+	d->decoder_tid = NULL;
+	packet_queue_flush(d->queue);
+}
+
+static int video_thread(void *arg)
+{
+	VideoState *is = arg;
+	AVFrame *frame;
+	double pts;
+	double duration;
+	int ret;
+	AVRational tb = is->video_st->time_base;
+	AVRational frame_rate = av_guess_frame_rate(is->ic, is->video_st, NULL);
+	AVFilterGraph *graph = avfilter_graph_alloc();
+	AVFilterContext *filt_out = NULL, *filt_in = NULL;
+	int last_w = 0;
+	int last_h = 0;
+	enum AVPixelFormat last_format = -2;
+	int last_serial = -1;
+	int last_vfilter_idx = 0;
+	if (!graph) {
+		return AVERROR(ENOMEM);
+	}
+
+	frame = av_frame_alloc();
+	if (!frame) {
+		avfilter_graph_free(&graph);
+		return AVERROR(ENOMEM);
+	}
+
+	thread_stats_enter(THREAD_VIDEO_DECODE);
+	while (1) {
+		ret = get_video_frame(is, frame);
+		if (ret < 0)
+			goto the_end;
+		if (!ret) {
+			if (is->viddec.finished == is->viddec.pkt_serial)
+				framecrc_finish(is, is->video_stream);
+			continue;
+		}
+
+		/* uncompressed frames the display takes as they are do not need the filter graph */
+		if (is->viddec.bypass_format == frame->format && !vfilters_list &&
+		    (frame->format == AV_PIX_FMT_YUV420P ||
+		     (frame->format == AV_PIX_FMT_BGRA && (!export_video || framecrc)))) {
+			seek_stats_mark(is, SEEK_STAGE_FILTER, is->viddec.pkt_serial, 0);
+			pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(is->video_st->time_base);
+			duration = estimate_frame_duration(is, &is->frame_dur, pts,
+			                                   av_frame_get_pkt_duration(frame) * av_q2d(is->video_st->time_base),
+			                                   frame_rate, is->viddec.pkt_serial);
+			if (framecrc)
+				ret = framecrc_video_frame(is, frame, is->video_st->time_base);
+			else if (export_video)
+				ret = export_video_frame(is, frame, frame_rate);
+			else
+				ret = queue_picture(is, frame, pts, duration, av_frame_get_pkt_pos(frame),
+				                    is->viddec.pkt_serial);
+			av_frame_unref(frame);
+			if (ret < 0)
+				goto the_end;
+			continue;
+		}
+
+		/* with -fast_seek a plain filter chain holds no frames and is kept across seeks */
+		if (last_w != frame->width || last_h != frame->height ||
+		    last_format != frame->format ||
+		    (last_serial != is->viddec.pkt_serial && (!fast_seek || vfilters_list)) ||
+		    last_vfilter_idx != is->vfilter_idx) {
+			av_log(NULL, AV_LOG_DEBUG,
+			       "Video frame changed from size:%dx%d format:%s serial:%d to size:%dx%d format:%s serial:%d\n",
+			       last_w, last_h,
+			       (const char *)av_x_if_null(av_get_pix_fmt_name(last_format), "none"),
+			       last_serial, frame->width, frame->height,
+			       (const char *)av_x_if_null(av_get_pix_fmt_name(frame->format), "none"),
+			       is->viddec.pkt_serial);
+			avfilter_graph_free(&graph);
+			graph = avfilter_graph_alloc();
+			if ((ret = configure_video_filters(graph, is,
+			                                   vfilters_list ? vfilters_list[is->vfilter_idx] : NULL, frame)) < 0) {
+				SDL_Event event;
+				event.type = FF_QUIT_EVENT;
+				event.user.data1 = is;
+				SDL_PushEvent(&event);
+				goto the_end;
+			}
+			filt_in = is->in_video_filter;
+			filt_out = is->out_video_filter;
+			last_w = frame->width;
+			last_h = frame->height;
+			last_format = frame->format;
+			last_serial = is->viddec.pkt_serial;
+			last_vfilter_idx = is->vfilter_idx;
+			frame_rate = filt_out->inputs[0]->frame_rate;
+		}
+		last_serial = is->viddec.pkt_serial;
+		seek_stats_mark(is, SEEK_STAGE_FILTER, is->viddec.pkt_serial, 0);
+
+		ret = av_buffersrc_add_frame(filt_in, frame);
+		if (ret < 0)
+			goto the_end;
+
+		while (ret >= 0) {
+			is->frame_last_returned_time = av_gettime_relative() / 1000000.0;
+
+			ret = av_buffersink_get_frame_flags(filt_out, frame, 0);
+			if (ret < 0) {
+				if (ret == AVERROR_EOF)
+					is->viddec.finished = is->viddec.pkt_serial;
+				ret = 0;
+				break;
+			}
+
+			is->frame_last_filter_delay = av_gettime_relative() / 1000000.0 -
+			                              is->frame_last_returned_time;
+			if (fabs(is->frame_last_filter_delay) > AV_NOSYNC_THRESHOLD / 10.0)
+				is->frame_last_filter_delay = 0;
+			tb = filt_out->inputs[0]->time_base;
+			pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+			/* user filters may retime the frames, their packet durations no longer apply */
+			duration = estimate_frame_duration(is, &is->frame_dur, pts,
+			                                   vfilters_list ? 0 :
+			                                   av_frame_get_pkt_duration(frame) * av_q2d(is->video_st->time_base),
+			                                   frame_rate, is->viddec.pkt_serial);
+			if (framecrc)
+				ret = framecrc_video_frame(is, frame, tb);
+			else if (export_video)
+				ret = export_video_frame(is, frame, frame_rate);
+			else
+				ret = queue_picture(is, frame, pts, duration, av_frame_get_pkt_pos(frame),
+				                    is->viddec.pkt_serial);
+			av_frame_unref(frame);
+		}
+
+		if (ret < 0)
+			goto the_end;
+	}
+the_end:
+	framecrc_finish(is, is->video_stream);
+	avfilter_graph_free(&graph);
+	av_frame_free(&frame);
+	thread_stats_update();
+	perf_thread_close();
+	return 0;
+}
+
+/* copy samples for viewing in editor window */
+static void update_sample_display(VideoState *is, short *samples,
+                                  int samples_size)
+{
+	int size, len;
+
+	size = samples_size / sizeof(short);
+	while (size > 0) {
+		len = SAMPLE_ARRAY_SIZE - is->sample_array_index;
+		if (len > size)
+			len = size;
+		memcpy(is->sample_array + is->sample_array_index, samples, len * sizeof(short));
+		samples += len;
+		is->sample_array_index += len;
+		if (is->sample_array_index >= SAMPLE_ARRAY_SIZE)
+			is->sample_array_index = 0;
+		size -= len;
+	}
+}
+
+/**
+ * Decode one audio frame and return its uncompressed size.
+ *
+ * The processed audio frame is decoded, converted if required, and
+ * stored in is->audio_buf, with size in bytes given by the return
+ * value.
+ */
+static int audio_decode_frame(VideoState *is)
+{
+	int data_size, resampled_data_size;
+	int64_t dec_channel_layout;
+	av_unused double audio_clock0;
+	int wanted_nb_samples;
+	Frame *af;
+
+	do {
+		if (!(af = frame_queue_peek_readable(&is->sampq)))
+			return -1;
+		frame_queue_next(&is->sampq);
+	} while (af->serial != is->audioq.serial);
+
+	data_size = av_samples_get_buffer_size(NULL, av_frame_get_channels(af->frame),
+	                                       af->frame->nb_samples,
+	                                       af->frame->format, 1);
+
+	dec_channel_layout =
+	    (af->frame->channel_layout &&
+	     av_frame_get_channels(af->frame) == av_get_channel_layout_nb_channels(
+	         af->frame->channel_layout)) ?
+	    af->frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(
+	                af->frame));
+	wanted_nb_samples = af->frame->nb_samples;
+
+	if (af->frame->format != is->audio_src.fmt ||
+	    dec_channel_layout != is->audio_src.channel_layout ||
+	    af->frame->sample_rate != is->audio_src.freq ||
+	    (wanted_nb_samples != af->frame->nb_samples && !is->swr_ctx)) {
+		swr_free(&is->swr_ctx);
+		is->swr_ctx = swr_alloc_set_opts(NULL,
+		                                 is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
+		                                 dec_channel_layout,           af->frame->format, af->frame->sample_rate,
+		                                 0, NULL);
+		if (!is->swr_ctx || swr_init(is->swr_ctx) < 0) {
+			av_log(NULL, AV_LOG_ERROR,
+			       "Cannot create sample rate converter for conversion of %d Hz %s %d channels to %d Hz %s %d channels!\n",
+			       af->frame->sample_rate, av_get_sample_fmt_name(af->frame->format),
+			       av_frame_get_channels(af->frame),
+			       is->audio_tgt.freq, av_get_sample_fmt_name(is->audio_tgt.fmt),
+			       is->audio_tgt.channels);
+			swr_free(&is->swr_ctx);
+			return -1;
+		}
+		is->audio_src.channel_layout = dec_channel_layout;
+		is->audio_src.channels = av_frame_get_channels(af->frame);
+		is->audio_src.freq = af->frame->sample_rate;
+		is->audio_src.fmt = af->frame->format;
+	}
+
+	if (is->swr_ctx) {
+		const uint8_t **in = (const uint8_t **)af->frame->extended_data;
+		uint8_t **out = &is->audio_buf1;
+		int out_count = (int64_t)wanted_nb_samples * is->audio_tgt.freq /
+		                af->frame->sample_rate + 256;
+		int out_size = av_samples_get_buffer_size(NULL, is->audio_tgt.channels,
+		               out_count, is->audio_tgt.fmt, 0);
+		uint64_t pc[PERF_COUNTER_NB];
+		int len2, perf;
+		if (out_size < 0) {
+			av_log(NULL, AV_LOG_ERROR, "av_samples_get_buffer_size() failed\n");
+			return -1;
+		}
+		if (wanted_nb_samples != af->frame->nb_samples) {
+			if (swr_set_compensation(is->swr_ctx,
+			                         (wanted_nb_samples - af->frame->nb_samples) * is->audio_tgt.freq /
+			                         af->frame->sample_rate,
+			                         wanted_nb_samples * is->audio_tgt.freq / af->frame->sample_rate) < 0) {
+				av_log(NULL, AV_LOG_ERROR, "swr_set_compensation() failed\n");
+				return -1;
+			}
+		}
+		if (__atomic_exchange_n(&mem_budget.trim_audio_buf, 0, __ATOMIC_ACQ_REL)) {
+			if (is->audio_buf1_size > out_size) {
+				av_freep(&is->audio_buf1);
+				is->audio_buf1_size = 0;
+			}
+		}
+		av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
+		if (!is->audio_buf1)
+			return AVERROR(ENOMEM);
+		perf = perf_begin(pc);
+		len2 = swr_convert(is->swr_ctx, out, out_count, in, af->frame->nb_samples);
+		if (perf)
+			perf_end(PERF_REGION_SWR, pc, af->frame->nb_samples);
+		if (len2 < 0) {
+			av_log(NULL, AV_LOG_ERROR, "swr_convert() failed\n");
+			return -1;
+		}
+		if (len2 == out_count) {
+			av_log(NULL, AV_LOG_WARNING, "audio buffer is probably too small\n");
+			if (swr_init(is->swr_ctx) < 0)
+				swr_free(&is->swr_ctx);
 		}
+		is->audio_buf = is->audio_buf1;
+		resampled_data_size = len2 * is->audio_tgt.channels * av_get_bytes_per_sample(
+		                          is->audio_tgt.fmt);
+	} else {
+		is->audio_buf = af->frame->data[0];
+		resampled_data_size = data_size;
+	}
 
-		outputs->name = av_strdup("in");
-		outputs->filter_ctx = source_ctx;
-		outputs->pad_idx = 0;
-		outputs->next = NULL;
+	audio_clock0 = is->audio_clock;
+	/* update the audio clock with the pts */
+	if (!isnan(af->pts))
+		is->audio_clock = af->pts + (double) af->frame->nb_samples /
+		                  af->frame->sample_rate;
+	else
+		is->audio_clock = NAN;
+	is->audio_clock_serial = af->serial;
+	return resampled_data_size;
+}
 
-		inputs->name = av_strdup("out");
-		inputs->filter_ctx = sink_ctx;
-		inputs->pad_idx = 0;
-		inputs->next = NULL;
+/* prepare a new audio buffer */
+static void aclock_filter_reset(AudioClockFilter *f, int serial, double time)
+{
+	f->nb = f->index = 0;
+	f->serial = serial;
+	f->base = time;
+	f->last_raw = f->last_out = NAN;
+}
 
-		if ((ret = avfilter_graph_parse_ptr(graph, filtergraph, &inputs, &outputs,
-		                                    NULL)) < 0)
-			goto fail;
+/* add the position reported at a callback, return the fitted one and its speed */
+static double aclock_filter_update(VideoState *is, double pts, double time, double *speed)
+{
+	AudioClockFilter *f = &is->aclock;
+	int n = av_clip(aclock_filter, ACLOCK_MIN_POINTS, ACLOCK_WINDOW_MAX);
+	double prev_time = f->last_time;
+	double x, out, mean_y = 0, sxx = 0, sxy = 0;
+	int i;
+
+	if (f->serial != is->audio_clock_serial || time - f->last_time > ACLOCK_MAX_GAP ||
+	    (f->nb >= ACLOCK_MIN_POINTS &&
+	     fabs(pts - (time + f->offset + f->slope * (time - f->base - f->mean_x))) > ACLOCK_MAX_ERROR)) {
+		if (f->nb)
+			f->nb_resets++;
+		aclock_filter_reset(f, is->audio_clock_serial, time);
+	}
+	x = time - f->base;
+	f->x[f->index] = x;
+	f->y[f->index] = pts - time;
+	f->index = (f->index + 1) % n;
+	f->nb = FFMIN(f->nb + 1, n);
+	f->last_time = time;
+
+	if (f->nb < ACLOCK_MIN_POINTS) {
+		out = pts;
+		*speed = 1.0;
 	} else {
-		if ((ret = avfilter_link(source_ctx, 0, sink_ctx, 0)) < 0)
-			goto fail;
+		f->mean_x = 0;
+		for (i = 0; i < f->nb; i++) {
+			f->mean_x += f->x[i];
+			mean_y += f->y[i];
+		}
+		f->mean_x /= f->nb;
+		mean_y /= f->nb;
+		for (i = 0; i < f->nb; i++) {
+			sxx += (f->x[i] - f->mean_x) * (f->x[i] - f->mean_x);
+			sxy += (f->x[i] - f->mean_x) * (f->y[i] - mean_y);
+		}
+		f->offset = mean_y;
+		f->slope = av_clipd(sxx > 0 ? sxy / sxx : 0, -ACLOCK_MAX_DRIFT, ACLOCK_MAX_DRIFT);
+		out = time + f->offset + f->slope * (x - f->mean_x);
+		*speed = 1.0 + f->slope;
 	}
 
-	/* Reorder the filters to ensure that inputs of the custom filters are merged first */
-	for (i = 0; i < graph->nb_filters - nb_filters; i++)
-		FFSWAP(AVFilterContext *, graph->filters[i], graph->filters[i + nb_filters]);
+	if (!isnan(f->last_out)) {
+		double raw_step = pts - (f->last_raw + time - prev_time);
+		double out_step = out - (f->last_out + (time - prev_time) * f->last_speed);
+		f->raw_step2 += raw_step * raw_step;
+		f->out_step2 += out_step * out_step;
+		f->nb_steps++;
+	}
+	f->last_raw = pts;
+	f->last_out = out;
+	f->last_speed = *speed;
+	return out;
+}
 
-	ret = avfilter_graph_config(graph, NULL);
-fail:
-	avfilter_inout_free(&outputs);
-	avfilter_inout_free(&inputs);
-	return ret;
+static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
+{
+	VideoState *is = opaque;
+	int audio_size, len1;
+
+	thread_stats_enter(THREAD_AUDIO_CALLBACK);
+	audio_callback_time = av_gettime_relative();
+
+	while (len > 0) {
+		if (is->audio_buf_index >= is->audio_buf_size) {
+			audio_size = audio_decode_frame(is);
+			if (audio_size < 0) {
+				/* if error, just output silence */
+				is->audio_buf = NULL;
+				is->audio_buf_size = SDL_AUDIO_MIN_BUFFER_SIZE / is->audio_tgt.frame_size *
+				                     is->audio_tgt.frame_size;
+			} else {
+				if (is->show_mode != SHOW_MODE_VIDEO)
+					update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
+				is->audio_buf_size = audio_size;
+			}
+			is->audio_buf_index = 0;
+		}
+		len1 = is->audio_buf_size - is->audio_buf_index;
+		if (len1 > len)
+			len1 = len;
+		if (is->audio_buf && is->audio_volume == SDL_MIX_MAXVOLUME)
+			memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
+		else {
+			memset(stream, 0, len1);
+			if (is->audio_buf)
+				SDL_MixAudio(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1,
+				             is->audio_volume);
+		}
+		len -= len1;
+		stream += len1;
+		is->audio_buf_index += len1;
+	}
+	is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
+	/* Let's assume the audio driver that is used by SDL has two periods. */
+	if (!isnan(is->audio_clock)) {
+		double pts = is->audio_clock - (double)(2 * is->audio_hw_buf_size +
+		                                        is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec;
+		double time = audio_callback_time / 1000000.0;
+
+		if (aclock_filter > 0)
+			pts = aclock_filter_update(is, pts, time, &is->audclk.speed);
+		set_clock_at(&is->audclk, pts, is->audio_clock_serial, time);
+		sync_clock_to_slave(&is->extclk, &is->audclk);
+	}
+	thread_stats_update();
 }
 
-static int configure_video_filters(AVFilterGraph *graph, VideoState *is,
-                                   const char *vfilters, AVFrame *frame)
+static int audio_open(void *opaque, int64_t wanted_channel_layout,
+                      int wanted_nb_channels, int wanted_sample_rate,
+                      struct AudioParams *audio_hw_params)
 {
-	static const enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGRA, AV_PIX_FMT_NONE };
-	char sws_flags_str[512] = "";
-	char buffersrc_args[256];
-	int ret;
-	AVFilterContext *filt_src = NULL, *filt_out = NULL, *last_filter = NULL;
-	AVCodecParameters *codecpar = is->video_st->codecpar;
-	AVRational fr = av_guess_frame_rate(is->ic, is->video_st, NULL);
-	AVDictionaryEntry *e = NULL;
+	SDL_AudioSpec wanted_spec, spec;
+	const char *env;
+	static const int next_nb_channels[] = {0, 0, 1, 6, 2, 6, 4, 6};
+	static const int next_sample_rates[] = {0, 44100, 48000, 96000, 192000};
+	int next_sample_rate_idx = FF_ARRAY_ELEMS(next_sample_rates) - 1;
 
-	while ((e = av_dict_get(sws_dict, "", e, AV_DICT_IGNORE_SUFFIX))) {
-		if (!strcmp(e->key, "sws_flags")) {
-			av_strlcatf(sws_flags_str, sizeof(sws_flags_str), "%s=%s:", "flags", e->value);
-		} else
-			av_strlcatf(sws_flags_str, sizeof(sws_flags_str), "%s=%s:", e->key, e->value);
+	env = SDL_getenv("SDL_AUDIO_CHANNELS");
+	if (env) {
+		wanted_nb_channels = atoi(env);
+		wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
+	}
+	if (!wanted_channel_layout ||
+	    wanted_nb_channels != av_get_channel_layout_nb_channels(
+	        wanted_channel_layout)) {
+		wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
+		wanted_channel_layout &= ~AV_CH_LAYOUT_STEREO_DOWNMIX;
+	}
+	wanted_nb_channels = av_get_channel_layout_nb_channels(wanted_channel_layout);
+	wanted_spec.channels = wanted_nb_channels;
+	wanted_spec.freq = wanted_sample_rate;
+	if (wanted_spec.freq <= 0 || wanted_spec.channels <= 0) {
+		av_log(NULL, AV_LOG_ERROR, "Invalid sample rate or channel count!\n");
+		return -1;
+	}
+	while (next_sample_rate_idx &&
+	       next_sample_rates[next_sample_rate_idx] >= wanted_spec.freq)
+		next_sample_rate_idx--;
+	wanted_spec.format = AUDIO_S16SYS;
+	wanted_spec.silence = 0;
+	wanted_spec.samples = FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE,
+	                            2 << av_log2(wanted_spec.freq / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
+	wanted_spec.callback = sdl_audio_callback;
+	wanted_spec.userdata = opaque;
+	while (SDL_OpenAudio(&wanted_spec, &spec) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "SDL_OpenAudio (%d channels, %d Hz): %s\n",
+		       wanted_spec.channels, wanted_spec.freq, SDL_GetError());
+		wanted_spec.channels = next_nb_channels[FFMIN(7, wanted_spec.channels)];
+		if (!wanted_spec.channels) {
+			wanted_spec.freq = next_sample_rates[next_sample_rate_idx--];
+			wanted_spec.channels = wanted_nb_channels;
+			if (!wanted_spec.freq) {
+				av_log(NULL, AV_LOG_ERROR,
+				       "No more combinations to try, audio open failed\n");
+				return -1;
+			}
+		}
+		wanted_channel_layout = av_get_default_channel_layout(wanted_spec.channels);
+	}
+	if (spec.format != AUDIO_S16SYS) {
+		av_log(NULL, AV_LOG_ERROR,
+		       "SDL advised audio format %d is not supported!\n", spec.format);
+		return -1;
+	}
+	if (spec.channels != wanted_spec.channels) {
+		wanted_channel_layout = av_get_default_channel_layout(spec.channels);
+		if (!wanted_channel_layout) {
+			av_log(NULL, AV_LOG_ERROR,
+			       "SDL advised channel count %d is not supported!\n", spec.channels);
+			return -1;
+		}
 	}
-	if (strlen(sws_flags_str))
-		sws_flags_str[strlen(sws_flags_str) - 1] = '\0';
 
-	graph->scale_sws_opts = av_strdup(sws_flags_str);
+	audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+	audio_hw_params->freq = spec.freq;
+	audio_hw_params->channel_layout = wanted_channel_layout;
+	audio_hw_params->channels = spec.channels;
+	audio_hw_params->frame_size = av_samples_get_buffer_size(NULL,
+	                              audio_hw_params->channels, 1, audio_hw_params->fmt, 1);
+	audio_hw_params->bytes_per_sec = av_samples_get_buffer_size(NULL,
+	                                 audio_hw_params->channels, audio_hw_params->freq, audio_hw_params->fmt, 1);
+	if (audio_hw_params->bytes_per_sec <= 0 || audio_hw_params->frame_size <= 0) {
+		av_log(NULL, AV_LOG_ERROR, "av_samples_get_buffer_size failed\n");
+		return -1;
+	}
+	return spec.size;
+}
 
-	snprintf(buffersrc_args, sizeof(buffersrc_args),
-	         "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-	         frame->width, frame->height, frame->format,
-	         is->video_st->time_base.num, is->video_st->time_base.den,
-	         codecpar->sample_aspect_ratio.num, FFMAX(codecpar->sample_aspect_ratio.den, 1));
-	if (fr.num && fr.den)
-		av_strlcatf(buffersrc_args, sizeof(buffersrc_args), ":frame_rate=%d/%d", fr.num,
-		            fr.den);
+/* open a given stream. Return 0 if OK */
+static int stream_component_open(VideoState *is, int stream_index)
+{
+	AVFormatContext *ic = is->ic;
+	AVCodecContext *avctx;
+	AVCodec *codec;
+	AVDictionary *opts = NULL;
+	int sample_rate, nb_channels;
+	int64_t channel_layout;
+	int ret = 0;
+	AVFilterLink *link;
 
-	if ((ret = avfilter_graph_create_filter(&filt_src,
-	                                        avfilter_get_by_name("buffer"),
-	                                        "ffplay_buffer", buffersrc_args, NULL,
-	                                        graph)) < 0)
+	if (stream_index >= ic->nb_streams)
+		return -1;
+
+	avctx = avcodec_alloc_context3(NULL);
+	if (!avctx)
+		return AVERROR(ENOMEM);
+
+	ret = avcodec_parameters_to_context(avctx, ic->streams[stream_index]->codecpar);
+	if (ret < 0)
+		goto fail;
+	av_codec_set_pkt_timebase(avctx, ic->streams[stream_index]->time_base);
+
+	codec = avcodec_find_decoder(avctx->codec_id);
+	if (!codec) {
+		av_log(NULL, AV_LOG_WARNING, "No codec could be found with id %d\n",
+		       avctx->codec_id);
+		ret = AVERROR(EINVAL);
+		goto fail;
+	}
+
+	avctx->codec_id = codec->id;
+
+	/* -deterministic: one decoding thread, and the bit-exact variant of the
+	   codecs that have one; SIMD stays enabled */
+	av_dict_set(&opts, "threads", deterministic ? "1" : "auto", 0);
+	if (deterministic)
+		avctx->flags |= AV_CODEC_FLAG_BITEXACT;
+
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO ||
+	    avctx->codec_type == AVMEDIA_TYPE_AUDIO)
+		av_dict_set(&opts, "refcounted_frames", "1", 0);
+	frame_pool_install(avctx, codec);
+	if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
 		goto fail;
+	}
 
-	ret = avfilter_graph_create_filter(&filt_out,
-	                                   avfilter_get_by_name("buffersink"),
-	                                   "ffplay_buffersink", NULL, NULL, graph);
-	if (ret < 0)
-		goto fail;
+	is->eof = 0;
+	ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
+	switch (avctx->codec_type) {
+	case AVMEDIA_TYPE_AUDIO:
+		is->audio_filter_src.freq = avctx->sample_rate;
+		is->audio_filter_src.channels = avctx->channels;
+		is->audio_filter_src.channel_layout = get_valid_channel_layout(
+		        avctx->channel_layout, avctx->channels);
+		is->audio_filter_src.fmt = avctx->sample_fmt;
+		if ((ret = configure_audio_filters(is, afilters, 0)) < 0)
+			goto fail;
+		link = is->out_audio_filter->inputs[0];
+		sample_rate = link->sample_rate;
+		nb_channels = avfilter_link_get_channels(link);
+		channel_layout = link->channel_layout;
 
-	if ((ret = av_opt_set_int_list(filt_out, "pix_fmts", pix_fmts,  AV_PIX_FMT_NONE,
-	                               AV_OPT_SEARCH_CHILDREN)) < 0)
-		goto fail;
+		/* prepare audio output */
+		if (export_audio)
+			ret = export_audio_open(channel_layout, nb_channels, sample_rate, &is->audio_tgt);
+		else
+			ret = audio_open(is, channel_layout, nb_channels, sample_rate, &is->audio_tgt);
+		if (ret < 0)
+			goto fail;
+		is->audio_hw_buf_size = ret;
+		is->audio_src = is->audio_tgt;
+		is->audio_buf_size = 0;
+		is->audio_buf_index = 0;
 
-	last_filter = filt_out;
+		is->audio_stream = stream_index;
+		is->audio_st = ic->streams[stream_index];
 
-	if ((ret = configure_filtergraph(graph, vfilters, filt_src, last_filter)) < 0)
-		goto fail;
+		decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread);
+		is->auddec.bypass_format = decoder_bypass_format(ic->streams[stream_index]->codecpar);
+		if ((is->ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH |
+		                               AVFMT_NO_BYTE_SEEK)) && !is->ic->iformat->read_seek) {
+			is->auddec.start_pts = is->audio_st->start_time;
+			is->auddec.start_pts_tb = is->audio_st->time_base;
+		}
+		if ((ret = decoder_start(&is->auddec, audio_thread, is)) < 0)
+			goto out;
+		if (!export_audio)
+			SDL_PauseAudio(0);
+		break;
+	case AVMEDIA_TYPE_VIDEO:
+		is->video_stream = stream_index;
+		is->video_st = ic->streams[stream_index];
 
-	is->in_video_filter = filt_src;
-	is->out_video_filter = filt_out;
+		decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread);
+		/* the new decoder starts with the default skip_frame */
+		is->skipping_nonref = 0;
+		is->viddec.bypass_format = decoder_bypass_format(ic->streams[stream_index]->codecpar);
+		if (intra_threads > 1 && !deterministic)
+			intra_pool_open(&is->viddec, is->video_st);
+		if ((ret = decoder_start(&is->viddec, video_thread, is)) < 0)
+			goto out;
+		is->queue_attachments_req = 1;
+		break;
+	default:
+		break;
+	}
+	goto out;
 
 fail:
+	avcodec_free_context(&avctx);
+out:
+	av_dict_free(&opts);
+
 	return ret;
 }
 
-static int configure_audio_filters(VideoState *is, const char *afilters,
-                                   int force_output_format)
+static void stream_component_close(VideoState *is, int stream_index)
 {
-	static const enum AVSampleFormat sample_fmts[] = { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE };
-	int sample_rates[2] = { 0, -1 };
-	int64_t channel_layouts[2] = { 0, -1 };
-	int channels[2] = { 0, -1 };
-	AVFilterContext *filt_asrc = NULL, *filt_asink = NULL;
-	char aresample_swr_opts[512] = "";
-	AVDictionaryEntry *e = NULL;
-	char asrc_args[256];
-	int ret;
+	AVFormatContext *ic = is->ic;
 
-	avfilter_graph_free(&is->agraph);
-	if (!(is->agraph = avfilter_graph_alloc()))
-		return AVERROR(ENOMEM);
+	if (stream_index < 0 || stream_index >= ic->nb_streams)
+		return;
 
-	while ((e = av_dict_get(swr_opts, "", e, AV_DICT_IGNORE_SUFFIX)))
-		av_strlcatf(aresample_swr_opts, sizeof(aresample_swr_opts), "%s=%s:", e->key,
-		            e->value);
-	if (strlen(aresample_swr_opts))
-		aresample_swr_opts[strlen(aresample_swr_opts) - 1] = '\0';
-	av_opt_set(is->agraph, "aresample_swr_opts", aresample_swr_opts, 0);
+	switch (ic->streams[stream_index]->codecpar->codec_type) {
+	case AVMEDIA_TYPE_AUDIO:
+		decoder_abort(&is->auddec, &is->sampq);
+		if (!export_audio) {
+			SDL_CloseAudio();
+			perf_audio_close();
+		}
+		decoder_destroy(&is->auddec);
+		swr_free(&is->swr_ctx);
+		av_freep(&is->audio_buf1);
+		is->audio_buf1_size = 0;
+		is->audio_buf = NULL;
+		is->audio_stream = -1;
+		is->audio_st = NULL;
+		break;
+	case AVMEDIA_TYPE_VIDEO:
+		decoder_abort(&is->viddec, &is->pictq);
+		decoder_destroy(&is->viddec);
+		is->video_stream = -1;
+		is->video_st = NULL;
+		/* the next video stream, or this one reopened, uploads its picture again */
+		is->still_image = 0;
+		break;
+	default:
+		break;
+	}
+	ic->streams[stream_index]->discard = AVDISCARD_ALL;
+}
 
-	ret = snprintf(asrc_args, sizeof(asrc_args),
-	               "sample_rate=%d:sample_fmt=%s:channels=%d:time_base=%d/%d",
-	               is->audio_filter_src.freq, av_get_sample_fmt_name(is->audio_filter_src.fmt),
-	               is->audio_filter_src.channels,
-	               1, is->audio_filter_src.freq);
-	if (is->audio_filter_src.channel_layout)
-		snprintf(asrc_args + ret, sizeof(asrc_args) - ret,
-		         ":channel_layout=0x%"PRIx64,  is->audio_filter_src.channel_layout);
+/* close and reopen a stream, which reallocates its decoder, filters and output */
+static void stream_component_reopen(VideoState *is, int stream_index)
+{
+	if (stream_index < 0)
+		return;
+	stream_component_close(is, stream_index);
+	if (stream_component_open(is, stream_index) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "soak: failed to reopen stream %d\n", stream_index);
+		framecrc_finish(is, stream_index);
+	}
+}
 
-	ret = avfilter_graph_create_filter(&filt_asrc,
-	                                   avfilter_get_by_name("abuffer"), "ffplay_abuffer",
-	                                   asrc_args, NULL, is->agraph);
-	if (ret < 0)
-		goto end;
+static int decode_interrupt_cb(void *ctx)
+{
+	VideoState *is = ctx;
+	return is->abort_request;
+}
 
+/* drain the pipe into the ring with large reads, independently of the demuxer */
+static int pipe_reader_thread(void *arg)
+{
+	PipeRing *r = arg;
+	struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+	int64_t len;
+	ssize_t n;
+
+	SDL_LockMutex(r->mutex);
+	for (;;) {
+		/* keep a quarter of the ring behind the demuxer for backward seeks */
+		while (!r->abort && r->write_pos - r->read_pos >= r->size - r->size / 4)
+			cond_wait(r->cond, r->mutex);
+		if (r->abort)
+			break;
+		len = FFMIN3(r->size - r->write_pos % r->size,
+		             r->size - r->size / 4 - (r->write_pos - r->read_pos), PIPE_READ_SIZE);
+		r->writing = len;
+		SDL_UnlockMutex(r->mutex);
+
+		/* poll so that an idle pipe does not keep us from exiting */
+		n = poll(&pfd, 1, 100);
+		if (n > 0)
+			n = read(r->fd, r->buf + r->write_pos % r->size, len);
+
+		SDL_LockMutex(r->mutex);
+		r->writing = 0;
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n > 0 || (n == 0 && !(pfd.revents & (POLLIN | POLLHUP)))) {
+			r->write_pos += n;
+			SDL_CondBroadcast(r->cond);
+			continue;
+		}
+		r->eof = n ? AVERROR(errno) : AVERROR_EOF;
+		SDL_CondBroadcast(r->cond);
+		break;
+	}
+	SDL_UnlockMutex(r->mutex);
+	return 0;
+}
 
-	ret = avfilter_graph_create_filter(&filt_asink,
-	                                   avfilter_get_by_name("abuffersink"), "ffplay_abuffersink",
-	                                   NULL, NULL, is->agraph);
-	if (ret < 0)
-		goto end;
+static int pipe_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+	PipeRing *r = opaque;
+	int64_t avail;
+	int ret = 0;
 
-	if ((ret = av_opt_set_int_list(filt_asink, "sample_fmts", sample_fmts,
-	                               AV_SAMPLE_FMT_NONE, AV_OPT_SEARCH_CHILDREN)) < 0)
-		goto end;
-	if ((ret = av_opt_set_int(filt_asink, "all_channel_counts", 1,
-	                          AV_OPT_SEARCH_CHILDREN)) < 0)
-		goto end;
+	SDL_LockMutex(r->mutex);
+	while (!(avail = r->write_pos - r->read_pos) && !r->eof) {
+		if (r->is->abort_request) {
+			ret = AVERROR_EXIT;
+			break;
+		}
+		cond_wait_timeout(r->cond, r->mutex, 10);
+	}
+	if (!ret && !avail)
+		ret = r->eof;
+	if (!ret) {
+		ret = FFMIN3(buf_size, avail, r->size - r->read_pos % r->size);
+		memcpy(buf, r->buf + r->read_pos % r->size, ret);
+		r->read_pos += ret;
+		SDL_CondBroadcast(r->cond);
+	}
+	SDL_UnlockMutex(r->mutex);
+	return ret;
+}
 
-	if (force_output_format) {
-		channel_layouts[0] = is->audio_tgt.channel_layout;
-		channels[0] = is->audio_tgt.channels;
-		sample_rates[0] = is->audio_tgt.freq;
-		if ((ret = av_opt_set_int(filt_asink, "all_channel_counts", 0,
-		                          AV_OPT_SEARCH_CHILDREN)) < 0)
-			goto end;
-		if ((ret = av_opt_set_int_list(filt_asink, "channel_layouts", channel_layouts,
-		                               -1, AV_OPT_SEARCH_CHILDREN)) < 0)
-			goto end;
-		if ((ret = av_opt_set_int_list(filt_asink, "channel_counts", channels, -1,
-		                               AV_OPT_SEARCH_CHILDREN)) < 0)
-			goto end;
-		if ((ret = av_opt_set_int_list(filt_asink, "sample_rates", sample_rates, -1,
-		                               AV_OPT_SEARCH_CHILDREN)) < 0)
+/* seek inside what is still in the ring, that is the data read from the pipe but not yet overwritten */
+static int64_t pipe_seek(void *opaque, int64_t offset, int whence)
+{
+	PipeRing *r = opaque;
+	int64_t ret;
+
+	SDL_LockMutex(r->mutex);
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		ret = r->eof == AVERROR_EOF ? r->write_pos : AVERROR(ENOSYS);
+		goto end;
+	case SEEK_CUR:
+		offset += r->read_pos;
+		break;
+	case SEEK_END:
+		if (r->eof != AVERROR_EOF) {
+			ret = AVERROR(ESPIPE);
 			goto end;
+		}
+		offset += r->write_pos;
+		break;
+	case SEEK_SET:
+		break;
+	default:
+		ret = AVERROR(EINVAL);
+		goto end;
 	}
-
-	if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc,
-	                                 filt_asink)) < 0)
+	if (offset > r->write_pos || offset < FFMAX(0, r->write_pos + r->writing - r->size)) {
+		ret = AVERROR(ESPIPE);
 		goto end;
-
-	is->in_audio_filter = filt_asrc;
-	is->out_audio_filter = filt_asink;
-
+	}
+	r->read_pos = ret = offset;
+	SDL_CondBroadcast(r->cond);
 end:
-	if (ret < 0)
-		avfilter_graph_free(&is->agraph);
+	SDL_UnlockMutex(r->mutex);
 	return ret;
 }
 
-static int audio_thread(void *arg)
+static int64_t mem_pipe_usage(void *opaque)
 {
-	VideoState *is = arg;
-	AVFrame *frame = av_frame_alloc();
-	Frame *af;
-	int last_serial = -1;
-	int64_t dec_channel_layout;
-	int reconfigure;
-	int got_frame = 0;
-	AVRational tb;
-	int ret = 0;
+	return ((PipeRing *)opaque)->size;
+}
 
-	if (!frame)
+/**
+ * Read a pipe input ("-", "pipe:[fd]" or a FIFO) through a -pipe_buffer
+ * MiB ring filled by its own thread, so producer bursts do not stall the
+ * demuxer and the demuxer's small reads do not cost a syscall each.
+ * Returns 0 without touching ic if the input is not a pipe.
+ */
+static int pipe_input_open(VideoState *is, AVFormatContext *ic)
+{
+	PipeRing *r = &pipe_in;
+	const char *filename = is->filename, *p;
+	uint8_t *iobuf;
+	struct stat st;
+
+	if (!strcmp(filename, "-")) {
+		r->fd = STDIN_FILENO;
+	} else if (av_strstart(filename, "pipe:", &p)) {
+		r->fd = *p ? strtol(p, NULL, 10) : STDIN_FILENO;
+	} else if (!stat(filename, &st) && S_ISFIFO(st.st_mode)) {
+		if ((r->fd = open(filename, O_RDONLY)) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "%s: %s\n", filename, strerror(errno));
+			return AVERROR(errno);
+		}
+		r->own_fd = 1;
+	} else {
+		return 0;
+	}
+
+	r->is = is;
+	r->size = (int64_t)pipe_buffer << 20;
+	r->buf = av_malloc(r->size);
+	iobuf = av_malloc(PIPE_IO_SIZE);
+	r->mutex = SDL_CreateMutex();
+	r->cond = SDL_CreateCond();
+	if (!r->buf || !iobuf || !r->mutex || !r->cond) {
+		av_free(iobuf);
 		return AVERROR(ENOMEM);
+	}
+	r->pb = avio_alloc_context(iobuf, PIPE_IO_SIZE, 0, r, pipe_read_packet, NULL, pipe_seek);
+	if (!r->pb) {
+		av_free(iobuf);
+		return AVERROR(ENOMEM);
+	}
+	/* demuxers must treat it as a stream, avio_seek() still uses pipe_seek() going backward */
+	r->pb->seekable = 0;
+	if (!(r->tid = SDL_CreateThread(pipe_reader_thread, "pipe_reader", r))) {
+		av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+		return AVERROR(ENOMEM);
+	}
+	ic->pb = r->pb;
+	mem_budget_register("pipe ring", MEM_PRIO_FIXED, r, mem_pipe_usage, NULL, NULL);
+	return 0;
+}
 
-	do {
-		if ((got_frame = decoder_decode_frame(&is->auddec, frame)) < 0)
-			goto the_end;
+/* set or clear the bit of a block, in memory and in the map file */
+static void cache_mark_block(CacheInput *c, int64_t index, int cached)
+{
+	if (cached)
+		c->map[index >> 3] |= 1 << (index & 7);
+	else
+		c->map[index >> 3] &= ~(1 << (index & 7));
+	if (c->map_fd >= 0 &&
+	    pwrite(c->map_fd, &c->map[index >> 3], 1, c->map_offset + (index >> 3)) != 1) {
+		av_log(NULL, AV_LOG_WARNING, "cache: %s.map: %s, no longer updated\n", c->path, strerror(errno));
+		close(c->map_fd);
+		c->map_fd = -1;
+	}
+}
 
-		if (got_frame) {
-			tb = (AVRational) {
-				1, frame->sample_rate
-			};
+static int cache_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+	CacheInput *c = opaque;
+	int64_t index = c->pos / CACHE_BLOCK_SIZE;
+	int64_t start = index * CACHE_BLOCK_SIZE;
+	int len = FFMIN(CACHE_BLOCK_SIZE, c->size - start);
+	int off = c->pos - start;
+	int ret;
 
-			dec_channel_layout = get_valid_channel_layout(frame->channel_layout,
-			                     av_frame_get_channels(frame));
+	if (c->pos >= c->size)
+		return AVERROR_EOF;
+	buf_size = FFMIN(buf_size, len - off);
 
-			reconfigure =
-			    cmp_audio_fmts(is->audio_filter_src.fmt, is->audio_filter_src.channels,
-			                   frame->format, av_frame_get_channels(frame)) ||
-			    is->audio_filter_src.channel_layout != dec_channel_layout ||
-			    is->audio_filter_src.freq != frame->sample_rate ||
-			    is->auddec.pkt_serial != last_serial;
+	if (c->map[index >> 3] & (1 << (index & 7))) {
+		ret = pread(c->fd, buf, buf_size, c->pos);
+		if (ret > 0) {
+			c->pos += ret;
+			c->disk_bytes += ret;
+			return ret;
+		}
+		/* the data file was damaged, fetch the block again */
+		cache_mark_block(c, index, 0);
+	}
 
-			if (reconfigure) {
-				char buf1[1024], buf2[1024];
-				av_get_channel_layout_string(buf1, sizeof(buf1), -1,
-				                             is->audio_filter_src.channel_layout);
-				av_get_channel_layout_string(buf2, sizeof(buf2), -1, dec_channel_layout);
-				av_log(NULL, AV_LOG_DEBUG,
-				       "Audio frame changed from rate:%d ch:%d fmt:%s layout:%s serial:%d to rate:%d ch:%d fmt:%s layout:%s serial:%d\n",
-				       is->audio_filter_src.freq, is->audio_filter_src.channels,
-				       av_get_sample_fmt_name(is->audio_filter_src.fmt), buf1, last_serial,
-				       frame->sample_rate, av_frame_get_channels(frame),
-				       av_get_sample_fmt_name(frame->format), buf2, is->auddec.pkt_serial);
+	if (c->block_index != index) {
+		/* fetch the whole block so that it can be cached */
+		if (avio_tell(c->remote) != start &&
+		    (ret = avio_seek(c->remote, start, SEEK_SET)) < 0)
+			return ret;
+		c->block_index = -1;
+		ret = avio_read(c->remote, c->block, len);
+		if (ret <= 0)
+			return ret ? ret : AVERROR_EOF;
+		c->net_bytes += ret;
+		c->block_index = index;
+		c->block_len = ret;
+		if (ret == len && c->cached + len <= c->budget &&
+		    pwrite(c->fd, c->block, len, start) == len) {
+			cache_mark_block(c, index, 1);
+			c->cached += len;
+		}
+	}
+	if (off >= c->block_len)
+		return AVERROR_EOF;
+	ret = FFMIN(buf_size, c->block_len - off);
+	memcpy(buf, c->block + off, ret);
+	c->pos += ret;
+	return ret;
+}
 
-				is->audio_filter_src.fmt = frame->format;
-				is->audio_filter_src.channels = av_frame_get_channels(frame);
-				is->audio_filter_src.channel_layout = dec_channel_layout;
-				is->audio_filter_src.freq = frame->sample_rate;
-				last_serial = is->auddec.pkt_serial;
+static int64_t cache_seek(void *opaque, int64_t offset, int whence)
+{
+	CacheInput *c = opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return c->size;
+	case SEEK_CUR:
+		offset += c->pos;
+		break;
+	case SEEK_END:
+		offset += c->size;
+		break;
+	case SEEK_SET:
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (offset < 0)
+		return AVERROR(EINVAL);
+	return c->pos = offset;
+}
 
-				if ((ret = configure_audio_filters(is, afilters, 1)) < 0)
-					goto the_end;
-			}
+typedef struct CacheFile {
+	char *key;
+	time_t mtime;
+	int64_t size;
+} CacheFile;
 
-			if ((ret = av_buffersrc_add_frame(is->in_audio_filter, frame)) < 0)
-				goto the_end;
+static int cmp_cache_file(const void *a, const void *b)
+{
+	const CacheFile *fa = a, *fb = b;
+	return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
 
-			while ((ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame,
-			              0)) >= 0) {
-				tb = is->out_audio_filter->inputs[0]->time_base;
-				if (!(af = frame_queue_peek_writable(&is->sampq)))
-					goto the_end;
+/* remove the least recently used entities until the cache fits in -cache_size with room for need bytes */
+static void cache_evict(const char *keep, int64_t need)
+{
+	CacheFile *files = NULL;
+	int nb_files = 0, i;
+	int64_t total = 0, budget = (int64_t)cache_size << 20;
+	DIR *dir = opendir(cache_dir);
+	struct dirent *de;
+
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+		char *path;
+		struct stat st;
 
-				af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
-				af->pos = av_frame_get_pkt_pos(frame);
-				af->serial = is->auddec.pkt_serial;
-				af->duration = av_q2d((AVRational) {
-					frame->nb_samples, frame->sample_rate
-				});
+		if (len < 6 || strcmp(de->d_name + len - 5, ".data"))
+			continue;
+		path = av_asprintf("%s/%s", cache_dir, de->d_name);
+		if (path && !stat(path, &st) && !av_reallocp_array(&files, nb_files + 1, sizeof(*files))) {
+			files[nb_files].key = av_strndup(de->d_name, len - 5);
+			files[nb_files].mtime = st.st_mtime;
+			files[nb_files].size = (int64_t)st.st_blocks * 512;
+			total += files[nb_files++].size;
+		}
+		av_free(path);
+	}
+	closedir(dir);
 
-				av_frame_move_ref(af->frame, frame);
-				frame_queue_push(&is->sampq);
+	qsort(files, nb_files, sizeof(*files), cmp_cache_file);
+	for (i = 0; i < nb_files && total + need > budget; i++) {
+		char *data, *map;
+		int fd = -1;
 
-				if (is->audioq.serial != is->auddec.pkt_serial)
-					break;
+		if (!files[i].key || !strcmp(files[i].key, keep))
+			continue;
+		data = av_asprintf("%s/%s.data", cache_dir, files[i].key);
+		map = av_asprintf("%s/%s.map", cache_dir, files[i].key);
+		/* an entity another process is playing holds a shared lock */
+		if (data && map && (fd = open(data, O_RDONLY)) >= 0) {
+			if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+				av_log(NULL, AV_LOG_VERBOSE, "cache: %s is in use, not evicted\n", files[i].key);
+			} else if (!unlink(data)) {
+				unlink(map);
+				total -= files[i].size;
+				av_log(NULL, AV_LOG_VERBOSE, "cache: evicted %s\n", files[i].key);
 			}
-			if (ret == AVERROR_EOF)
-				is->auddec.finished = is->auddec.pkt_serial;
+			close(fd);
 		}
-	} while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
-the_end:
-	avfilter_graph_free(&is->agraph);
-	av_frame_free(&frame);
-	return ret;
+		av_free(data);
+		av_free(map);
+	}
+	for (i = 0; i < nb_files; i++)
+		av_free(files[i].key);
+	av_free(files);
 }
 
-static int decoder_start(Decoder *d, int (*fn)(void *), void *arg)
+/* load the block bitmap of an earlier session if it is for the same URL and size */
+static void cache_load_map(CacheInput *c, const char *url)
 {
-	packet_queue_start(d->queue);
-	d->decoder_tid = SDL_CreateThread(fn, "decoder", arg);
-	if (!d->decoder_tid) {
-		av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
-		return AVERROR(ENOMEM);
+	char *map_path = av_asprintf("%s.map", c->path);
+	FILE *f = map_path ? fopen(map_path, "rb") : NULL;
+	char magic[8];
+	int64_t size;
+	int32_t len;
+	char *stored = NULL;
+	int64_t i;
+
+	if (f && fread(magic, 1, 8, f) == 8 && !memcmp(magic, CACHE_MAP_MAGIC, 8) &&
+	    fread(&size, sizeof(size), 1, f) == 1 && size == c->size &&
+	    fread(&len, sizeof(len), 1, f) == 1 && len == strlen(url) &&
+	    (stored = av_malloc(len + 1)) && fread(stored, 1, len, f) == len &&
+	    !memcmp(stored, url, len) &&
+	    fread(c->map, 1, (c->nb_blocks + 7) >> 3, f) == (c->nb_blocks + 7) >> 3) {
+		for (i = 0; i < c->nb_blocks; i++)
+			if (c->map[i >> 3] & (1 << (i & 7)))
+				c->cached += FFMIN(CACHE_BLOCK_SIZE, c->size - i * CACHE_BLOCK_SIZE);
+	} else {
+		memset(c->map, 0, (c->nb_blocks + 7) >> 3);
+		if (ftruncate(c->fd, 0) < 0)
+			av_log(NULL, AV_LOG_WARNING, "cache: %s\n", strerror(errno));
 	}
-	return 0;
+	if (f)
+		fclose(f);
+	av_free(stored);
+	av_free(map_path);
 }
 
-static int video_thread(void *arg)
+/* (re)write the map file from the loaded bitmap, cache_mark_block() then keeps it up to date */
+static int cache_write_map(CacheInput *c)
 {
-	VideoState *is = arg;
-	AVFrame *frame;
-	double pts;
-	double duration;
-	int ret;
-	AVRational tb = is->video_st->time_base;
-	AVRational frame_rate = av_guess_frame_rate(is->ic, is->video_st, NULL);
-	AVFilterGraph *graph = avfilter_graph_alloc();
-	AVFilterContext *filt_out = NULL, *filt_in = NULL;
-	int last_w = 0;
-	int last_h = 0;
-	enum AVPixelFormat last_format = -2;
-	int last_serial = -1;
-	int last_vfilter_idx = 0;
-	if (!graph) {
-		return AVERROR(ENOMEM);
+	char *map_path = av_asprintf("%s.map", c->path);
+	int32_t len = strlen(c->url);
+	int bitmap_size = (c->nb_blocks + 7) >> 3;
+	uint8_t *buf;
+	int size, ret = 0;
+
+	c->map_offset = 8 + sizeof(c->size) + sizeof(len) + len;
+	size = c->map_offset + bitmap_size;
+	buf = av_malloc(size);
+	if (!map_path || !buf) {
+		ret = AVERROR(ENOMEM);
+		goto end;
 	}
-
-	frame = av_frame_alloc();
-	if (!frame) {
-		avfilter_graph_free(&graph);
-		return AVERROR(ENOMEM);
+	memcpy(buf, CACHE_MAP_MAGIC, 8);
+	memcpy(buf + 8, &c->size, sizeof(c->size));
+	memcpy(buf + 16, &len, sizeof(len));
+	memcpy(buf + 20, c->url, len);
+	memcpy(buf + c->map_offset, c->map, bitmap_size);
+	if ((c->map_fd = open(map_path, O_RDWR | O_CREAT, 0666)) < 0 ||
+	    pwrite(c->map_fd, buf, size, 0) != size || ftruncate(c->map_fd, size) < 0) {
+		ret = AVERROR(errno);
+		av_log(NULL, AV_LOG_WARNING, "cache: %s: %s, the cached ranges are not kept\n",
+		       map_path, strerror(errno));
+		if (c->map_fd >= 0)
+			close(c->map_fd);
+		c->map_fd = -1;
 	}
+end:
+	av_free(buf);
+	av_free(map_path);
+	return ret;
+}
 
-	while (1) {
-		ret = get_video_frame(is, frame);
-		if (ret < 0)
-			goto the_end;
-		if (!ret)
-			continue;
-
-		if (last_w != frame->width || last_h != frame->height ||
-		    last_format != frame->format || last_serial != is->viddec.pkt_serial ||
-		    last_vfilter_idx != is->vfilter_idx) {
-			av_log(NULL, AV_LOG_DEBUG,
-			       "Video frame changed from size:%dx%d format:%s serial:%d to size:%dx%d format:%s serial:%d\n",
-			       last_w, last_h,
-			       (const char *)av_x_if_null(av_get_pix_fmt_name(last_format), "none"),
-			       last_serial, frame->width, frame->height,
-			       (const char *)av_x_if_null(av_get_pix_fmt_name(frame->format), "none"),
-			       is->viddec.pkt_serial);
-			avfilter_graph_free(&graph);
-			graph = avfilter_graph_alloc();
-			if ((ret = configure_video_filters(graph, is,
-			                                   vfilters_list ? vfilters_list[is->vfilter_idx] : NULL, frame)) < 0) {
-				SDL_Event event;
-				event.type = FF_QUIT_EVENT;
-				event.user.data1 = is;
-				SDL_PushEvent(&event);
-				goto the_end;
-			}
-			filt_in = is->in_video_filter;
-			filt_out = is->out_video_filter;
-			last_w = frame->width;
-			last_h = frame->height;
-			last_format = frame->format;
-			last_serial = is->viddec.pkt_serial;
-			last_vfilter_idx = is->vfilter_idx;
-			frame_rate = filt_out->inputs[0]->frame_rate;
-		}
-
-		ret = av_buffersrc_add_frame(filt_in, frame);
-		if (ret < 0)
-			goto the_end;
+/* open and lock the data file, reopening it if an eviction unlinked it before we got the lock */
+static int cache_open_data(const char *path)
+{
+	struct stat st;
+	int i, fd;
 
-		while (ret >= 0) {
-			is->frame_last_returned_time = av_gettime_relative() / 1000000.0;
+	for (i = 0; i < 3; i++) {
+		if ((fd = open(path, O_RDWR | O_CREAT, 0666)) < 0)
+			return -1;
+		if (!flock(fd, LOCK_SH) && !fstat(fd, &st) && st.st_nlink > 0)
+			return fd;
+		close(fd);
+	}
+	errno = EBUSY;
+	return -1;
+}
 
-			ret = av_buffersink_get_frame_flags(filt_out, frame, 0);
-			if (ret < 0) {
-				if (ret == AVERROR_EOF)
-					is->viddec.finished = is->viddec.pkt_serial;
-				ret = 0;
-				break;
-			}
+/**
+ * Put an on-disk cache under a remote input when -cache_dir is set. Cached
+ * byte ranges are kept in blocks keyed by the URL and the entity size, so
+ * replays, loops and backward seeks read them from disk. lavf's http does
+ * not export the ETag or Last-Modified headers, so the size is the only
+ * validator. Returns 0 without touching ic if the input is not cached.
+ */
+static int cache_input_open(VideoState *is, AVFormatContext *ic)
+{
+	CacheInput *c = &cache_in;
+	const char *proto = avio_find_protocol_name(is->filename);
+	char *data_path = NULL;
+	uint64_t key = 0xcbf29ce484222325ULL;
+	const char *p;
+	uint8_t *iobuf;
+	int ret;
 
-			is->frame_last_filter_delay = av_gettime_relative() / 1000000.0 -
-			                              is->frame_last_returned_time;
-			if (fabs(is->frame_last_filter_delay) > AV_NOSYNC_THRESHOLD / 10.0)
-				is->frame_last_filter_delay = 0;
-			tb = filt_out->inputs[0]->time_base;
-			duration = (frame_rate.num && frame_rate.den ? av_q2d((AVRational) {
-				frame_rate.den, frame_rate.num
-			}) : 0);
-			pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
-			ret = queue_picture(is, frame, pts, duration, av_frame_get_pkt_pos(frame),
-			                    is->viddec.pkt_serial);
-			av_frame_unref(frame);
-		}
+	if (!proto || (strcmp(proto, "http") && strcmp(proto, "https") && strcmp(proto, "ftp")))
+		return 0;
+	if ((ret = avio_open2(&c->remote, is->filename, AVIO_FLAG_READ, &ic->interrupt_callback, NULL)) < 0) {
+		print_error(is->filename, ret);
+		return ret;
+	}
+	c->size = avio_size(c->remote);
+	if (c->size <= 0 || !(c->remote->seekable & AVIO_SEEKABLE_NORMAL)) {
+		/* live or unseekable, let lavf open it directly */
+		av_log(NULL, AV_LOG_VERBOSE, "cache: %s has no size or cannot seek, not cached\n", is->filename);
+		avio_closep(&c->remote);
+		return 0;
+	}
 
-		if (ret < 0)
-			goto the_end;
+	/* FNV-1a of the URL, the size makes a changed entity a new key */
+	for (p = is->filename; *p; p++)
+		key = (key ^ (uint8_t)*p) * 0x100000001b3ULL;
+	c->url = av_strdup(is->filename);
+	c->path = av_asprintf("%s/%016"PRIx64"-%"PRId64, cache_dir, key, c->size);
+	data_path = c->path ? av_asprintf("%s.data", c->path) : NULL;
+	if (!c->url || !data_path)
+		goto enomem;
+	mkdir(cache_dir, 0777);
+	cache_evict(strrchr(c->path, '/') + 1, FFMIN(c->size, (int64_t)cache_size << 20));
+	if ((c->fd = cache_open_data(data_path)) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "cache: %s: %s, not cached\n", data_path, strerror(errno));
+		av_free(data_path);
+		cache_input_close();
+		return 0;
 	}
-the_end:
-	avfilter_graph_free(&graph);
-	av_frame_free(&frame);
+	/* the mtime orders the entities for eviction */
+	futimens(c->fd, NULL);
+	av_free(data_path);
+
+	c->nb_blocks = (c->size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+	c->map = av_mallocz((c->nb_blocks + 7) >> 3);
+	c->block = av_malloc(CACHE_BLOCK_SIZE);
+	iobuf = av_malloc(PIPE_IO_SIZE);
+	if (!c->map || !c->block || !iobuf) {
+		av_free(iobuf);
+		goto enomem;
+	}
+	c->budget = (int64_t)cache_size << 20;
+	cache_load_map(c, c->url);
+	cache_write_map(c);
+
+	c->pb = avio_alloc_context(iobuf, PIPE_IO_SIZE, 0, c, cache_read_packet, NULL, cache_seek);
+	if (!c->pb) {
+		av_free(iobuf);
+		goto enomem;
+	}
+	ic->pb = c->pb;
+	av_log(NULL, AV_LOG_VERBOSE, "cache: %s, %.1f of %.1f MiB cached\n", c->path,
+	       c->cached / 1048576.0, c->size / 1048576.0);
 	return 0;
+
+enomem:
+	cache_input_close();
+	return AVERROR(ENOMEM);
 }
 
-/* copy samples for viewing in editor window */
-static void update_sample_display(VideoState *is, short *samples,
-                                  int samples_size)
+/* segment and playlist reads, timed to estimate the download rate */
+static int abr_io_read(void *opaque, uint8_t *buf, int buf_size)
 {
-	int size, len;
+	AVIOContext *inner = opaque;
+	int64_t start = av_gettime_relative();
+	int ret = avio_read_partial(inner, buf, buf_size);
 
-	size = samples_size / sizeof(short);
-	while (size > 0) {
-		len = SAMPLE_ARRAY_SIZE - is->sample_array_index;
-		if (len > size)
-			len = size;
-		memcpy(is->sample_array + is->sample_array_index, samples, len * sizeof(short));
-		samples += len;
-		is->sample_array_index += len;
-		if (is->sample_array_index >= SAMPLE_ARRAY_SIZE)
-			is->sample_array_index = 0;
-		size -= len;
+	if (ret > 0) {
+		abr.io_bytes += ret;
+		abr.io_time += av_gettime_relative() - start;
 	}
+	return ret ? ret : AVERROR_EOF;
 }
 
-/**
- * Decode one audio frame and return its uncompressed size.
- *
- * The processed audio frame is decoded, converted if required, and
- * stored in is->audio_buf, with size in bytes given by the return
- * value.
- */
-static int audio_decode_frame(VideoState *is)
+static int64_t abr_io_seek(void *opaque, int64_t offset, int whence)
 {
-	int data_size, resampled_data_size;
-	int64_t dec_channel_layout;
-	av_unused double audio_clock0;
-	int wanted_nb_samples;
-	Frame *af;
-
-	do {
-		if (!(af = frame_queue_peek_readable(&is->sampq)))
-			return -1;
-		frame_queue_next(&is->sampq);
-	} while (af->serial != is->audioq.serial);
+	AVIOContext *inner = opaque;
 
-	data_size = av_samples_get_buffer_size(NULL, av_frame_get_channels(af->frame),
-	                                       af->frame->nb_samples,
-	                                       af->frame->format, 1);
+	if (whence & AVSEEK_SIZE)
+		return avio_size(inner);
+	return avio_seek(inner, offset, whence & ~AVSEEK_FORCE);
+}
 
-	dec_channel_layout =
-	    (af->frame->channel_layout &&
-	     av_frame_get_channels(af->frame) == av_get_channel_layout_nb_channels(
-	         af->frame->channel_layout)) ?
-	    af->frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(
-	                af->frame));
-	wanted_nb_samples = af->frame->nb_samples;
+static int abr_io_open(AVFormatContext *s, AVIOContext **pb, const char *url,
+                       int flags, AVDictionary **options)
+{
+	AVIOContext *inner;
+	uint8_t *buf;
+	int ret;
 
-	if (af->frame->format != is->audio_src.fmt ||
-	    dec_channel_layout != is->audio_src.channel_layout ||
-	    af->frame->sample_rate != is->audio_src.freq ||
-	    (wanted_nb_samples != af->frame->nb_samples && !is->swr_ctx)) {
-		swr_free(&is->swr_ctx);
-		is->swr_ctx = swr_alloc_set_opts(NULL,
-		                                 is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
-		                                 dec_channel_layout,           af->frame->format, af->frame->sample_rate,
-		                                 0, NULL);
-		if (!is->swr_ctx || swr_init(is->swr_ctx) < 0) {
-			av_log(NULL, AV_LOG_ERROR,
-			       "Cannot create sample rate converter for conversion of %d Hz %s %d channels to %d Hz %s %d channels!\n",
-			       af->frame->sample_rate, av_get_sample_fmt_name(af->frame->format),
-			       av_frame_get_channels(af->frame),
-			       is->audio_tgt.freq, av_get_sample_fmt_name(is->audio_tgt.fmt),
-			       is->audio_tgt.channels);
-			swr_free(&is->swr_ctx);
-			return -1;
-		}
-		is->audio_src.channel_layout = dec_channel_layout;
-		is->audio_src.channels = av_frame_get_channels(af->frame);
-		is->audio_src.freq = af->frame->sample_rate;
-		is->audio_src.fmt = af->frame->format;
+	/* the main input is closed with avio_close(), it cannot be wrapped */
+	if (pb == &s->pb || (flags & AVIO_FLAG_WRITE))
+		return abr.io_open(s, pb, url, flags, options);
+
+	if ((ret = abr.io_open(s, &inner, url, flags, options)) < 0)
+		return ret;
+	if (!(buf = av_malloc(ABR_IO_SIZE)) ||
+	    !(*pb = avio_alloc_context(buf, ABR_IO_SIZE, 0, inner, abr_io_read, NULL,
+	                               inner->seekable ? abr_io_seek : NULL))) {
+		av_free(buf);
+		abr.io_close(s, inner);
+		return AVERROR(ENOMEM);
 	}
+	(*pb)->seekable = inner->seekable;
+	return 0;
+}
 
-	if (is->swr_ctx) {
-		const uint8_t **in = (const uint8_t **)af->frame->extended_data;
-		uint8_t **out = &is->audio_buf1;
-		int out_count = (int64_t)wanted_nb_samples * is->audio_tgt.freq /
-		                af->frame->sample_rate + 256;
-		int out_size = av_samples_get_buffer_size(NULL, is->audio_tgt.channels,
-		               out_count, is->audio_tgt.fmt, 0);
-		int len2;
-		if (out_size < 0) {
-			av_log(NULL, AV_LOG_ERROR, "av_samples_get_buffer_size() failed\n");
-			return -1;
-		}
-		if (wanted_nb_samples != af->frame->nb_samples) {
-			if (swr_set_compensation(is->swr_ctx,
-			                         (wanted_nb_samples - af->frame->nb_samples) * is->audio_tgt.freq /
-			                         af->frame->sample_rate,
-			                         wanted_nb_samples * is->audio_tgt.freq / af->frame->sample_rate) < 0) {
-				av_log(NULL, AV_LOG_ERROR, "swr_set_compensation() failed\n");
-				return -1;
-			}
-		}
-		av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
-		if (!is->audio_buf1)
-			return AVERROR(ENOMEM);
-		len2 = swr_convert(is->swr_ctx, out, out_count, in, af->frame->nb_samples);
-		if (len2 < 0) {
-			av_log(NULL, AV_LOG_ERROR, "swr_convert() failed\n");
-			return -1;
-		}
-		if (len2 == out_count) {
-			av_log(NULL, AV_LOG_WARNING, "audio buffer is probably too small\n");
-			if (swr_init(is->swr_ctx) < 0)
-				swr_free(&is->swr_ctx);
-		}
-		is->audio_buf = is->audio_buf1;
-		resampled_data_size = len2 * is->audio_tgt.channels * av_get_bytes_per_sample(
-		                          is->audio_tgt.fmt);
-	} else {
-		is->audio_buf = af->frame->data[0];
-		resampled_data_size = data_size;
+static void abr_io_close(AVFormatContext *s, AVIOContext *pb)
+{
+	if (pb && pb->read_packet == abr_io_read) {
+		AVIOContext *inner = pb->opaque;
+		av_freep(&pb->buffer);
+		av_free(pb);
+		pb = inner;
 	}
+	abr.io_close(s, pb);
+}
 
-	audio_clock0 = is->audio_clock;
-	/* update the audio clock with the pts */
-	if (!isnan(af->pts))
-		is->audio_clock = af->pts + (double) af->frame->nb_samples /
-		                  af->frame->sample_rate;
-	else
-		is->audio_clock = NAN;
-	is->audio_clock_serial = af->serial;
-	return resampled_data_size;
+/* parameters carried in-band, which a decoder picks up at the next keyframe */
+static int abr_inband_extradata(const AVCodecParameters *par)
+{
+	return !par->extradata_size ||
+	       (par->extradata_size >= 3 && !par->extradata[0] && !par->extradata[1] &&
+	        (par->extradata[2] == 1 || (par->extradata_size >= 4 && !par->extradata[2] &&
+	                                    par->extradata[3] == 1)));
 }
 
-/* prepare a new audio buffer */
-static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
+/**
+ * Whether the decoder opened for a can take the packets of b. The decoders
+ * are kept across a switch, so the codec and its global headers must match;
+ * Annex B video carries its parameter sets in-band and may change size.
+ */
+static int abr_compatible(const AVCodecParameters *a, const AVCodecParameters *b)
 {
-	VideoState *is = opaque;
-	int audio_size, len1;
+	if (a->codec_id != b->codec_id)
+		return 0;
+	if (a->codec_type == AVMEDIA_TYPE_AUDIO &&
+	    (a->sample_rate != b->sample_rate || a->channels != b->channels ||
+	     a->channel_layout != b->channel_layout || a->format != b->format))
+		return 0;
+	if (a->codec_type == AVMEDIA_TYPE_VIDEO && abr_inband_extradata(a) && abr_inband_extradata(b))
+		return 1;
+	return a->extradata_size == b->extradata_size &&
+	       !memcmp(a->extradata, b->extradata, a->extradata_size);
+}
 
-	audio_callback_time = av_gettime_relative();
+/* feed a packet to the decoder of another stream */
+static void abr_remap(AVFormatContext *ic, AVPacket *pkt, int stream_index)
+{
+	av_packet_rescale_ts(pkt, ic->streams[pkt->stream_index]->time_base,
+	                     ic->streams[stream_index]->time_base);
+	pkt->stream_index = stream_index;
+}
 
-	while (len > 0) {
-		if (is->audio_buf_index >= is->audio_buf_size) {
-			audio_size = audio_decode_frame(is);
-			if (audio_size < 0) {
-				/* if error, just output silence */
-				is->audio_buf = NULL;
-				is->audio_buf_size = SDL_AUDIO_MIN_BUFFER_SIZE / is->audio_tgt.frame_size *
-				                     is->audio_tgt.frame_size;
-			} else {
-				if (is->show_mode != SHOW_MODE_VIDEO)
-					update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
-				is->audio_buf_size = audio_size;
-			}
-			is->audio_buf_index = 0;
+static int cmp_abr_variant(const void *a, const void *b)
+{
+	const AbrVariant *va = a, *vb = b;
+	return (va->bitrate > vb->bitrate) - (va->bitrate < vb->bitrate);
+}
+
+/**
+ * Collect the variants of an input whose programs carry a variant_bitrate,
+ * as HLS does, and only keep the streams being played. Does nothing with
+ * less than two variants.
+ */
+static void abr_init(VideoState *is)
+{
+	AVFormatContext *ic = is->ic;
+	int i, j;
+
+	for (i = 0; i < ic->nb_programs; i++) {
+		AVProgram *prog = ic->programs[i];
+		AVDictionaryEntry *e = av_dict_get(prog->metadata, "variant_bitrate", NULL, 0);
+		AbrVariant v = { .video_stream = -1, .audio_stream = -1 };
+
+		if (!e)
+			continue;
+		v.bitrate = strtoll(e->value, NULL, 10);
+		for (j = 0; j < prog->nb_stream_indexes; j++) {
+			int idx = prog->stream_index[j];
+			enum AVMediaType type = ic->streams[idx]->codecpar->codec_type;
+			if (type == AVMEDIA_TYPE_VIDEO && v.video_stream < 0)
+				v.video_stream = idx;
+			else if (type == AVMEDIA_TYPE_AUDIO && v.audio_stream < 0)
+				v.audio_stream = idx;
 		}
-		len1 = is->audio_buf_size - is->audio_buf_index;
-		if (len1 > len)
-			len1 = len;
-		if (is->audio_buf && is->audio_volume == SDL_MIX_MAXVOLUME)
-			memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-		else {
-			memset(stream, 0, len1);
-			if (is->audio_buf)
-				SDL_MixAudio(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1,
-				             is->audio_volume);
+		if (v.video_stream < 0 || !is->video_st ||
+		    !abr_compatible(is->video_st->codecpar, ic->streams[v.video_stream]->codecpar)) {
+			av_log(NULL, AV_LOG_VERBOSE, "abr: %"PRId64" bit/s variant not decodable by the open decoder, ignored\n",
+			       v.bitrate);
+			continue;
 		}
-		len -= len1;
-		stream += len1;
-		is->audio_buf_index += len1;
+		if (is->audio_st && (v.audio_stream < 0 ||
+		    !abr_compatible(is->audio_st->codecpar, ic->streams[v.audio_stream]->codecpar))) {
+			av_log(NULL, AV_LOG_VERBOSE, "abr: %"PRId64" bit/s variant has no matching audio, ignored\n",
+			       v.bitrate);
+			continue;
+		}
+		if (av_reallocp_array(&abr.variants, abr.nb_variants + 1, sizeof(*abr.variants)) < 0)
+			continue;
+		abr.variants[abr.nb_variants++] = v;
 	}
-	is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
-	/* Let's assume the audio driver that is used by SDL has two periods. */
-	if (!isnan(is->audio_clock)) {
-		set_clock_at(&is->audclk,
-		             is->audio_clock - (double)(2 * is->audio_hw_buf_size +
-		                                        is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, is->audio_clock_serial,
-		             audio_callback_time / 1000000.0);
-		sync_clock_to_slave(&is->extclk, &is->audclk);
+	qsort(abr.variants, abr.nb_variants, sizeof(*abr.variants), cmp_abr_variant);
+	for (abr.cur = 0; abr.cur < abr.nb_variants; abr.cur++)
+		if (abr.variants[abr.cur].video_stream == is->video_stream)
+			break;
+	if (abr.nb_variants < 2 || abr.cur == abr.nb_variants) {
+		av_freep(&abr.variants);
+		abr.nb_variants = 0;
+		return;
 	}
+
+	/* the demuxer only downloads the variants that have a stream in use */
+	for (i = 0; i < ic->nb_streams; i++)
+		if (i != is->video_stream && i != is->audio_stream)
+			ic->streams[i]->discard = AVDISCARD_ALL;
+
+	abr.pending = -1;
+	abr.audio_src = is->audio_stream;
+	abr.last_video_ts = abr.last_audio_ts = abr.audio_min_ts = AV_NOPTS_VALUE;
+	abr.next_check = abr.last_switch = av_gettime_relative() / 1000000.0;
+	for (i = 0; i < abr.nb_variants; i++)
+		av_log(NULL, AV_LOG_VERBOSE, "abr: variant %d %"PRId64" bit/s, video stream %d%s\n",
+		       i, abr.variants[i].bitrate, abr.variants[i].video_stream,
+		       i == abr.cur ? ", selected" : "");
 }
 
-static int audio_open(void *opaque, int64_t wanted_channel_layout,
-                      int wanted_nb_channels, int wanted_sample_rate,
-                      struct AudioParams *audio_hw_params)
+static void abr_start_switch(VideoState *is, int target, const char *reason)
 {
-	SDL_AudioSpec wanted_spec, spec;
-	const char *env;
-	static const int next_nb_channels[] = {0, 0, 1, 6, 2, 6, 4, 6};
-	static const int next_sample_rates[] = {0, 44100, 48000, 96000, 192000};
-	int next_sample_rate_idx = FF_ARRAY_ELEMS(next_sample_rates) - 1;
+	AbrVariant *v = &abr.variants[target];
+
+	av_log(NULL, AV_LOG_INFO, "abr: %s, switching from %"PRId64" to %"PRId64" bit/s\n",
+	       reason, abr.variants[abr.cur].bitrate, v->bitrate);
+	is->ic->streams[v->video_stream]->discard = AVDISCARD_DEFAULT;
+	if (abr.audio_src >= 0)
+		is->ic->streams[v->audio_stream]->discard = AVDISCARD_DEFAULT;
+	abr.pending = target;
+}
 
-	env = SDL_getenv("SDL_AUDIO_CHANNELS");
-	if (env) {
-		wanted_nb_channels = atoi(env);
-		wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
-	}
-	if (!wanted_channel_layout ||
-	    wanted_nb_channels != av_get_channel_layout_nb_channels(
-	        wanted_channel_layout)) {
-		wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
-		wanted_channel_layout &= ~AV_CH_LAYOUT_STEREO_DOWNMIX;
+/* pick the variant from the download rate, the decode time and the frames the video pipeline dropped */
+static void abr_update(VideoState *is)
+{
+	double time = av_gettime_relative() / 1000000.0;
+	int drops = is->frame_drops_early + is->frame_drops_late;
+	int frames = is->frames_presented;
+	int decoded = __atomic_load_n(&is->nb_decoded, __ATOMIC_ACQUIRE);
+	int64_t decode_time = __atomic_load_n(&is->decode_time, __ATOMIC_RELAXED);
+	AVRational fr = av_guess_frame_rate(is->ic, is->video_st, NULL);
+	double drop_ratio;
+	int best;
+
+	if (!abr.nb_variants || time < abr.next_check)
+		return;
+	abr.next_check = time + ABR_CHECK_INTERVAL;
+
+	if (abr.io_time > 0 && abr.io_bytes >= 64 * 1024) {
+		double sample = abr.io_bytes * 8.0 / (abr.io_time / 1000000.0);
+		abr.rate = abr.rate > 0 ? 0.7 * abr.rate + 0.3 * sample : sample;
+		abr.io_bytes = abr.io_time = 0;
 	}
-	wanted_nb_channels = av_get_channel_layout_nb_channels(wanted_channel_layout);
-	wanted_spec.channels = wanted_nb_channels;
-	wanted_spec.freq = wanted_sample_rate;
-	if (wanted_spec.freq <= 0 || wanted_spec.channels <= 0) {
-		av_log(NULL, AV_LOG_ERROR, "Invalid sample rate or channel count!\n");
-		return -1;
+	drop_ratio = drops - abr.last_drops + frames - abr.last_frames > 0 ?
+	             (double)(drops - abr.last_drops) / (drops - abr.last_drops + frames - abr.last_frames) : 0;
+	abr.last_drops = drops;
+	abr.last_frames = frames;
+	/* below 1 the decoder keeps up with the frame rate on its own */
+	abr.load = decoded > abr.last_decoded && fr.num && fr.den ?
+	           (decode_time - abr.last_decode_time) / 1000000.0 / (decoded - abr.last_decoded) * av_q2d(fr) : 0;
+	abr.last_decode_time = decode_time;
+	abr.last_decoded = decoded;
+
+	if (abr.pending >= 0)
+		return;
+	if (drop_ratio > ABR_DROP_DOWN && abr.cur > 0) {
+		/* the host cannot keep up, one step down at a time */
+		abr_start_switch(is, abr.cur - 1, "dropping frames");
+		return;
 	}
-	while (next_sample_rate_idx &&
-	       next_sample_rates[next_sample_rate_idx] >= wanted_spec.freq)
-		next_sample_rate_idx--;
-	wanted_spec.format = AUDIO_S16SYS;
-	wanted_spec.silence = 0;
-	wanted_spec.samples = FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE,
-	                            2 << av_log2(wanted_spec.freq / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
-	wanted_spec.callback = sdl_audio_callback;
-	wanted_spec.userdata = opaque;
-	while (SDL_OpenAudio(&wanted_spec, &spec) < 0) {
-		av_log(NULL, AV_LOG_WARNING, "SDL_OpenAudio (%d channels, %d Hz): %s\n",
-		       wanted_spec.channels, wanted_spec.freq, SDL_GetError());
-		wanted_spec.channels = next_nb_channels[FFMIN(7, wanted_spec.channels)];
-		if (!wanted_spec.channels) {
-			wanted_spec.freq = next_sample_rates[next_sample_rate_idx--];
-			wanted_spec.channels = wanted_nb_channels;
-			if (!wanted_spec.freq) {
-				av_log(NULL, AV_LOG_ERROR,
-				       "No more combinations to try, audio open failed\n");
-				return -1;
-			}
-		}
-		wanted_channel_layout = av_get_default_channel_layout(wanted_spec.channels);
+	if (abr.load > ABR_DECODE_DOWN && abr.cur > 0) {
+		abr_start_switch(is, abr.cur - 1, "decoding too slow");
+		return;
 	}
-	if (spec.format != AUDIO_S16SYS) {
-		av_log(NULL, AV_LOG_ERROR,
-		       "SDL advised audio format %d is not supported!\n", spec.format);
-		return -1;
+	if (abr.rate <= 0)
+		return;
+	for (best = abr.nb_variants - 1; best > 0; best--)
+		if (abr.variants[best].bitrate <= abr.rate * ABR_BW_MARGIN)
+			break;
+	if (best < abr.cur)
+		abr_start_switch(is, best, "download too slow");
+	else if (best > abr.cur && drop_ratio < ABR_DROP_UP && abr.load < ABR_DECODE_UP &&
+	         time - abr.last_switch > ABR_UP_HOLD)
+		abr_start_switch(is, abr.cur + 1, "bandwidth available");
+}
+
+/**
+ * Track the packets of the current variant and complete a pending switch on
+ * the first keyframe of the new variant that follows the queued video, which
+ * is where its segment boundary lines up. The decoders and is->video_st and
+ * audio_st stay as they were opened: the packets of the variant being played
+ * are handed to them as packets of those streams, which the variants were
+ * checked to be compatible with in abr_init(). Nothing read by the other
+ * threads changes, so no lock is needed. Returns 1 if the packet must be
+ * dropped: every packet that is not from the current variant is, including
+ * what the demuxer still returns of the variants left behind, whose stream
+ * may be the one the decoders were opened with.
+ */
+static int abr_route(VideoState *is, AVPacket *pkt)
+{
+	AVFormatContext *ic = is->ic;
+	AbrVariant *v = &abr.variants[abr.cur];
+	int64_t ts;
+
+	if (pkt->stream_index == v->video_stream) {
+		abr_remap(ic, pkt, is->video_stream);
+		abr.last_video_ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+		return 0;
 	}
-	if (spec.channels != wanted_spec.channels) {
-		wanted_channel_layout = av_get_default_channel_layout(spec.channels);
-		if (!wanted_channel_layout) {
-			av_log(NULL, AV_LOG_ERROR,
-			       "SDL advised channel count %d is not supported!\n", spec.channels);
-			return -1;
+	if (abr.audio_src >= 0 && pkt->stream_index == abr.audio_src) {
+		abr_remap(ic, pkt, is->audio_stream);
+		ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+		if (abr.audio_min_ts != AV_NOPTS_VALUE && ts != AV_NOPTS_VALUE) {
+			if (ts <= abr.audio_min_ts)
+				return 1;
+			abr.audio_min_ts = AV_NOPTS_VALUE;
 		}
+		abr.last_audio_ts = ts;
+		return 0;
 	}
-
-	audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
-	audio_hw_params->freq = spec.freq;
-	audio_hw_params->channel_layout = wanted_channel_layout;
-	audio_hw_params->channels = spec.channels;
-	audio_hw_params->frame_size = av_samples_get_buffer_size(NULL,
-	                              audio_hw_params->channels, 1, audio_hw_params->fmt, 1);
-	audio_hw_params->bytes_per_sec = av_samples_get_buffer_size(NULL,
-	                                 audio_hw_params->channels, audio_hw_params->freq, audio_hw_params->fmt, 1);
-	if (audio_hw_params->bytes_per_sec <= 0 || audio_hw_params->frame_size <= 0) {
-		av_log(NULL, AV_LOG_ERROR, "av_samples_get_buffer_size failed\n");
-		return -1;
+	if (abr.pending < 0)
+		return 1;
+
+	v = &abr.variants[abr.pending];
+	if (pkt->stream_index != v->video_stream || !(pkt->flags & AV_PKT_FLAG_KEY))
+		return 1;
+	ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	if (ts != AV_NOPTS_VALUE && abr.last_video_ts != AV_NOPTS_VALUE &&
+	    av_compare_ts(ts, ic->streams[pkt->stream_index]->time_base,
+	                  abr.last_video_ts, is->video_st->time_base) <= 0)
+		return 1;
+
+	ic->streams[abr.variants[abr.cur].video_stream]->discard = AVDISCARD_ALL;
+	if (abr.audio_src >= 0 && v->audio_stream != abr.audio_src) {
+		abr.audio_min_ts = abr.last_audio_ts;
+		ic->streams[abr.audio_src]->discard = AVDISCARD_ALL;
+		abr.audio_src = v->audio_stream;
 	}
-	return spec.size;
+	abr_remap(ic, pkt, is->video_stream);
+	abr.last_video_ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	abr.cur = abr.pending;
+	abr.pending = -1;
+	abr.nb_switches++;
+	abr.last_switch = av_gettime_relative() / 1000000.0;
+	av_log(NULL, AV_LOG_VERBOSE, "abr: now playing %"PRId64" bit/s\n", v->bitrate);
+	return 0;
 }
 
-/* open a given stream. Return 0 if OK */
-static int stream_component_open(VideoState *is, int stream_index)
+static int64_t mem_audio_buf_usage(void *opaque)
 {
-	AVFormatContext *ic = is->ic;
-	AVCodecContext *avctx;
-	AVCodec *codec;
-	AVDictionary *opts = NULL;
-	int sample_rate, nb_channels;
-	int64_t channel_layout;
-	int ret = 0;
-	AVFilterLink *link;
+	return ((VideoState *)opaque)->audio_buf1_size;
+}
 
-	if (stream_index >= ic->nb_streams)
-		return -1;
+static int64_t mem_audio_buf_shrink(void *opaque, int64_t bytes)
+{
+	/* the audio callback owns the buffer, it reallocates it at the size it needs */
+	__atomic_store_n(&mem_budget.trim_audio_buf, 1, __ATOMIC_RELEASE);
+	return ((VideoState *)opaque)->audio_buf1_size / 2;
+}
 
-	avctx = avcodec_alloc_context3(NULL);
-	if (!avctx)
-		return AVERROR(ENOMEM);
+/* the decoders and the display update these under their queue mutex */
+static int64_t mem_frame_queue_usage(FrameQueue *f)
+{
+	return __atomic_load_n(&f->size, __ATOMIC_RELAXED) *
+	       __atomic_load_n(&f->frame_bytes, __ATOMIC_RELAXED);
+}
 
-	ret = avcodec_parameters_to_context(avctx, ic->streams[stream_index]->codecpar);
-	if (ret < 0)
-		goto fail;
-	av_codec_set_pkt_timebase(avctx, ic->streams[stream_index]->time_base);
+static int64_t mem_frames_usage(void *opaque)
+{
+	VideoState *is = opaque;
+	return mem_frame_queue_usage(&is->pictq) + mem_frame_queue_usage(&is->sampq);
+}
 
-	codec = avcodec_find_decoder(avctx->codec_id);
-	if (!codec) {
-		av_log(NULL, AV_LOG_WARNING, "No codec could be found with id %d\n",
-		       avctx->codec_id);
-		ret = AVERROR(EINVAL);
-		goto fail;
+static int64_t mem_frames_shrink(void *opaque, int64_t bytes)
+{
+	VideoState *is = opaque;
+	int64_t released = 0;
+	FrameQueue *queues[] = { &is->pictq, &is->sampq };
+	int i;
+
+	for (i = 0; i < FF_ARRAY_ELEMS(queues) && released < bytes; i++) {
+		FrameQueue *f = queues[i];
+		int64_t frame_bytes = __atomic_load_n(&f->frame_bytes, __ATOMIC_RELAXED);
+		int limit = f->limit;
+		if (frame_bytes <= 0)
+			continue;
+		frame_queue_set_limit(f, f->limit - (bytes - released + frame_bytes - 1) / frame_bytes);
+		released += (int64_t)(limit - f->limit) * frame_bytes;
 	}
+	return released;
+}
 
-	avctx->codec_id = codec->id;
+static void mem_frames_restore(void *opaque)
+{
+	VideoState *is = opaque;
+	frame_queue_set_limit(&is->pictq, is->pictq.max_size);
+	frame_queue_set_limit(&is->sampq, is->sampq.max_size);
+}
 
-	av_dict_set(&opts, "threads", "auto", 0);
+static int64_t mem_packets_usage(void *opaque)
+{
+	VideoState *is = opaque;
+	return __atomic_load_n(&is->videoq.size, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&is->audioq.size, __ATOMIC_RELAXED);
+}
 
-	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO ||
-	    avctx->codec_type == AVMEDIA_TYPE_AUDIO)
-		av_dict_set(&opts, "refcounted_frames", "1", 0);
-	if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
-		goto fail;
-	}
+static int64_t mem_packets_shrink(void *opaque, int64_t bytes)
+{
+	int64_t usage = mem_packets_usage(opaque);
+	int limit = FFMAX(FFMIN(usage, mem_budget.queue_limit) - bytes, MEM_QUEUE_MIN);
 
-	is->eof = 0;
-	ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
-	switch (avctx->codec_type) {
-	case AVMEDIA_TYPE_AUDIO:
-		is->audio_filter_src.freq = avctx->sample_rate;
-		is->audio_filter_src.channels = avctx->channels;
-		is->audio_filter_src.channel_layout = get_valid_channel_layout(
-		        avctx->channel_layout, avctx->channels);
-		is->audio_filter_src.fmt = avctx->sample_fmt;
-		if ((ret = configure_audio_filters(is, afilters, 0)) < 0)
-			goto fail;
-		link = is->out_audio_filter->inputs[0];
-		sample_rate = link->sample_rate;
-		nb_channels = avfilter_link_get_channels(link);
-		channel_layout = link->channel_layout;
+	/* the read thread stops until the decoders have drained the queues */
+	__atomic_store_n(&mem_budget.queue_limit, limit, __ATOMIC_RELAXED);
+	return FFMAX(usage - limit, 0);
+}
 
-		/* prepare audio output */
-		if ((ret = audio_open(is, channel_layout, nb_channels, sample_rate,
-		                      &is->audio_tgt)) < 0)
-			goto fail;
-		is->audio_hw_buf_size = ret;
-		is->audio_src = is->audio_tgt;
-		is->audio_buf_size = 0;
-		is->audio_buf_index = 0;
+static void mem_packets_restore(void *opaque)
+{
+	__atomic_store_n(&mem_budget.queue_limit, MAX_QUEUE_SIZE, __ATOMIC_RELAXED);
+}
 
-		is->audio_stream = stream_index;
-		is->audio_st = ic->streams[stream_index];
+/* the ring is allocated whole, the packets stored in it count as packets */
+static int64_t mem_arena_usage(void *opaque)
+{
+	PacketArena *a = opaque;
+	int64_t usage;
 
-		decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread);
-		if ((is->ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH |
-		                               AVFMT_NO_BYTE_SEEK)) && !is->ic->iformat->read_seek) {
-			is->auddec.start_pts = is->audio_st->start_time;
-			is->auddec.start_pts_tb = is->audio_st->time_base;
-		}
-		if ((ret = decoder_start(&is->auddec, audio_thread, is)) < 0)
-			goto out;
-		SDL_PauseAudio(0);
-		break;
-	case AVMEDIA_TYPE_VIDEO:
-		is->video_stream = stream_index;
-		is->video_st = ic->streams[stream_index];
+	SDL_LockMutex(a->mutex);
+	usage = a->size - (a->head - a->tail);
+	SDL_UnlockMutex(a->mutex);
+	return usage;
+}
 
-		decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread);
-		if ((ret = decoder_start(&is->viddec, video_thread, is)) < 0)
-			goto out;
-		is->queue_attachments_req = 1;
-		break;
-	default:
-		break;
+static int64_t mem_textures_usage(void *opaque)
+{
+	VideoState *is = opaque;
+	int64_t usage = 0;
+	int i;
+
+	for (i = 0; i < is->pictq.max_size; i++) {
+		Frame *vp = &is->pictq.queue[i];
+		if (vp->bmp)
+			usage += (int64_t)vp->width * vp->height *
+			         (vp->format == AV_PIX_FMT_YUV420P ? 3 : 8) / 2;
 	}
-	goto out;
+	return usage;
+}
 
-fail:
-	avcodec_free_context(&avctx);
-out:
-	av_dict_free(&opts);
+/* the memory.pressure file of our cgroup, or the system-wide one */
+static int mem_psi_open(void)
+{
+	char line[1024], path[1100];
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	int fd = -1;
+
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (av_strstart(line, "0::", NULL)) {
+				line[strcspn(line, "\n")] = 0;
+				snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.pressure", line + 3);
+				fd = open(path, O_RDONLY | O_CLOEXEC);
+				break;
+			}
+		fclose(f);
+	}
+	if (fd < 0)
+		fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		av_log(NULL, AV_LOG_VERBOSE, "memory budget: no memory pressure information\n");
+	return fd;
+}
 
-	return ret;
+/* share of the last 10 s some task was stalled on memory, in percent */
+static double mem_psi_read(int fd)
+{
+	char buf[256];
+	double avg10 = 0;
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (n <= 0)
+		return 0;
+	buf[n] = 0;
+	sscanf(buf, "some avg10=%lf", &avg10);
+	return avg10;
 }
 
-static int decode_interrupt_cb(void *ctx)
+static void mem_budget_init(VideoState *is)
 {
-	VideoState *is = ctx;
-	return is->abort_request;
+	mem_budget_register("audio buffer", MEM_PRIO_SLACK, is,
+	                    mem_audio_buf_usage, mem_audio_buf_shrink, NULL);
+	mem_budget_register("frames", MEM_PRIO_FRAMES, is,
+	                    mem_frames_usage, mem_frames_shrink, mem_frames_restore);
+	mem_budget_register("packets", MEM_PRIO_PACKETS, is,
+	                    mem_packets_usage, mem_packets_shrink, mem_packets_restore);
+	mem_budget_register("textures", MEM_PRIO_FIXED, is, mem_textures_usage, NULL, NULL);
+	if (is->videoq.arena) {
+		mem_budget_register("video packet arena", MEM_PRIO_FIXED, is->videoq.arena,
+		                    mem_arena_usage, NULL, NULL);
+		mem_budget_register("audio packet arena", MEM_PRIO_FIXED, is->audioq.arena,
+		                    mem_arena_usage, NULL, NULL);
+	}
+	if (mem_psi > 0)
+		mem_budget.psi_fd = mem_psi_open();
+}
+
+/* check the budget every MEM_POLL_INTERVAL, shrink or restore the clients */
+static double mem_budget_poll(VideoState *is)
+{
+	MemBudget *mb = &mem_budget;
+	double time = av_gettime_relative() / 1000000.0;
+	int64_t limit = (int64_t)mem_budget_size << 20;
+	int64_t excess;
+	int i;
+
+	if (mem_budget_size <= 0)
+		return REFRESH_RATE;
+	if (time < mb->next_poll)
+		return FFMIN(REFRESH_RATE, mb->next_poll - time);
+	mb->next_poll = time + MEM_POLL_INTERVAL;
+
+	SDL_LockMutex(mb->mutex);
+	mb->usage = 0;
+	for (i = 0; i < mb->nb_clients; i++)
+		mb->usage += mb->clients[i].usage(mb->clients[i].opaque);
+	mb->psi = mb->psi_fd >= 0 ? mem_psi_read(mb->psi_fd) : 0;
+
+	excess = mb->usage - limit;
+	/* under pressure give back a quarter even within the budget */
+	if (mem_psi > 0 && mb->psi > mem_psi)
+		excess = FFMAX(excess, mb->usage / 4);
+	if (excess > 0) {
+		av_log(NULL, AV_LOG_VERBOSE, "memory budget: %.1f of %.1f MiB used, pressure %.2f%%, shrinking by %.1f MiB\n",
+		       mb->usage / 1048576.0, limit / 1048576.0, mb->psi, excess / 1048576.0);
+		for (i = 0; i < mb->nb_clients && excess > 0; i++)
+			if (mb->clients[i].shrink)
+				excess -= mb->clients[i].shrink(mb->clients[i].opaque, excess);
+		mb->pressure = 1;
+		mb->nb_shrinks++;
+	} else if (mb->pressure && mb->usage < limit * 3 / 4 && (mem_psi <= 0 || mb->psi < mem_psi / 2)) {
+		av_log(NULL, AV_LOG_VERBOSE, "memory budget: pressure gone, restoring\n");
+		for (i = 0; i < mb->nb_clients; i++)
+			if (mb->clients[i].restore)
+				mb->clients[i].restore(mb->clients[i].opaque);
+		mb->pressure = 0;
+	}
+	SDL_UnlockMutex(mb->mutex);
+	return FFMIN(REFRESH_RATE, mb->next_poll - time);
 }
 
 static int stream_has_enough_packets(AVStream *st, int stream_id,
@@ -1938,6 +6424,7 @@ static int stream_has_enough_packets(AVStream *st, int stream_id,
 {
 	return stream_id < 0 || queue->abort_request ||
 	       (st->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
+	       (st->nb_frames == 1 && queue->nb_packets > 0) ||
 	       (queue->nb_packets > MIN_FRAMES && (!queue->duration ||
 	               av_q2d(st->time_base) * queue->duration > 1.0));
 }
@@ -1958,6 +6445,7 @@ static int read_thread(void *arg)
 	SDL_mutex *wait_mutex = SDL_CreateMutex();
 	int64_t pkt_ts;
 
+	thread_stats_enter(THREAD_READ);
 	if (!wait_mutex) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
 		ret = AVERROR(ENOMEM);
@@ -1978,6 +6466,21 @@ static int read_thread(void *arg)
 
 	av_dict_set(&format_opts, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
 
+	if (pipe_buffer > 0 && (err = pipe_input_open(is, ic)) < 0) {
+		ret = -1;
+		goto fail;
+	}
+	if (cache_dir && (err = cache_input_open(is, ic)) < 0) {
+		ret = -1;
+		goto fail;
+	}
+	if (abr_enabled) {
+		abr.io_open = ic->io_open;
+		abr.io_close = ic->io_close;
+		ic->io_open = abr_io_open;
+		ic->io_close = abr_io_close;
+	}
+
 	err = avformat_open_input(&ic, is->filename, is->iformat, &format_opts);
 	if (err < 0) {
 		print_error(is->filename, err);
@@ -2026,17 +6529,32 @@ static int read_thread(void *arg)
 			set_default_window_size(codecpar->width, codecpar->height);
 	}
 
-	/* open the streams */
-	if (st_index[AVMEDIA_TYPE_AUDIO] >= 0) {
-		stream_component_open(is, st_index[AVMEDIA_TYPE_AUDIO]);
+	if (framecrc) {
+		if (st_index[AVMEDIA_TYPE_VIDEO] >= 0)
+			framecrc_expect(st_index[AVMEDIA_TYPE_VIDEO]);
+		if (st_index[AVMEDIA_TYPE_AUDIO] >= 0)
+			framecrc_expect(st_index[AVMEDIA_TYPE_AUDIO]);
+	}
+
+	/* open the streams, the export only decodes the ones it writes */
+	if (st_index[AVMEDIA_TYPE_AUDIO] >= 0 && (export_audio || !export_video)) {
+		if (stream_component_open(is, st_index[AVMEDIA_TYPE_AUDIO]) < 0)
+			framecrc_finish(is, st_index[AVMEDIA_TYPE_AUDIO]);
 	}
 
 	ret = -1;
-	if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
-		ret = stream_component_open(is, st_index[AVMEDIA_TYPE_VIDEO]);
+	if (st_index[AVMEDIA_TYPE_VIDEO] >= 0 && (export_video || !export_audio)) {
+		if ((ret = stream_component_open(is, st_index[AVMEDIA_TYPE_VIDEO])) < 0)
+			framecrc_finish(is, st_index[AVMEDIA_TYPE_VIDEO]);
 	}
 
-	is->show_mode = ret >= 0 ? SHOW_MODE_VIDEO : SHOW_MODE_RDFT;
+	if (abr_enabled)
+		abr_init(is);
+
+	if (export_video || export_audio)
+		is->show_mode = SHOW_MODE_NONE;
+	else
+		is->show_mode = ret >= 0 ? SHOW_MODE_VIDEO : SHOW_MODE_RDFT;
 
 	if (is->video_stream < 0 && is->audio_stream < 0) {
 		av_log(NULL, AV_LOG_FATAL,
@@ -2064,14 +6582,21 @@ static int read_thread(void *arg)
 			if (ret < 0) {
 				av_log(NULL, AV_LOG_ERROR,
 				       "%s: error while seeking\n", is->ic->filename);
+				seek_stats_cancel(is);
 			} else {
+				seek_stats_mark(is, SEEK_STAGE_SEEK, -1, 0);
+				abr.last_video_ts = abr.last_audio_ts = abr.audio_min_ts = AV_NOPTS_VALUE;
 				if (is->audio_stream >= 0) {
 					packet_queue_flush(&is->audioq);
 					packet_queue_put(&is->audioq, &flush_pkt);
 				}
-				if (is->video_stream >= 0) {
+				if (is->still_image) {
+					/* the picture on screen stays valid, no frame will follow the seek */
+					seek_stats_cancel(is);
+				} else if (is->video_stream >= 0) {
 					packet_queue_flush(&is->videoq);
 					packet_queue_put(&is->videoq, &flush_pkt);
+					seek_stats_flushed(is, is->videoq.serial);
 				}
 				if (is->seek_flags & AVSEEK_FLAG_BYTE) {
 					set_clock(&is->extclk, NAN, 0);
@@ -2083,8 +6608,15 @@ static int read_thread(void *arg)
 			is->queue_attachments_req = 1;
 			is->eof = 0;
 		}
+		if (is->reconfig_req) {
+			int audio_stream = is->audio_stream, video_stream = is->video_stream;
+			stream_component_reopen(is, audio_stream);
+			stream_component_reopen(is, video_stream);
+			is->reconfig_req = 0;
+		}
 		if (is->queue_attachments_req) {
-			if (is->video_st && is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+			if (is->video_st && is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC &&
+			    !is->still_image) {
 				AVPacket copy;
 				if ((ret = av_copy_packet(&copy, &is->video_st->attached_pic)) < 0)
 					goto fail;
@@ -2096,12 +6628,12 @@ static int read_thread(void *arg)
 
 		/* if the queue are full, no need to read more */
 		if (infinite_buffer < 1 &&
-		    (is->audioq.size + is->videoq.size > MAX_QUEUE_SIZE ||
+		    (is->audioq.size + is->videoq.size > __atomic_load_n(&mem_budget.queue_limit, __ATOMIC_RELAXED) ||
 		     (stream_has_enough_packets(is->audio_st, is->audio_stream, &is->audioq) &&
 		      stream_has_enough_packets(is->video_st, is->video_stream, &is->videoq)))) {
 			/* wait 10 ms */
 			SDL_LockMutex(wait_mutex);
-			SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
+			cond_wait_timeout(is->continue_read_thread, wait_mutex, 10);
 			SDL_UnlockMutex(wait_mutex);
 			continue;
 		}
@@ -2116,6 +6648,7 @@ static int read_thread(void *arg)
 				goto fail;
 			}
 		}
+		abr_update(is);
 		ret = av_read_frame(ic, pkt);
 		if (ret < 0) {
 			if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !is->eof) {
@@ -2128,12 +6661,16 @@ static int read_thread(void *arg)
 			if (ic->pb && ic->pb->error)
 				break;
 			SDL_LockMutex(wait_mutex);
-			SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
+			cond_wait_timeout(is->continue_read_thread, wait_mutex, 10);
 			SDL_UnlockMutex(wait_mutex);
 			continue;
 		} else {
 			is->eof = 0;
 		}
+		if (abr.nb_variants && abr_route(is, pkt)) {
+			av_packet_unref(pkt);
+			continue;
+		}
 		/* check if packet is in play range specified by user, then queue, otherwise discard */
 		stream_start_time = ic->streams[pkt->stream_index]->start_time;
 		pkt_ts = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
@@ -2145,7 +6682,7 @@ static int read_thread(void *arg)
 		if (pkt->stream_index == is->audio_stream && pkt_in_play_range) {
 			packet_queue_put(&is->audioq, pkt);
 		} else if (pkt->stream_index == is->video_stream && pkt_in_play_range
-		           && !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+		           && !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) && !is->still_image) {
 			packet_queue_put(&is->videoq, pkt);
 		} else {
 			av_packet_unref(pkt);
@@ -2165,6 +6702,86 @@ fail:
 		SDL_PushEvent(&event);
 	}
 	SDL_DestroyMutex(wait_mutex);
+	thread_stats_update();
+	perf_thread_close();
+	return 0;
+}
+
+/* stands in for read_thread() with a shm: input, there is nothing to demux */
+static int shm_read_thread(void *arg)
+{
+	VideoState *is = arg;
+	AVFormatContext *ic = NULL;
+	AVStream *st;
+	ShmSlotHeader slot;
+	SDL_mutex *wait_mutex = SDL_CreateMutex();
+	int ret;
+
+	thread_stats_enter(THREAD_READ);
+	if (!wait_mutex) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+		ret = AVERROR(ENOMEM);
+		goto fail;
+	}
+	if ((ret = shm_input_attach(is->filename + 4, AV_LOG_ERROR)) < 0)
+		goto fail;
+
+	/* the stream takes the parameters of the first frame */
+	while (!shm_input_peek(&shm_in, &slot)) {
+		if (is->abort_request) {
+			ret = 0;
+			goto fail;
+		}
+		av_usleep(10000);
+	}
+
+	ic = avformat_alloc_context();
+	if (!ic || !(st = avformat_new_stream(ic, NULL))) {
+		ret = AVERROR(ENOMEM);
+		goto fail;
+	}
+	st->time_base = (AVRational) { 1, 1000000 };
+	st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	st->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+	st->codecpar->format = slot.format;
+	st->codecpar->width = slot.width;
+	st->codecpar->height = slot.height;
+	st->codecpar->sample_aspect_ratio = (AVRational) { slot.sar_num, slot.sar_den };
+	if (slot.duration > 0)
+		st->avg_frame_rate = av_d2q(1 / slot.duration, 1000000);
+	is->ic = ic;
+
+	set_default_window_size(slot.width, slot.height);
+	if ((ret = stream_component_open(is, 0)) < 0)
+		goto fail;
+	is->show_mode = SHOW_MODE_VIDEO;
+
+	while (!is->abort_request) {
+		if (is->seek_req) {
+			/* a live ring cannot seek */
+			is->seek_req = 0;
+			seek_stats_cancel(is);
+		}
+		SDL_LockMutex(wait_mutex);
+		cond_wait_timeout(is->continue_read_thread, wait_mutex, 100);
+		SDL_UnlockMutex(wait_mutex);
+	}
+	ret = 0;
+
+fail:
+	if (ic && !is->ic)
+		avformat_free_context(ic);
+
+	if (ret != 0) {
+		SDL_Event event;
+
+		event.type = FF_QUIT_EVENT;
+		event.user.data1 = is;
+		SDL_PushEvent(&event);
+	}
+	SDL_DestroyMutex(wait_mutex);
+	thread_stats_update();
+	perf_thread_close();
 	return 0;
 }
 
@@ -2179,6 +6796,8 @@ static VideoState *stream_open(const char *filename, AVInputFormat *iformat)
 	if (!is->filename)
 		goto fail;
 	is->iformat = iformat;
+	is->video_stream = -1;
+	is->audio_stream = -1;
 
 	/* start video display */
 	if (frame_queue_init(&is->pictq, &is->videoq, VIDEO_PICTURE_QUEUE_SIZE, 1) < 0)
@@ -2188,18 +6807,34 @@ static VideoState *stream_open(const char *filename, AVInputFormat *iformat)
 
 	if (packet_queue_init(&is->videoq) < 0 || packet_queue_init(&is->audioq) < 0)
 		goto fail;
+	/* audio packets are a fraction of the video ones */
+	if (packet_arena_size > 0 &&
+	    (!(is->videoq.arena = packet_arena_alloc((int64_t)packet_arena_size << 20)) ||
+	     !(is->audioq.arena = packet_arena_alloc((int64_t)packet_arena_size << 18))))
+		goto fail;
 
 	if (!(is->continue_read_thread = SDL_CreateCond())) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
 		goto fail;
 	}
+	if (!(is->seek_stats.mutex = SDL_CreateMutex())) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+		goto fail;
+	}
 
 	init_clock(&is->vidclk, &is->videoq.serial);
 	init_clock(&is->audclk, &is->audioq.serial);
 	init_clock(&is->extclk, &is->extclk.serial);
 	is->audio_clock_serial = -1;
+	aclock_filter_reset(&is->aclock, -1, 0);
+	is->frame_dur = (DurationEstimate) { .last_pts = NAN, .serial = -1 };
 	is->audio_volume = SDL_MIX_MAXVOLUME;
-	is->read_tid = SDL_CreateThread(read_thread, "read_thread", is);
+	is->zoom = 1.0;
+	is->zoom_cx = is->zoom_cy = 0.5;
+	if (mem_budget_size > 0)
+		mem_budget_init(is);
+	is->read_tid = SDL_CreateThread(av_strstart(filename, "shm:", NULL) ? shm_read_thread : read_thread,
+	                                "read_thread", is);
 	if (!is->read_tid) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
 fail:
@@ -2208,16 +6843,440 @@ fail:
 	return is;
 }
 
+#define SCENARIO_KEY_REPEAT 0.05
+
+static int scenario_parse_key(const char *name)
+{
+	static const struct {
+		const char *name;
+		int key;
+	} keys[] = {
+		{ "UP", SDLK_UP }, { "DOWN", SDLK_DOWN },
+		{ "LEFT", SDLK_LEFT }, { "RIGHT", SDLK_RIGHT },
+	};
+	int i;
+
+	for (i = 0; i < FF_ARRAY_ELEMS(keys); i++)
+		if (!av_strcasecmp(name, keys[i].name))
+			return keys[i].key;
+	if (strlen(name) == 1)
+		return name[0];
+	return 0;
+}
+
+/**
+ * Load a scenario file. Each non-empty line holds an action, scheduled in
+ * seconds since the first frame was shown, e.g.:
+ *
+ *   1.0  seek 120          seek to 120 s
+ *   5.0  seek_rel -10      seek 10 s backwards
+ *   8.0  key RIGHT 3       hold RIGHT for 3 s (key repeats every 50 ms)
+ *  14.0  resize 1280 720   resize the window
+ *  16.0  volume -5         change the volume by 5 steps
+ *  20.0  quit
+ *
+ * Everything after a '#' is ignored. Actions must be in time order.
+ */
+static int scenario_load(const char *filename)
+{
+	char line[1024], name[32], arg[32];
+	FILE *f = fopen(filename, "r");
+	int lineno = 0, ret = 0;
+
+	if (!f) {
+		ret = AVERROR(errno);
+		print_error(filename, ret);
+		return ret;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		ScenarioAction *a;
+		double time;
+		char *p;
+		int n;
+
+		lineno++;
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		if (sscanf(line, "%lf %31s %n", &time, name, &n) < 2) {
+			if (strspn(line, " \t\r\n") == strlen(line))
+				continue;
+			goto invalid;
+		}
+		p = line + n;
+
+		if ((ret = av_reallocp_array(&scenario.actions, scenario.nb_actions + 1,
+		                             sizeof(*scenario.actions))) < 0)
+			goto end;
+		a = &scenario.actions[scenario.nb_actions];
+		memset(a, 0, sizeof(*a));
+		a->time = time;
+		a->latency = NAN;
+
+		if (!strcmp(name, "seek") || !strcmp(name, "seek_rel")) {
+			a->type = name[4] ? SCENARIO_SEEK_REL : SCENARIO_SEEK;
+			a->wait = SCENARIO_WAIT_SERIAL;
+			if (sscanf(p, "%lf", &a->arg) != 1)
+				goto invalid;
+		} else if (!strcmp(name, "key")) {
+			a->type = SCENARIO_KEY;
+			if (sscanf(p, "%31s %lf", arg, &a->arg) < 1 ||
+			    !(a->key = scenario_parse_key(arg)))
+				goto invalid;
+			if (a->key == SDLK_LEFT || a->key == SDLK_RIGHT)
+				a->wait = SCENARIO_WAIT_SERIAL;
+		} else if (!strcmp(name, "resize")) {
+			a->type = SCENARIO_RESIZE;
+			a->wait = SCENARIO_WAIT_RESIZE;
+			if (sscanf(p, "%d %d", &a->width, &a->height) != 2 ||
+			    a->width <= 0 || a->height <= 0)
+				goto invalid;
+		} else if (!strcmp(name, "volume")) {
+			a->type = SCENARIO_VOLUME;
+			if (sscanf(p, "%lf", &a->arg) != 1)
+				goto invalid;
+		} else if (!strcmp(name, "quit")) {
+			a->type = SCENARIO_QUIT;
+		} else {
+			goto invalid;
+		}
+		if (scenario.nb_actions && time < a[-1].time)
+			goto invalid;
+		scenario.nb_actions++;
+	}
+	goto end;
+
+invalid:
+	av_log(NULL, AV_LOG_FATAL, "%s:%d: invalid scenario action\n", filename, lineno);
+	ret = AVERROR(EINVAL);
+end:
+	fclose(f);
+	return ret;
+}
+
+static void scenario_push_key(int key, int type, int repeat)
+{
+	SDL_Event event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = type;
+	event.key.state = type == SDL_KEYDOWN ? SDL_PRESSED : SDL_RELEASED;
+	event.key.repeat = repeat;
+	event.key.keysym.sym = key;
+	SDL_PushEvent(&event);
+}
+
+static void scenario_start_action(VideoState *is, ScenarioAction *a, double time)
+{
+	SDL_Event event;
+
+	if (scenario.next > 0) {
+		ScenarioAction *prev = a - 1;
+		prev->drops = scenario_drops(is) - prev->drops_start;
+	}
+	a->start_time = time;
+	a->drops_start = scenario_drops(is);
+	a->serial = is->video_st ? is->videoq.serial : is->audioq.serial;
+	scenario.pending = a->wait != SCENARIO_WAIT_NONE ? a - scenario.actions : -1;
+
+	switch (a->type) {
+	case SCENARIO_SEEK:
+		stream_seek(is, (int64_t)(a->arg * AV_TIME_BASE), 0, 0);
+		break;
+	case SCENARIO_SEEK_REL:
+		stream_seek_relative(is, a->arg);
+		break;
+	case SCENARIO_KEY:
+		if (scenario.held_key)
+			scenario_push_key(scenario.held_key, SDL_KEYUP, 0);
+		scenario_push_key(a->key, SDL_KEYDOWN, 0);
+		scenario.held_key = a->key;
+		scenario.hold_end = time + a->arg;
+		scenario.next_repeat = time + SCENARIO_KEY_REPEAT;
+		break;
+	case SCENARIO_RESIZE:
+		if (window)
+			SDL_SetWindowSize(window, a->width, a->height);
+		/* do not depend on the window manager to report the new size */
+		memset(&event, 0, sizeof(event));
+		event.type = SDL_WINDOWEVENT;
+		event.window.event = SDL_WINDOWEVENT_RESIZED;
+		event.window.data1 = a->width;
+		event.window.data2 = a->height;
+		SDL_PushEvent(&event);
+		break;
+	case SCENARIO_VOLUME:
+		update_volume(is, a->arg < 0 ? -1 : 1, (int)fabs(a->arg) * SDL_VOLUME_STEP);
+		break;
+	case SCENARIO_QUIT:
+		event.type = FF_QUIT_EVENT;
+		event.user.data1 = is;
+		SDL_PushEvent(&event);
+		break;
+	}
+}
+
+/* inject the scenario actions which are due, return the time until the next one */
+static double scenario_poll(VideoState *is)
+{
+	double time = av_gettime_relative() / 1000000.0;
+	double remaining = REFRESH_RATE;
+
+	if (!scenario.nb_actions)
+		return remaining;
+	if (isnan(scenario.start)) {
+		/* start the clock once playback has actually begun */
+		if (!is->pictq.rindex_shown && isnan(get_master_clock(is)))
+			return remaining;
+		scenario.start = time;
+	}
+
+	/* audio only streams have no presented frames to watch */
+	if (scenario.pending >= 0 && !is->video_st) {
+		ScenarioAction *a = &scenario.actions[scenario.pending];
+		if (a->wait == SCENARIO_WAIT_SERIAL && is->audclk.serial != a->serial &&
+		    !isnan(get_clock(&is->audclk))) {
+			a->latency = time - a->start_time;
+			scenario.pending = -1;
+		}
+	}
+
+	if (scenario.held_key) {
+		if (time >= scenario.hold_end) {
+			scenario_push_key(scenario.held_key, SDL_KEYUP, 0);
+			scenario.held_key = 0;
+		} else if (time >= scenario.next_repeat) {
+			scenario_push_key(scenario.held_key, SDL_KEYDOWN, 1);
+			scenario.next_repeat += SCENARIO_KEY_REPEAT;
+		}
+		if (scenario.held_key)
+			remaining = FFMIN(remaining, scenario.next_repeat - time);
+	}
+
+	while (scenario.next < scenario.nb_actions &&
+	       scenario.start + scenario.actions[scenario.next].time <= time) {
+		scenario_start_action(is, &scenario.actions[scenario.next], time);
+		scenario.next++;
+	}
+	if (scenario.next < scenario.nb_actions)
+		remaining = FFMIN(remaining,
+		                  scenario.start + scenario.actions[scenario.next].time - time);
+	return FFMAX(remaining, 0.0);
+}
+
+static void stream_close(VideoState *is)
+{
+	is->abort_request = 1;
+	SDL_WaitThread(is->read_tid, NULL);
+
+	if (is->ic) {
+		stream_component_close(is, is->audio_stream);
+		stream_component_close(is, is->video_stream);
+		avformat_close_input(&is->ic);
+	}
+
+	packet_queue_destroy(&is->videoq);
+	packet_queue_destroy(&is->audioq);
+
+	frame_queue_destroy(&is->pictq);
+	frame_queue_destroy(&is->sampq);
+	SDL_DestroyCond(is->continue_read_thread);
+	SDL_DestroyMutex(is->seek_stats.mutex);
+	sws_freeContext(is->img_convert_ctx);
+	sws_freeContext(is->sub_convert_ctx);
+	av_free(is->filename);
+	if (is->vis_texture)
+		SDL_DestroyTexture(is->vis_texture);
+	if (is->sub_texture)
+		SDL_DestroyTexture(is->sub_texture);
+	av_free(is);
+}
+
+/* drive the soak test from the main thread, return the time until the next event */
+static double soak_poll(VideoState *is)
+{
+	double time = av_gettime_relative() / 1000000.0;
+	SDL_Event event;
+
+	if (soak_duration <= 0)
+		return REFRESH_RATE;
+	if (isnan(soak.start)) {
+		soak.start = time;
+		soak.next_seek = time + soak_seek_interval;
+		soak.next_reconfig = time + soak_reconfig_interval;
+		soak.next_sample = time;
+		soak.seed = 1;
+	}
+
+	if (time >= soak.next_sample) {
+		soak_sample(time);
+		soak.next_sample += soak_sample_interval;
+	}
+	if (time - soak.start >= soak_duration) {
+		event.type = FF_QUIT_EVENT;
+		event.user.data1 = is;
+		SDL_PushEvent(&event);
+		soak.next_sample = soak.next_seek = soak.next_reconfig = INFINITY;
+		return REFRESH_RATE;
+	}
+
+	if (is->ic && time >= soak.next_seek) {
+		double pos = 0, len = is->ic->duration / (double)AV_TIME_BASE;
+		soak.seed = soak.seed * 1664525 + 1013904223;
+		if (is->ic->duration != AV_NOPTS_VALUE && len > 0) {
+			pos = (soak.seed >> 8) / (double)(1 << 24) * len;
+			if (is->ic->start_time != AV_NOPTS_VALUE)
+				pos += is->ic->start_time / (double)AV_TIME_BASE;
+			stream_seek(is, (int64_t)(pos * AV_TIME_BASE), 0, 0);
+		} else {
+			stream_seek_relative(is, soak.seed & 0x100 ? 10.0 : -10.0);
+		}
+		soak.nb_seeks++;
+		soak.next_seek += soak_seek_interval;
+	}
+	if (is->ic && time >= soak.next_reconfig) {
+		/* the read thread owns the streams and reopens them between packets */
+		is->reconfig_req = 1;
+		SDL_CondSignal(is->continue_read_thread);
+		soak.nb_reconfigs++;
+		soak.next_reconfig += soak_reconfig_interval;
+	}
+	return FFMAX(FFMIN(REFRESH_RATE, FFMIN(soak.next_sample, FFMIN(soak.next_seek,
+	                   soak.next_reconfig)) - time), 0.0);
+}
+
+static void print_stats(VideoState *is)
+{
+	int64_t now = av_gettime_relative(), total = 0;
+	static const char *const names[THREAD_NB] = {
+		"read", "video decode", "audio decode", "main", "audio callback"
+	};
+	int i;
+
+	thread_stats_update();
+	av_log(NULL, AV_LOG_INFO, "%-16s %10s %7s %9s\n", "thread", "cpu (s)", "cpu %", "blocked %");
+	for (i = 0; i < THREAD_NB; i++) {
+		ThreadStats *ts = &thread_stats[i];
+		double wall = (now - ts->start) / 100.0;
+		if (!ts->start)
+			continue;
+		total += ts->cpu;
+		av_log(NULL, AV_LOG_INFO, "%-16s %10.3f %7.1f %9.1f\n", names[i], ts->cpu / 1000000.0,
+		       wall > 0 ? ts->cpu / wall : 0, wall > 0 ? ts->blocked / wall : 0);
+	}
+	av_log(NULL, AV_LOG_INFO, "total cpu %.3f s", total / 1000000.0);
+	if (is->frames_presented)
+		av_log(NULL, AV_LOG_INFO, ", %.3f ms per presented frame (%d frames)",
+		       total / 1000.0 / is->frames_presented, is->frames_presented);
+	av_log(NULL, AV_LOG_INFO, "\n");
+	if (pipe_in.buf) {
+		SDL_LockMutex(pipe_in.mutex);
+		av_log(NULL, AV_LOG_INFO, "pipe ring %.1f%% full, %.1f MiB ahead and %.1f MiB behind the demuxer%s\n",
+		       100.0 * (pipe_in.write_pos - pipe_in.read_pos) / pipe_in.size,
+		       (pipe_in.write_pos - pipe_in.read_pos) / 1048576.0,
+		       FFMIN(pipe_in.read_pos, pipe_in.size - (pipe_in.write_pos - pipe_in.read_pos)) / 1048576.0,
+		       pipe_in.eof ? ", input ended" : "");
+		SDL_UnlockMutex(pipe_in.mutex);
+	}
+	if (cache_in.pb)
+		av_log(NULL, AV_LOG_INFO, "cache %.1f of %.1f MiB on disk, %.1f MiB read from disk, %.1f MiB from the network\n",
+		       cache_in.cached / 1048576.0, cache_in.size / 1048576.0,
+		       cache_in.disk_bytes / 1048576.0, cache_in.net_bytes / 1048576.0);
+	for (i = 0; i < 2; i++) {
+		PacketArena *a = i ? is->audioq.arena : is->videoq.arena;
+		if (!a)
+			continue;
+		SDL_LockMutex(a->mutex);
+		av_log(NULL, AV_LOG_INFO, "%s packet arena %.1f of %.1f MiB in use, %"PRId64" packets stored, %"PRId64" left on the heap\n",
+		       i ? "audio" : "video", (a->head - a->tail) / 1048576.0, a->size / 1048576.0,
+		       a->nb_arena, a->nb_heap);
+		SDL_UnlockMutex(a->mutex);
+	}
+	if (frame_pool.mutex) {
+		SDL_LockMutex(frame_pool.mutex);
+		av_log(NULL, AV_LOG_INFO, "frame pool %.1f MiB in use, %.1f MiB idle, %"PRId64" allocations, %"PRId64" reuses, %d on huge pages\n",
+		       frame_pool.used_bytes / 1048576.0, frame_pool.idle_bytes / 1048576.0,
+		       frame_pool.nb_allocs, frame_pool.nb_reuses, frame_pool.nb_huge);
+		SDL_UnlockMutex(frame_pool.mutex);
+	}
+	if (mem_budget_size > 0) {
+		MemBudget *mb = &mem_budget;
+		SDL_LockMutex(mb->mutex);
+		av_log(NULL, AV_LOG_INFO, "memory %.1f of %d MiB, pressure %.2f%%, %d shrinks%s:",
+		       mb->usage / 1048576.0, mem_budget_size, mb->psi, mb->nb_shrinks,
+		       mb->pressure ? ", shrunk" : "");
+		for (i = 0; i < mb->nb_clients; i++)
+			av_log(NULL, AV_LOG_INFO, " %s %.1f", mb->clients[i].name,
+			       mb->clients[i].usage(mb->clients[i].opaque) / 1048576.0);
+		av_log(NULL, AV_LOG_INFO, "\n");
+		SDL_UnlockMutex(mb->mutex);
+	}
+	if (abr.nb_variants)
+		av_log(NULL, AV_LOG_INFO, "abr variant %d of %d at %"PRId64" bit/s, download rate %.0f bit/s, decode load %.2f, %d switches\n",
+		       abr.cur + 1, abr.nb_variants, abr.variants[abr.cur].bitrate, abr.rate, abr.load, abr.nb_switches);
+	if (nonref_skip)
+		av_log(NULL, AV_LOG_INFO, "non-reference frames skipped %d times%s, %d frames dropped after decoding\n",
+		       is->nb_nonref_skips, is->skipping_nonref ? ", skipping now" : "", is->frame_drops_early);
+	if (is->nb_paced > 1) {
+		double mean = is->pacing_delay_sum / is->nb_paced;
+		av_log(NULL, AV_LOG_INFO, "frame pacing: delay %.3f ms mean, %.3f ms sd, %.3f ms rms late against frame_timer%s\n",
+		       1000 * mean, 1000 * sqrt(FFMAX(is->pacing_delay_sum2 / is->nb_paced - mean * mean, 0)),
+		       1000 * sqrt(is->pacing_err2 / is->nb_paced), aclock_filter > 0 ? ", audio clock filtered" : "");
+	}
+	if (aclock_filter > 0) {
+		double out_step2, raw_step2, slope;
+		int64_t nb_steps;
+		int nb_resets;
+
+		/* the audio callback updates the filter */
+		SDL_LockAudio();
+		out_step2 = is->aclock.out_step2;
+		raw_step2 = is->aclock.raw_step2;
+		slope = is->aclock.slope;
+		nb_steps = is->aclock.nb_steps;
+		nb_resets = is->aclock.nb_resets;
+		SDL_UnlockAudio();
+		if (nb_steps)
+			av_log(NULL, AV_LOG_INFO, "audio clock updates jump %.3f ms rms, %.3f ms unfiltered, drift %+.0f ppm, %d restarts\n",
+			       1000 * sqrt(out_step2 / nb_steps), 1000 * sqrt(raw_step2 / nb_steps),
+			       1000000 * slope, nb_resets);
+	}
+	if (perf_counters)
+		perf_print_report();
+}
+
+/* print the statistics every -stats seconds */
+static double stats_poll(VideoState *is)
+{
+	static double next_stats = NAN;
+	double time = av_gettime_relative() / 1000000.0;
+
+	if (stats_interval <= 0)
+		return REFRESH_RATE;
+	if (isnan(next_stats))
+		next_stats = time + stats_interval;
+	if (time >= next_stats) {
+		print_stats(is);
+		next_stats += stats_interval;
+	}
+	return FFMIN(REFRESH_RATE, next_stats - time);
+}
+
 static void refresh_loop_wait_event(VideoState *is, SDL_Event *event)
 {
 	double remaining_time = 0.0;
 	SDL_PumpEvents();
 	while (!SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT)) {
-		if (remaining_time > 0.0)
+		if (remaining_time > 0.0) {
+			int64_t start = av_gettime_relative();
 			av_usleep((int64_t)(remaining_time * 1000000.0));
-		remaining_time = REFRESH_RATE;
+			thread_stats[THREAD_MAIN].blocked += av_gettime_relative() - start;
+		}
+		remaining_time = FFMIN(FFMIN(scenario_poll(is), soak_poll(is)),
+		                       FFMIN(stats_poll(is), mem_budget_poll(is)));
 		if (is->show_mode != SHOW_MODE_NONE)
 			video_refresh(is, &remaining_time);
+		if (fast_seek && seek_stats_pending(is, -1))
+			remaining_time = FFMIN(remaining_time, SEEK_REFRESH_RATE);
 		SDL_PumpEvents();
 	}
 }
@@ -2226,7 +7285,7 @@ static void refresh_loop_wait_event(VideoState *is, SDL_Event *event)
 static void event_loop(VideoState *cur_stream)
 {
 	SDL_Event event;
-	double incr, pos;
+	double incr;
 
 	while (1) {
 		refresh_loop_wait_event(cur_stream, &event);
@@ -2239,6 +7298,21 @@ static void event_loop(VideoState *cur_stream)
 			case SDLK_DOWN:
 				update_volume(cur_stream, -1, SDL_VOLUME_STEP);
 				break;
+			case SDLK_c:
+				print_stats(cur_stream);
+				break;
+			case SDLK_PLUS:
+			case SDLK_EQUALS:
+			case SDLK_KP_PLUS:
+				set_zoom(cur_stream, cur_stream->zoom * 1.25, cur_stream->zoom_cx, cur_stream->zoom_cy);
+				break;
+			case SDLK_MINUS:
+			case SDLK_KP_MINUS:
+				set_zoom(cur_stream, cur_stream->zoom / 1.25, cur_stream->zoom_cx, cur_stream->zoom_cy);
+				break;
+			case SDLK_0:
+				set_zoom(cur_stream, 1.0, 0.5, 0.5);
+				break;
 			case SDLK_LEFT:
 				incr = -10.0;
 				goto do_seek;
@@ -2246,19 +7320,23 @@ static void event_loop(VideoState *cur_stream)
 				incr = 10.0;
 				goto do_seek;
 do_seek:
-				pos = get_master_clock(cur_stream);
-				if (isnan(pos))
-					pos = (double)cur_stream->seek_pos / AV_TIME_BASE;
-				pos += incr;
-				if (cur_stream->ic->start_time != AV_NOPTS_VALUE &&
-				    pos < cur_stream->ic->start_time / (double)AV_TIME_BASE)
-					pos = cur_stream->ic->start_time / (double)AV_TIME_BASE;
-				stream_seek(cur_stream, (int64_t)(pos * AV_TIME_BASE),
-				            (int64_t)(incr * AV_TIME_BASE), 0);
+				stream_seek_relative(cur_stream, incr);
 			default:
 				break;
 			}
 			break;
+		case SDL_MOUSEWHEEL:
+			if (event.wheel.y)
+				set_zoom(cur_stream, cur_stream->zoom * (event.wheel.y > 0 ? 1.25 : 0.8),
+				         cur_stream->zoom_cx, cur_stream->zoom_cy);
+			break;
+		case SDL_MOUSEMOTION:
+			/* drag the picture with the left button */
+			if (event.motion.state & SDL_BUTTON_LMASK && cur_stream->zoom > 1.0 && cur_stream->width)
+				set_zoom(cur_stream, cur_stream->zoom,
+				         cur_stream->zoom_cx - event.motion.xrel / (cur_stream->width * cur_stream->zoom),
+				         cur_stream->zoom_cy - event.motion.yrel / (cur_stream->height * cur_stream->zoom));
+			break;
 		case SDL_WINDOWEVENT:
 			switch (event.window.event) {
 			case SDL_WINDOWEVENT_RESIZED:
@@ -2285,6 +7363,124 @@ do_seek:
 	}
 }
 
+#define OPT_BOOL   0x0001
+#define OPT_INT    0x0002
+#define OPT_DOUBLE 0x0004
+#define OPT_STRING 0x0008
+
+typedef struct OptionDef {
+	const char *name;
+	int flags;
+	void *dst_ptr;
+	const char *help;
+	const char *argname;
+} OptionDef;
+
+static const OptionDef options[] = {
+	{ "vf", OPT_STRING, &vfilters, "set the video filter graph", "filter_graph" },
+	{ "af", OPT_STRING, &afilters, "set the audio filter graph", "filter_graph" },
+	{ "o", OPT_STRING, &export_video, "write the video as Y4M to a file or '-' instead of displaying it", "file" },
+	{ "o_raw", OPT_BOOL, &export_raw, "write raw YUV420P planes instead of Y4M with -o" },
+	{ "ao", OPT_STRING, &export_audio, "write the audio as native endian s16 PCM to a file or '-' instead of playing it", "file" },
+	{ "framecrc", OPT_STRING, &framecrc, "write a CRC32C of every filtered frame to a file or '-' instead of playing", "file" },
+	{ "deterministic", OPT_BOOL, &deterministic, "decode with a fixed single thread and bit-exact conversions" },
+	{ "pipe_buffer", OPT_INT, &pipe_buffer, "read-ahead ring for pipe inputs, 0 to read them directly", "MiB" },
+	{ "nonref_skip", OPT_BOOL, &nonref_skip, "skip decoding non-reference frames while video lags the master clock" },
+	{ "aclock_filter", OPT_INT, &aclock_filter, "smooth the audio clock over that many callbacks, 0 to take each as it is", "callbacks" },
+	{ "sw_output", OPT_INT, &sw_output, "present through the window surface: 1 always, 0 never, -1 with the software renderer" },
+	{ "packet_arena", OPT_INT, &packet_arena_size, "copy the queued video packets into a ring of that size, a quarter of it for audio", "MiB" },
+	{ "frame_pool", OPT_BOOL, &frame_pool_enabled, "decode into pooled, 64-byte aligned buffers kept across resolution changes" },
+	{ "hugepages", OPT_BOOL, &hugepages, "back pooled frame buffers of 2 MiB and more with huge pages, implies -frame_pool" },
+	{ "mem_budget", OPT_INT, &mem_budget_size, "memory budget shared by the queues, frames and buffers", "MiB" },
+	{ "mem_psi", OPT_DOUBLE, &mem_psi, "memory pressure (cgroup PSI some avg10) that shrinks the buffers, 0 to ignore it", "percent" },
+	{ "abr", OPT_BOOL, &abr_enabled, "switch between the variants of HLS inputs on bandwidth, decode time and frame drops" },
+	{ "cache_dir", OPT_STRING, &cache_dir, "cache the byte ranges read from http, https and ftp inputs in this directory", "dir" },
+	{ "cache_size", OPT_INT, &cache_size, "disk space of the input cache, least recently used inputs are evicted", "MiB" },
+	{ "shm", OPT_STRING, &shm_name, "publish the displayed frames to a POSIX shared memory ring", "name" },
+	{ "shm_slots", OPT_INT, &shm_slots, "number of frames in the shared memory ring", "count" },
+	{ "scenario", OPT_STRING, &scenario_file, "run the timed actions of a scenario file", "file" },
+	{ "scenario_report", OPT_STRING, &scenario_report, "write the per action scenario metrics to a file", "file" },
+	{ "fast_seek", OPT_BOOL, &fast_seek, "show the first picture after a seek as soon as it is decoded, poll for it every 1 ms and keep a plain filter chain across seeks" },
+	{ "soak", OPT_DOUBLE, &soak_duration, "loop the input with seeks and reconfigurations and check for memory growth", "seconds" },
+	{ "soak_seek", OPT_DOUBLE, &soak_seek_interval, "time between the soak test seeks", "seconds" },
+	{ "soak_reconfig", OPT_DOUBLE, &soak_reconfig_interval, "time between the soak test stream reconfigurations", "seconds" },
+	{ "soak_sample", OPT_DOUBLE, &soak_sample_interval, "time between the soak test memory samples", "seconds" },
+	{ "soak_max_growth", OPT_DOUBLE, &soak_max_growth, "steady state memory growth the soak test tolerates", "KiB/h" },
+	{ "intra_threads", OPT_INT, &intra_threads, "decode intra-only codecs on this many decoders in parallel", "count" },
+	{ "perf", OPT_BOOL, &perf_counters, "count cycles, instructions and cache and branch misses of the hot regions" },
+	{ "stats", OPT_DOUBLE, &stats_interval, "print the thread CPU statistics on exit and every given seconds if > 0 (also on 'c')", "seconds" },
+	{ NULL, },
+};
+
+static void show_usage(void)
+{
+	const OptionDef *po;
+	char buf[64];
+
+	av_log(NULL, AV_LOG_INFO, "usage: %s [options] input_file\n", program_name);
+	for (po = options; po->name; po++) {
+		snprintf(buf, sizeof(buf), "%s%s%s%s", po->name, po->argname ? " <" : "",
+		         po->argname ? po->argname : "", po->argname ? ">" : "");
+		av_log(NULL, AV_LOG_INFO, "-%-24s %s\n", buf, po->help);
+	}
+}
+
+static int parse_options(int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+		const OptionDef *po;
+		char *tail;
+
+		if (opt[0] != '-' || !opt[1]) {
+			if (input_filename) {
+				av_log(NULL, AV_LOG_FATAL,
+				       "Argument '%s' provided as input filename, but '%s' was already specified.\n",
+				       opt, input_filename);
+				return AVERROR(EINVAL);
+			}
+			input_filename = opt;
+			continue;
+		}
+
+		for (po = options; po->name; po++)
+			if (!strcmp(opt + 1, po->name))
+				break;
+		if (!po->name) {
+			av_log(NULL, AV_LOG_FATAL, "Unrecognized option '%s'\n", opt);
+			return AVERROR(EINVAL);
+		}
+		if (po->flags & OPT_BOOL) {
+			*(int *)po->dst_ptr = 1;
+			continue;
+		}
+		if (++i == argc) {
+			av_log(NULL, AV_LOG_FATAL, "Missing argument for option '%s'\n", opt);
+			return AVERROR(EINVAL);
+		}
+		if (po->flags & OPT_STRING) {
+			*(const char **)po->dst_ptr = argv[i];
+		} else if (po->flags & OPT_INT) {
+			long val = strtol(argv[i], &tail, 0);
+			if (*tail || val < INT_MIN || val > INT_MAX)
+				goto invalid;
+			*(int *)po->dst_ptr = val;
+		} else if (po->flags & OPT_DOUBLE) {
+			double val = strtod(argv[i], &tail);
+			if (*tail)
+				goto invalid;
+			*(double *)po->dst_ptr = val;
+		}
+		continue;
+invalid:
+		av_log(NULL, AV_LOG_FATAL, "Invalid value '%s' for option '%s'\n", argv[i], opt);
+		return AVERROR(EINVAL);
+	}
+	return 0;
+}
+
 /* Called from the main */
 int main(int argc, char **argv)
 {
@@ -2302,17 +7498,49 @@ int main(int argc, char **argv)
 
 	init_opts();
 
-	if (argc < 2) {
-		av_log(NULL, AV_LOG_FATAL, "An input file must be specified\n");
-		return -1;
-	}
-	input_filename = argv[1];
+	if (parse_options(argc, argv) < 0)
+		exit(1);
 	if (!input_filename) {
+		show_usage();
 		av_log(NULL, AV_LOG_FATAL, "An input file must be specified\n");
 		exit(1);
 	}
+	if (scenario_file && scenario_load(scenario_file) < 0)
+		exit(1);
+	if (shm_name && shm_slots < 1) {
+		av_log(NULL, AV_LOG_FATAL, "-shm_slots must be at least 1\n");
+		exit(1);
+	}
+	if (soak_duration > 0) {
+		loop = 0;
+		soak.baseline_heap = get_heap_in_use();
+	}
+
+	if (vfilters)
+		vfilters_list = &vfilters;
+
+	if (deterministic) {
+		sws_flags |= SWS_BITEXACT | SWS_ACCURATE_RND;
+		av_dict_set(&sws_dict, "flags", "+bitexact+accurate_rnd", AV_DICT_APPEND);
+	}
 
 	flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
+	if (framecrc) {
+		/* decode both streams like an export, hashing instead of writing them */
+		if (framecrc_open(framecrc) < 0)
+			exit(1);
+		export_video = export_audio = framecrc;
+	}
+	if (export_video || export_audio) {
+		if (!framecrc &&
+		    ((export_video && export_open(&export_video_sink, export_video) < 0) ||
+		     (export_audio && export_open(&export_audio_sink, export_audio) < 0)))
+			exit(1);
+		/* decode as fast as the output takes it, no window, no clock */
+		flags = SDL_INIT_EVENTS | SDL_INIT_TIMER;
+		framedrop = 0;
+		autoexit = 1;
+	}
 
 	/* Try to work around an occasional ALSA buffer underflow issue when the
 	 * period size is NPOT due to ALSA resampling by forcing the buffer size. */
@@ -2331,6 +7559,17 @@ int main(int argc, char **argv)
 	av_init_packet(&flush_pkt);
 	flush_pkt.data = (uint8_t *)&flush_pkt;
 
+	/* before any client registers */
+	if (mem_budget_size > 0 && !(mem_budget.mutex = SDL_CreateMutex())) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+		do_exit(NULL);
+	}
+	if (hugepages)
+		frame_pool_enabled = 1;
+	if (frame_pool_enabled && frame_pool_init() < 0)
+		do_exit(NULL);
+
+	thread_stats_enter(THREAD_MAIN);
 	is = stream_open(input_filename, file_iformat);
 	if (!is) {
 		av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
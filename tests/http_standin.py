@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Local stand-in for a remote HTTP server, for the tests of the inputs
+ffplay reads over the network (-cache_dir, -abr).
+
+Serves a directory with byte range support, which python's http.server
+lacks, can throttle the files whose path matches a pattern, and logs one
+line per request: method, path, requested range, bytes sent.
+
+    http_standin.py DIR PORTFILE LOG [--throttle REGEX:BYTES_PER_SEC]...
+
+The port it listens on is written to PORTFILE once it accepts connections.
+"""
+
+import argparse
+import http.server
+import os
+import re
+import socketserver
+import sys
+import threading
+import time
+
+CHUNK = 16 * 1024
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def log_transfer(self, rng, sent):
+        with self.server.log_lock:
+            self.server.log.write('%s %s %s %d\n' % (self.command, self.path, rng or '-', sent))
+            self.server.log.flush()
+
+    def rate(self):
+        for pattern, rate in self.server.throttle:
+            if pattern.search(self.path):
+                return rate
+        return 0
+
+    def send_file(self, head):
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            self.send_error(404)
+            self.log_transfer(None, 0)
+            return
+        size = os.path.getsize(path)
+        start, end = 0, size - 1
+        rng = self.headers.get('Range')
+        m = re.match(r'bytes=(\d*)-(\d*)$', rng or '')
+        if m and (m.group(1) or m.group(2)):
+            if m.group(1):
+                start = int(m.group(1))
+                if m.group(2):
+                    end = min(int(m.group(2)), size - 1)
+            else:
+                start = max(size - int(m.group(2)), 0)
+            if start >= size:
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */%d' % size)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                self.log_transfer(rng, 0)
+                return
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, end, size))
+        else:
+            rng = None
+            self.send_response(200)
+        length = end - start + 1
+        self.send_header('Accept-Ranges', 'bytes')
+        self.send_header('Content-Type', self.guess_type(path))
+        self.send_header('Content-Length', str(length))
+        self.end_headers()
+        sent = 0
+        if not head:
+            rate = self.rate()
+            t0 = time.monotonic()
+            with open(path, 'rb') as f:
+                f.seek(start)
+                try:
+                    while sent < length:
+                        data = f.read(min(CHUNK, length - sent))
+                        if not data:
+                            break
+                        self.wfile.write(data)
+                        sent += len(data)
+                        if rate:
+                            delay = t0 + sent / rate - time.monotonic()
+                            if delay > 0:
+                                time.sleep(delay)
+                except (BrokenPipeError, ConnectionResetError):
+                    pass
+        self.log_transfer(rng, sent)
+
+    def do_GET(self):
+        self.send_file(False)
+
+    def do_HEAD(self):
+        self.send_file(True)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('dir')
+    parser.add_argument('portfile')
+    parser.add_argument('log')
+    parser.add_argument('--throttle', action='append', default=[])
+    args = parser.parse_args()
+
+    os.chdir(args.dir)
+    server = Server(('127.0.0.1', 0), Handler)
+    server.log = open(args.log, 'a')
+    server.log_lock = threading.Lock()
+    server.throttle = []
+    for t in args.throttle:
+        pattern, rate = t.rsplit(':', 1)
+        server.throttle.append((re.compile(pattern), float(rate)))
+    with open(args.portfile + '.tmp', 'w') as f:
+        f.write('%d\n' % server.server_address[1])
+    os.rename(args.portfile + '.tmp', args.portfile)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
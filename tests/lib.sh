@@ -0,0 +1,45 @@
+# Sourced by the tests. FFPLAY and FFMPEG select the binaries; the inputs
+# are generated with ffmpeg's lavfi sources and served by http_standin.py.
+# A test exits with 77 when something it needs is missing.
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+FFPLAY=${FFPLAY:-$TESTS/../ffplay}
+FFMPEG=${FFMPEG:-ffmpeg}
+
+tmp=$(mktemp -d)
+standin_pid=
+cleanup() {
+	[ -n "$standin_pid" ] && kill $standin_pid 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() { echo "FAIL: $*" >&2; exit 1; }
+skip() { echo "SKIP: $*" >&2; exit 77; }
+
+[ -x "$FFPLAY" ] || fail "$FFPLAY is not built"
+command -v "$FFMPEG" >/dev/null || skip "no $FFMPEG to generate the inputs"
+command -v python3 >/dev/null || skip "no python3 for the HTTP stand-in"
+
+# start_standin DIR [--throttle REGEX:BYTES_PER_SEC]...: serve DIR at $base
+start_standin() {
+	dir=$1
+	shift
+	rm -f "$tmp/port"
+	python3 "$TESTS/http_standin.py" "$dir" "$tmp/port" "$tmp/http.log" "$@" &
+	standin_pid=$!
+	i=0
+	while [ ! -s "$tmp/port" ]; do
+		i=$((i + 1))
+		[ $i -lt 100 ] || fail "the HTTP stand-in did not start"
+		sleep 0.1
+	done
+	base=http://127.0.0.1:$(cat "$tmp/port")
+}
+
+stop_standin() {
+	kill $standin_pid
+	wait $standin_pid 2>/dev/null || true
+	standin_pid=
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Run every test, 77 from a test means it was skipped.
+
+cd "$(dirname "$0")"
+pass=0 failed=0 skipped=0
+for t in test_*.sh; do
+	sh "$t" >"${t%.sh}.log" 2>&1
+	case $? in
+	0)  pass=$((pass + 1)); echo "PASS $t" ;;
+	77) skipped=$((skipped + 1)); echo "SKIP $t: $(tail -n 1 "${t%.sh}.log")" ;;
+	*)  failed=$((failed + 1)); echo "FAIL $t, see tests/${t%.sh}.log" ;;
+	esac
+done
+echo "$pass passed, $failed failed, $skipped skipped"
+[ $failed -eq 0 ]
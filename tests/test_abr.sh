@@ -0,0 +1,54 @@
+#!/bin/sh
+# -abr against the HTTP stand-in serving a generated three variant HLS
+# playlist whose top variant is throttled below its bitrate: ffplay must
+# switch down, and the frames of the variants it leaves must not reach the
+# decoders, so the pts of every stream keep increasing and no frame is
+# decoded twice.
+
+. "$(dirname "$0")/lib.sh"
+
+mkdir "$tmp/www"
+printf '#EXTM3U\n' >"$tmp/www/master.m3u8"
+for v in 0:320x180:200k:300000 1:640x360:600k:800000 2:1280x720:2000k:2400000; do
+	set -- $(echo $v | tr : ' ')
+	"$FFMPEG" -nostdin -loglevel error -f lavfi -i testsrc=size=$2:rate=25 \
+	          -f lavfi -i sine=frequency=440:sample_rate=48000 -t 20 \
+	          -c:v mpeg4 -b:v $3 -g 50 -c:a mp2 -ac 2 -b:a 128k \
+	          -f hls -hls_time 2 -hls_list_size 0 -hls_segment_filename "$tmp/www/v$1_%03d.ts" \
+	          "$tmp/www/v$1.m3u8" || fail "cannot generate variant $1"
+	printf '#EXT-X-STREAM-INF:BANDWIDTH=%d,RESOLUTION=%s\nv%d.m3u8\n' $4 $2 $1 \
+	       >>"$tmp/www/master.m3u8"
+done
+
+# 400 kbit/s for the 2 Mbit/s variant
+start_standin "$tmp/www" --throttle 'v2_.*\.ts:50000'
+
+"$FFPLAY" -abr -stats 0 -framecrc "$tmp/out.crc" "$base/master.m3u8" 2>"$tmp/out.log" ||
+	fail "$(tail -n 3 "$tmp/out.log")"
+
+grep -q 'abr: download too slow, switching' "$tmp/out.log" ||
+	fail "did not switch down: $(grep 'abr' "$tmp/out.log" | tail -n 3)"
+switches=$(sed -n 's/.*abr variant .*, \([0-9]*\) switches.*/\1/p' "$tmp/out.log" | tail -n 1)
+[ -n "$switches" ] && [ "$switches" -ge 1 ] || fail "no switch completed"
+
+# per stream: pts strictly increasing, then "stream <index> <frames>"
+awk -F', *' '
+	/^[0-9]/ {
+		if (($1 in last) && $2 + 0 <= last[$1]) {
+			printf "stream %s: pts %s after %s\n", $1, $2, last[$1]
+			bad = 1
+		}
+		last[$1] = $2 + 0
+		n[$1]++
+	}
+	END {
+		for (s in n)
+			printf "stream %s %d\n", s, n[s]
+		exit bad
+	}' "$tmp/out.crc" >"$tmp/order" || fail "$(head -n 3 "$tmp/order")"
+
+# the video has the fewest frames, mp2 frames last 24 ms; 20 s at 25 fps
+video_frames=$(awk '{ print $3 }' "$tmp/order" | sort -n | head -n 1)
+[ -n "$video_frames" ] && [ "$video_frames" -le 500 ] && [ "$video_frames" -ge 450 ] ||
+	fail "$video_frames video frames: $(cat "$tmp/order")"
+exit 0
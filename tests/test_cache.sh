@@ -0,0 +1,70 @@
+#!/bin/sh
+# -cache_dir against the HTTP stand-in: a replay is served from disk with
+# the same frames, a run killed midway keeps the blocks it cached, and
+# eviction skips an entity another process has locked.
+
+. "$(dirname "$0")/lib.sh"
+
+mkdir "$tmp/www"
+"$FFMPEG" -nostdin -loglevel error -f lavfi -i testsrc=size=320x240:rate=25 \
+          -f lavfi -i sine=frequency=440 -t 20 -c:v mpeg4 -q:v 2 -c:a mp2 \
+          "$tmp/www/a.mkv" || fail "cannot generate the input"
+cp "$tmp/www/a.mkv" "$tmp/www/b.mkv"
+
+# "cache: X MiB read from disk, Y MiB from the network" -> $disk $net
+cache_report() {
+	set -- $(sed -n 's/.*cache: \([0-9.]*\) MiB read from disk, \([0-9.]*\) MiB from the network.*/\1 \2/p' "$1" | tail -n 1)
+	[ $# -eq 2 ] || fail "no cache report"
+	disk=$1
+	net=$2
+}
+
+start_standin "$tmp/www"
+
+"$FFPLAY" -cache_dir "$tmp/cache" -framecrc "$tmp/1.crc" "$base/a.mkv" 2>"$tmp/1.log" ||
+	fail "first run: $(tail -n 3 "$tmp/1.log")"
+cache_report "$tmp/1.log"
+[ "$net" != "0.0" ] || fail "first run read nothing from the network"
+
+"$FFPLAY" -cache_dir "$tmp/cache" -framecrc "$tmp/2.crc" "$base/a.mkv" 2>"$tmp/2.log" ||
+	fail "replay: $(tail -n 3 "$tmp/2.log")"
+cache_report "$tmp/2.log"
+[ "$net" = "0.0" ] || fail "replay read $net MiB from the network"
+cmp -s "$tmp/1.crc" "$tmp/2.crc" || fail "replay decoded other frames"
+
+# the map is written as blocks complete, not on exit
+stop_standin
+start_standin "$tmp/www" --throttle 'b\.mkv:400000'
+"$FFPLAY" -cache_dir "$tmp/cache" -framecrc "$tmp/3.crc" "$base/b.mkv" 2>"$tmp/3.log" &
+pid=$!
+sleep 4
+kill -9 $pid
+wait $pid 2>/dev/null || true
+stop_standin
+start_standin "$tmp/www"
+"$FFPLAY" -cache_dir "$tmp/cache" -framecrc "$tmp/4.crc" "$base/b.mkv" 2>"$tmp/4.log" ||
+	fail "run after a kill: $(tail -n 3 "$tmp/4.log")"
+cache_report "$tmp/4.log"
+[ "$disk" != "0.0" ] || fail "the blocks cached before the kill were lost"
+cmp -s "$tmp/1.crc" "$tmp/4.crc" || fail "run after a kill decoded other frames"
+
+# a 1 MiB cache must evict a.mkv to play b.mkv, unless a.mkv is in use
+a_data=
+for f in "$tmp"/cache/*.data; do
+	cmp -s "$f" "$tmp/www/a.mkv" && a_data=$f
+done
+[ -n "$a_data" ] || fail "a.mkv is not fully cached"
+python3 -c 'import fcntl, sys, time
+f = open(sys.argv[1]); fcntl.flock(f, fcntl.LOCK_SH); print(flush=True); time.sleep(60)' \
+	"$a_data" >"$tmp/lock" &
+lock_pid=$!
+while [ ! -s "$tmp/lock" ]; do sleep 0.1; done
+"$FFPLAY" -cache_dir "$tmp/cache" -cache_size 1 -framecrc /dev/null "$base/b.mkv" 2>"$tmp/5.log" ||
+	fail "run with a small cache: $(tail -n 3 "$tmp/5.log")"
+[ -f "$a_data" ] && [ -f "${a_data%.data}.map" ] || fail "evicted an entity in use"
+kill $lock_pid
+wait $lock_pid 2>/dev/null || true
+"$FFPLAY" -cache_dir "$tmp/cache" -cache_size 1 -framecrc /dev/null "$base/b.mkv" 2>"$tmp/6.log" ||
+	fail "run with a small cache: $(tail -n 3 "$tmp/6.log")"
+[ ! -f "$a_data" ] || fail "did not evict an entity no longer in use"
+exit 0